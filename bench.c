@@ -0,0 +1,689 @@
+/* Benchmarks for the buddy allocator, compared against the C library malloc.
+ *
+ * Each benchmark is run twice per allocator: once untimed to measure
+ * throughput, and once timing every operation to measure the latency
+ * distribution, so that the cost of reading the clock does not show up in
+ * the throughput numbers. An operation is a single allocation or free.
+ *
+ * Other allocators can be compared by preloading them in place of malloc:
+ *
+ *     LD_PRELOAD=/usr/lib/libjemalloc.so ./bench -l jemalloc
+ *     LD_PRELOAD=/usr/lib/libmimalloc.so ./bench -l mimalloc
+ *
+ * Recorded workloads are replayed with -r, either from a recording made with
+ * BUDDY_RECORD or from a text file with one operation per line, where ids are
+ * small integers naming live allocations:
+ *
+ *     m <id> <size>
+ *     r <id> <size>
+ *     f <id>
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "buddy.h"
+
+// The pool geometry can be overridden to benchmark deep bit trees, e.g. BENCH_FLAGS="-DPOOL_LOG2=30 -DBUDDY_BLOCKED_TREE"
+#ifndef POOL_LOG2
+#define POOL_LOG2 26
+#endif
+#ifndef POOL_MIN_LOG2
+#define POOL_MIN_LOG2 4
+#endif
+#ifndef POOL_MAX_LOG2
+#define POOL_MAX_LOG2 20
+#endif
+
+// Number of live allocations kept by the churn benchmarks
+#define WINDOW 4096
+
+// Size used by the fixed size benchmarks
+#define FIXED_SIZE 64
+
+// Most blocks a merge cascade allocates before freeing them
+#define CASCADE_BLOCKS (1 << (POOL_MAX_LOG2 - POOL_MIN_LOG2))
+
+// Blocks the scattered lookup benchmark fills the pool with, which are 4 KiB in a 1 GiB pool
+#define SCATTER_BLOCKS ((size_t)1 << (POOL_LOG2 - POOL_MIN_LOG2 < 18 ? POOL_LOG2 - POOL_MIN_LOG2 : 18))
+
+// Benchmarks check the operation count between rounds, so a run may go this far past it
+#define OVERSHOOT (2 * (CASCADE_BLOCKS > WINDOW ? CASCADE_BLOCKS : WINDOW))
+
+struct allocator {
+    const char *name;
+    void *(*malloc)(void *, size_t);
+    void (*free)(void *, void *, size_t);
+    void *(*realloc)(void *, void *, size_t, size_t);
+    void (*reset)(void *);
+    void *ctx;
+};
+
+struct result {
+    size_t ops;
+    size_t failed;
+    uint64_t *latencies;
+    uint64_t elapsed;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs an allocator operation, recording its latency when the run is timed
+#define OP(r, expr) do { \
+    if ((r)->latencies) { \
+        uint64_t start_ = now_ns(); \
+        expr; \
+        (r)->latencies[(r)->ops] = now_ns() - start_; \
+    } else { \
+        expr; \
+    } \
+    (r)->ops++; \
+} while (0)
+
+static void *bench_malloc(const struct allocator *a, struct result *r, size_t size) {
+    void *p;
+    OP(r, p = a->malloc(a->ctx, size));
+    if (p) *(volatile char *)p = 1;
+    else r->failed++;
+    return p;
+}
+
+static void bench_free(const struct allocator *a, struct result *r, void *p, size_t size) {
+    if (!p) return;
+    OP(r, a->free(a->ctx, p, size));
+}
+
+static void *bench_realloc(const struct allocator *a, struct result *r, void *p, size_t size, size_t new_size) {
+    void *new_p;
+    OP(r, new_p = a->realloc(a->ctx, p, size, new_size));
+    if (!new_p && new_size) {
+        r->failed++;
+        a->free(a->ctx, p, size);
+    }
+    return new_p;
+}
+
+/* ALLOCATORS */
+static void *libc_malloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void libc_free(void *ctx, void *p, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(p);
+}
+
+static void *libc_realloc(void *ctx, void *p, size_t size, size_t new_size) {
+    (void)ctx;
+    (void)size;
+    return realloc(p, new_size);
+}
+
+static void libc_reset(void *ctx) {
+    (void)ctx;
+}
+
+struct buddy_pool {
+    char *memory;
+    char *meta;
+    size_t meta_size;
+    buddy_t *alloc;
+};
+
+static void *pool_malloc(void *ctx, size_t size) {
+    return buddy_malloc(((struct buddy_pool *)ctx)->alloc, size);
+}
+
+// A size of 0 frees the block without its size, as the C library does
+static void pool_free(void *ctx, void *p, size_t size) {
+    if (size == 0) buddy_free_unsized(((struct buddy_pool *)ctx)->alloc, p);
+    else buddy_free(((struct buddy_pool *)ctx)->alloc, p, size);
+}
+
+static void *pool_realloc(void *ctx, void *p, size_t size, size_t new_size) {
+    return buddy_realloc(((struct buddy_pool *)ctx)->alloc, p, size, new_size);
+}
+
+/* Starts every run from a freshly initialized pool. The metadata is kept out
+ * of band so that the whole pool is free blocks of the largest order, and the
+ * first allocation has to split one all the way down.
+ */
+static void pool_reset(void *ctx) {
+    struct buddy_pool *pool = ctx;
+
+    if (pool->alloc) buddy_destroy(pool->alloc);
+    pool->alloc = buddy_init_oob(pool->meta, pool->meta_size, pool->memory, (size_t)1 << POOL_LOG2, POOL_MIN_LOG2, POOL_MAX_LOG2);
+    if (!pool->alloc) {
+        fprintf(stderr, "buddy_init_oob: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* RANDOM NUMBERS */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Sizes are log-uniform between 16 bytes and 4 KiB, so small sizes dominate as in most programs
+static size_t random_size(uint64_t *state) {
+    uint64_t x = next_random(state);
+    size_t log2 = 4 + x % 9;
+    return ((size_t)1 << log2) + (x >> 8) % ((size_t)1 << log2);
+}
+
+/* BENCHMARKS */
+struct slot {
+    void *p;
+    size_t size;
+};
+
+// Thread caches serve the smallest orders, so worst case splits and merges use the first order above them
+static size_t uncached_size(void) {
+    #ifdef BUDDY_THREADS
+    return (size_t)1 << (POOL_MIN_LOG2 + BUDDY_CACHE_ORDERS);
+    #else
+    return (size_t)1 << POOL_MIN_LOG2;
+    #endif
+}
+
+static void run_slots(const struct allocator *a, struct result *r, size_t n, int random) {
+    static struct slot slots[WINDOW];
+    uint64_t state = 88172645463325252ull;
+
+    memset(slots, 0, sizeof(slots));
+    for (size_t i = 0; r->ops < n; i++) {
+        struct slot *s = &slots[random ? next_random(&state) % WINDOW : i % WINDOW];
+
+        bench_free(a, r, s->p, s->size);
+        s->size = random ? random_size(&state) : FIXED_SIZE;
+        s->p = bench_malloc(a, r, s->size);
+    }
+    for (size_t i = 0; i < WINDOW; i++) {
+        if (slots[i].p) a->free(a->ctx, slots[i].p, slots[i].size);
+    }
+}
+
+static void run_fixed(const struct allocator *a, struct result *r, size_t n) {
+    run_slots(a, r, n, 0);
+}
+
+static void run_random(const struct allocator *a, struct result *r, size_t n) {
+    run_slots(a, r, n, 1);
+}
+
+static void run_order(const struct allocator *a, struct result *r, size_t n, int lifo) {
+    static void *blocks[WINDOW];
+
+    while (r->ops < n) {
+        for (size_t i = 0; i < WINDOW; i++) blocks[i] = bench_malloc(a, r, FIXED_SIZE);
+        for (size_t i = 0; i < WINDOW; i++) bench_free(a, r, blocks[lifo ? WINDOW - 1 - i : i], FIXED_SIZE);
+    }
+}
+
+static void run_lifo(const struct allocator *a, struct result *r, size_t n) {
+    run_order(a, r, n, 1);
+}
+
+static void run_fifo(const struct allocator *a, struct result *r, size_t n) {
+    run_order(a, r, n, 0);
+}
+
+// Every allocation splits a block of the largest order down to the smallest, and every free merges it back
+static void run_split(const struct allocator *a, struct result *r, size_t n) {
+    size_t size = uncached_size();
+
+    while (r->ops < n) {
+        void *p = bench_malloc(a, r, size);
+        bench_free(a, r, p, size);
+    }
+}
+
+// Fills a block of the largest order with small blocks, then frees them so that the last free merges all the way up
+static void run_merge(const struct allocator *a, struct result *r, size_t n) {
+    static void *blocks[CASCADE_BLOCKS];
+    size_t size = uncached_size();
+    size_t count = ((size_t)1 << POOL_MAX_LOG2) / size;
+
+    while (r->ops < n) {
+        for (size_t i = 0; i < count; i++) blocks[i] = bench_malloc(a, r, size);
+        for (size_t i = 0; i < count; i++) bench_free(a, r, blocks[i], size);
+    }
+}
+
+/* Fills the pool with blocks, untimed, then frees one without its size and
+ * allocates it again, in a scattered order. The buddy of every freed block is
+ * allocated so nothing merges, and the time goes to looking up the order of
+ * the block, which climbs the bit tree from the smallest order far from the
+ * previous climb. The order multiplies by an odd constant, which visits every
+ * block once since the count is a power of 2.
+ */
+static void run_scatter(const struct allocator *a, struct result *r, size_t n) {
+    static void *blocks[SCATTER_BLOCKS];
+    size_t size = ((size_t)1 << POOL_LOG2) / SCATTER_BLOCKS;
+
+    if (size < uncached_size()) size = uncached_size();
+    size_t count = ((size_t)1 << POOL_LOG2) / size;
+    for (size_t i = 0; i < count; i++) blocks[i] = a->malloc(a->ctx, size);
+
+    for (size_t i = 0; r->ops < n; i++) {
+        size_t j = (i * 0x9e3779b97f4a7c15ull) & (count - 1);
+        bench_free(a, r, blocks[j], 0);
+        blocks[j] = bench_malloc(a, r, size);
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (blocks[i]) a->free(a->ctx, blocks[i], size);
+    }
+}
+
+struct benchmark {
+    const char *name;
+    void (*run)(const struct allocator *, struct result *, size_t);
+};
+
+static const struct benchmark benchmarks[] = {
+    {"fixed_churn", run_fixed},
+    {"random_churn", run_random},
+    {"lifo", run_lifo},
+    {"fifo", run_fifo},
+    {"split_max", run_split},
+    {"merge_cascade", run_merge},
+    {"unsized_scatter", run_scatter},
+};
+
+/* REPORTING */
+static int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void report(const char *benchmark, const char *allocator, const struct result *throughput, struct result *latency) {
+    qsort(latency->latencies, latency->ops, sizeof(uint64_t), compare_latencies);
+
+    printf("%-16s %-12s %14.0f %8llu %8llu %8llu",
+        benchmark, allocator, throughput->ops * 1e9 / (throughput->elapsed ? throughput->elapsed : 1),
+        (unsigned long long)percentile(latency->latencies, latency->ops, 0.5),
+        (unsigned long long)percentile(latency->latencies, latency->ops, 0.99),
+        (unsigned long long)percentile(latency->latencies, latency->ops, 0.999));
+    if (throughput->failed) printf("  (%zu failed)", throughput->failed);
+    printf("\n");
+}
+
+static void print_header(void) {
+    printf("%-16s %-12s %14s %8s %8s %8s\n", "benchmark", "allocator", "ops/s", "p50 ns", "p99 ns", "p999 ns");
+}
+
+static void run_benchmark(const struct benchmark *b, const struct allocator *a, size_t n) {
+    struct result throughput = {0}, latency = {0};
+
+    latency.latencies = malloc((n + OVERSHOOT) * sizeof(uint64_t));
+    if (!latency.latencies) {
+        perror("malloc");
+        exit(1);
+    }
+
+    a->reset(a->ctx);
+    uint64_t start = now_ns();
+    b->run(a, &throughput, n);
+    throughput.elapsed = now_ns() - start;
+
+    a->reset(a->ctx);
+    b->run(a, &latency, n);
+
+    report(b->name, a->name, &throughput, &latency);
+    free(latency.latencies);
+}
+
+/* MULTI-THREADED */
+struct worker {
+    pthread_t thread;
+    const struct allocator *alloc;
+    pthread_barrier_t *barrier;
+    struct result result;
+    size_t n;
+    uint64_t seed;
+};
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct slot slots[256] = {{0}};
+    uint64_t state = w->seed;
+
+    pthread_barrier_wait(w->barrier);
+    while (w->result.ops < w->n) {
+        struct slot *s = &slots[next_random(&state) % 256];
+
+        bench_free(w->alloc, &w->result, s->p, s->size);
+        s->size = random_size(&state);
+        s->p = bench_malloc(w->alloc, &w->result, s->size);
+    }
+    for (size_t i = 0; i < 256; i++) {
+        if (slots[i].p) w->alloc->free(w->alloc->ctx, slots[i].p, slots[i].size);
+    }
+    pthread_barrier_wait(w->barrier);
+    return NULL;
+}
+
+static void run_threads(const struct allocator *a, size_t n, int threads, int timed, struct result *total) {
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    pthread_barrier_t barrier;
+
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    for (int i = 0; i < threads; i++) {
+        workers[i].alloc = a;
+        workers[i].barrier = &barrier;
+        workers[i].n = n / threads;
+        workers[i].seed = 88172645463325252ull + i;
+        if (timed) workers[i].result.latencies = malloc((workers[i].n + 2) * sizeof(uint64_t));
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    uint64_t start = now_ns();
+    pthread_barrier_wait(&barrier);
+    total->elapsed = now_ns() - start;
+
+    if (timed) total->latencies = malloc((n + threads * 2) * sizeof(uint64_t));
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (timed) {
+            memcpy(total->latencies + total->ops, workers[i].result.latencies, workers[i].result.ops * sizeof(uint64_t));
+            free(workers[i].result.latencies);
+        }
+        total->ops += workers[i].result.ops;
+        total->failed += workers[i].result.failed;
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+}
+
+static void run_contention(const struct allocator *a, size_t n, int threads) {
+    struct result throughput = {0}, latency = {0};
+    char name[32];
+
+    a->reset(a->ctx);
+    run_threads(a, n, threads, 0, &throughput);
+    a->reset(a->ctx);
+    run_threads(a, n, threads, 1, &latency);
+
+    snprintf(name, sizeof(name), "threads/%d", threads);
+    report(name, a->name, &throughput, &latency);
+    free(latency.latencies);
+}
+
+/* REPLAY */
+struct trace_op {
+    size_t id;
+    size_t size;
+    char op;
+};
+
+struct trace {
+    struct trace_op *ops;
+    size_t count;
+    size_t capacity;
+    size_t ids;
+};
+
+static int push_op(struct trace *t, char op, size_t id, size_t size) {
+    if (t->count == t->capacity) {
+        size_t capacity = t->capacity ? t->capacity * 2 : 4096;
+        struct trace_op *ops = realloc(t->ops, capacity * sizeof(struct trace_op));
+        if (!ops) return -1;
+
+        t->ops = ops;
+        t->capacity = capacity;
+    }
+
+    t->ops[t->count++] = (struct trace_op){id, size, op};
+    if (id >= t->ids) t->ids = id + 1;
+    return 0;
+}
+
+static int load_text(FILE *f, struct trace *t) {
+    char line[256];
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long id, size = 0;
+        char op;
+
+        if (sscanf(line, " m %llu %llu", &id, &size) == 2) op = 'm';
+        else if (sscanf(line, " r %llu %llu", &id, &size) == 2) op = 'r';
+        else if (sscanf(line, " f %llu", &id) == 1) op = 'f';
+        else continue;
+
+        if (push_op(t, op, id, size) != 0) return -1;
+    }
+    return 0;
+}
+
+static int compare_records(const void *a, const void *b) {
+    const struct buddy_record *x = a, *y = b;
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    return (x > y) - (x < y);
+}
+
+/* Converts a binary recording into trace operations. Records are ordered by
+ * time, and live blocks are named by their offset from the pool base, so each
+ * allocation is given a new id that later operations on its offset refer to.
+ * Operations on blocks allocated before the recording started are dropped,
+ * as are failed allocations.
+ */
+static int load_recording(FILE *f, struct trace *t) {
+    struct buddy_record_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.version != BUDDY_RECORD_VERSION
+            || header.record_size != sizeof(struct buddy_record)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct buddy_record *records = NULL;
+    size_t count = 0, capacity = 0;
+    for (;;) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            struct buddy_record *grown = realloc(records, capacity * sizeof(struct buddy_record));
+            if (!grown) {
+                free(records);
+                return -1;
+            }
+            records = grown;
+        }
+
+        size_t read = fread(records + count, sizeof(struct buddy_record), capacity - count, f);
+        count += read;
+        if (count < capacity) break;
+    }
+
+    qsort(records, count, sizeof(struct buddy_record), compare_records);
+
+    // Open addressing table from offset to the id of the block allocated there, SIZE_MAX once freed
+    size_t buckets = 16;
+    while (buckets < count * 2) buckets *= 2;
+    uint64_t *offsets = malloc(buckets * sizeof(uint64_t));
+    size_t *ids = malloc(buckets * sizeof(size_t));
+    if (!offsets || !ids) {
+        free(records);
+        free(offsets);
+        free(ids);
+        return -1;
+    }
+    memset(offsets, 0xff, buckets * sizeof(uint64_t));
+
+    int ret = 0;
+    size_t next_id = 0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        const struct buddy_record *r = &records[i];
+        if (r->offset == BUDDY_RECORD_FAILED) continue;
+
+        size_t b = (r->offset * 0x9e3779b97f4a7c15ull) & (buckets - 1);
+        while (offsets[b] != UINT64_MAX && offsets[b] != r->offset) b = (b + 1) & (buckets - 1);
+
+        if (r->op == BUDDY_RECORD_MALLOC) {
+            offsets[b] = r->offset;
+            ids[b] = next_id++;
+            ret = push_op(t, 'm', ids[b], r->size);
+        } else if (offsets[b] != UINT64_MAX && ids[b] != SIZE_MAX) {
+            if (r->op == BUDDY_RECORD_REALLOC) {
+                ret = push_op(t, 'r', ids[b], r->size);
+            } else {
+                ret = push_op(t, 'f', ids[b], 0);
+                ids[b] = SIZE_MAX;
+            }
+        }
+    }
+
+    free(records);
+    free(offsets);
+    free(ids);
+    return ret;
+}
+
+// Loads a binary recording if the file starts with its magic, and a text trace otherwise
+static int load_trace(const char *path, struct trace *t) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    memset(t, 0, sizeof(*t));
+
+    char magic[8];
+    int binary = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, BUDDY_RECORD_MAGIC, sizeof(magic)) == 0;
+    rewind(f);
+
+    int ret = binary ? load_recording(f, t) : load_text(f, t);
+    fclose(f);
+    return ret;
+}
+
+static void run_trace(const struct allocator *a, struct result *r, const struct trace *t) {
+    struct slot *live = calloc(t->ids, sizeof(struct slot));
+
+    for (size_t i = 0; i < t->count; i++) {
+        const struct trace_op *op = &t->ops[i];
+        struct slot *s = &live[op->id];
+
+        if (op->op == 'm') {
+            // An id allocated twice without a free leaks the first allocation in the trace, so free it here
+            if (s->p) a->free(a->ctx, s->p, s->size);
+            s->size = op->size;
+            s->p = bench_malloc(a, r, s->size);
+        } else if (op->op == 'r') {
+            if (!s->p) continue;
+            s->p = bench_realloc(a, r, s->p, s->size, op->size);
+            s->size = op->size;
+        } else {
+            bench_free(a, r, s->p, s->size);
+            s->p = NULL;
+        }
+    }
+    for (size_t i = 0; i < t->ids; i++) {
+        if (live[i].p) a->free(a->ctx, live[i].p, live[i].size);
+    }
+    free(live);
+}
+
+static void replay(const struct allocator *a, const struct trace *t) {
+    struct result throughput = {0}, latency = {0};
+
+    latency.latencies = malloc((t->count + 1) * sizeof(uint64_t));
+
+    a->reset(a->ctx);
+    uint64_t start = now_ns();
+    run_trace(a, &throughput, t);
+    throughput.elapsed = now_ns() - start;
+
+    a->reset(a->ctx);
+    run_trace(a, &latency, t);
+
+    report("replay", a->name, &throughput, &latency);
+    free(latency.latencies);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n ops] [-t threads] [-l malloc label] [-r trace] [benchmark]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t n = 1000000;
+    int threads = 4;
+    const char *label = "libc";
+    const char *trace_path = NULL;
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) n = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) label = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) trace_path = argv[++i];
+        else if (argv[i][0] != '-') filter = argv[i];
+        else usage(argv[0]);
+    }
+    if (n == 0 || threads <= 0) usage(argv[0]);
+
+    struct buddy_pool pool = {0};
+    pool.memory = aligned_alloc((size_t)1 << POOL_MAX_LOG2, (size_t)1 << POOL_LOG2);
+    pool.meta_size = buddy_metadata_size(pool.memory, (size_t)1 << POOL_LOG2, POOL_MIN_LOG2, POOL_MAX_LOG2);
+    pool.meta = malloc(pool.meta_size);
+    if (!pool.memory || !pool.meta) {
+        perror("malloc");
+        return 1;
+    }
+
+    const struct allocator allocators[] = {
+        {"buddy", pool_malloc, pool_free, pool_realloc, pool_reset, &pool},
+        {label, libc_malloc, libc_free, libc_realloc, libc_reset, NULL},
+    };
+    const size_t count = sizeof(allocators) / sizeof(allocators[0]);
+
+    print_header();
+
+    if (trace_path) {
+        struct trace t;
+        if (load_trace(trace_path, &t) != 0) {
+            perror(trace_path);
+            return 1;
+        }
+        for (size_t i = 0; i < count; i++) replay(&allocators[i], &t);
+        free(t.ops);
+    } else {
+        for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+            if (filter && strcmp(filter, benchmarks[b].name) != 0) continue;
+            for (size_t i = 0; i < count; i++) run_benchmark(&benchmarks[b], &allocators[i], n);
+        }
+
+        if (!filter || strcmp(filter, "threads") == 0) {
+            #ifdef BUDDY_THREADS
+            run_contention(&allocators[0], n, threads);
+            #else
+            printf("%-16s %-12s (requires BUDDY_THREADS)\n", "threads", "buddy");
+            #endif
+            run_contention(&allocators[1], n, threads);
+        }
+    }
+
+    if (pool.alloc) buddy_destroy(pool.alloc);
+    free(pool.memory);
+    free(pool.meta);
+    return 0;
+}
\ No newline at end of file
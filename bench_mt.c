@@ -0,0 +1,591 @@
+/* Multi-threaded benchmarks for the thread-safe configurations of the buddy
+ * allocator, compared against the C library malloc.
+ *
+ * Every workload is run with 1, 2, 4 and so on up to the maximum number of
+ * threads, splitting the same number of operations between them, so that the
+ * throughput of each thread count shows how the configuration scales. As in
+ * bench.c, each run is repeated with every operation timed to measure the
+ * latency distribution, whose tail shows the time threads wait on locks.
+ *
+ * The workloads are:
+ *
+ *     local    each thread allocates and frees its own blocks
+ *     handoff  each thread allocates blocks that the next thread frees
+ *     mixed    sizes up to 64 KiB, with reallocations
+ *
+ * After every run, once all blocks are freed and the threads have exited, the
+ * free blocks counted in the bit tree by buddy_census are compared with the
+ * free lists counted by buddy_stats. A pool that does not add up is reported
+ * and makes the benchmark exit with status 1.
+ *
+ * The configuration is chosen at build time, and make bench-mt builds one
+ * benchmark per configuration: a single lock without thread caches, thread
+ * caches and per-thread arenas, and per-order locks.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "buddy.h"
+
+#ifndef BUDDY_THREADS
+#error "bench_mt needs a thread-safe configuration, such as BUDDY_THREADS"
+#endif
+
+// The pool is large enough for the live blocks of the largest thread count
+#ifndef POOL_LOG2
+#define POOL_LOG2 28
+#endif
+#ifndef POOL_MIN_LOG2
+#define POOL_MIN_LOG2 4
+#endif
+#ifndef POOL_MAX_LOG2
+#define POOL_MAX_LOG2 20
+#endif
+#ifndef ARENA_LOG2
+#define ARENA_LOG2 20
+#endif
+
+#if defined(BUDDY_ATOMIC)
+#define POOL_MODE "atomic"
+#elif BUDDY_CACHE_ORDERS == 0
+#define POOL_MODE "lock"
+#else
+#define POOL_MODE "magazines"
+#endif
+
+// Number of live allocations kept by each thread
+#define SLOTS 128
+
+// Blocks in flight from a thread to the next in the handoff workload, a power of 2
+#define INBOX 256
+
+#define MAX_THREADS 64
+
+struct allocator {
+    const char *name;
+    void *(*malloc)(void *, size_t);
+    void (*free)(void *, void *, size_t);
+    void *(*realloc)(void *, void *, size_t, size_t);
+    void (*reset)(void *);
+    int (*check)(void *);
+    void *ctx;
+};
+
+struct result {
+    size_t ops;
+    size_t failed;
+    uint64_t *latencies;
+    uint64_t elapsed;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs an allocator operation, recording its latency when the run is timed
+#define OP(r, expr) do { \
+    if ((r)->latencies) { \
+        uint64_t start_ = now_ns(); \
+        expr; \
+        (r)->latencies[(r)->ops] = now_ns() - start_; \
+    } else { \
+        expr; \
+    } \
+    (r)->ops++; \
+} while (0)
+
+static void *bench_malloc(const struct allocator *a, struct result *r, size_t size) {
+    void *p;
+    OP(r, p = a->malloc(a->ctx, size));
+    if (p) *(volatile char *)p = 1;
+    else r->failed++;
+    return p;
+}
+
+static void bench_free(const struct allocator *a, struct result *r, void *p, size_t size) {
+    if (!p) return;
+    OP(r, a->free(a->ctx, p, size));
+}
+
+static void *bench_realloc(const struct allocator *a, struct result *r, void *p, size_t size, size_t new_size) {
+    void *new_p;
+    OP(r, new_p = a->realloc(a->ctx, p, size, new_size));
+    if (!new_p) {
+        r->failed++;
+        a->free(a->ctx, p, size);
+    }
+    return new_p;
+}
+
+/* ALLOCATORS */
+static void *libc_malloc(void *ctx, size_t size) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void libc_free(void *ctx, void *p, size_t size) {
+    (void)ctx;
+    (void)size;
+    free(p);
+}
+
+static void *libc_realloc(void *ctx, void *p, size_t size, size_t new_size) {
+    (void)ctx;
+    (void)size;
+    return realloc(p, new_size);
+}
+
+static void libc_reset(void *ctx) {
+    (void)ctx;
+}
+
+struct buddy_pool {
+    char *memory;
+    char *meta;
+    size_t meta_size;
+    buddy_t *alloc;
+    #ifdef BUDDY_THREAD_ARENAS
+    buddy_thread_arenas_t *arenas;
+    #endif
+    // Census of the fresh pool, whose allocated blocks are the memory reserved around it
+    struct buddy_census initial;
+};
+
+static void *pool_malloc(void *ctx, size_t size) {
+    return buddy_malloc(((struct buddy_pool *)ctx)->alloc, size);
+}
+
+static void pool_free(void *ctx, void *p, size_t size) {
+    buddy_free(((struct buddy_pool *)ctx)->alloc, p, size);
+}
+
+static void *pool_realloc(void *ctx, void *p, size_t size, size_t new_size) {
+    return buddy_realloc(((struct buddy_pool *)ctx)->alloc, p, size, new_size);
+}
+
+// Starts every run from a freshly initialized pool, with the metadata out of band as in bench.c
+static void pool_reset(void *ctx) {
+    struct buddy_pool *pool = ctx;
+
+    #ifdef BUDDY_THREAD_ARENAS
+    if (pool->arenas) buddy_thread_arenas_destroy(pool->arenas);
+    pool->arenas = NULL;
+    #endif
+    if (pool->alloc) buddy_destroy(pool->alloc);
+    pool->alloc = buddy_init_oob(pool->meta, pool->meta_size, pool->memory, (size_t)1 << POOL_LOG2, POOL_MIN_LOG2, POOL_MAX_LOG2);
+    if (!pool->alloc) {
+        fprintf(stderr, "buddy_init_oob: %s\n", strerror(errno));
+        exit(1);
+    }
+    buddy_census(pool->alloc, &pool->initial);
+}
+
+/* Checks a pool after a run, once every block is freed and the thread caches
+ * are returned. The bit tree must have no allocated block left other than the
+ * reserved memory of the fresh pool and, with BUDDY_SLAB, the empty slab each
+ * size class keeps, and its free blocks must be the ones in the free lists.
+ */
+static int pool_check(void *ctx) {
+    struct buddy_pool *pool = ctx;
+    struct buddy_stats stats;
+    struct buddy_census census;
+    size_t retained[BUDDY_MAX_ORDERS] = { 0 };
+    size_t retained_bytes = 0;
+    int ok = 1;
+
+    #ifdef BUDDY_THREAD_ARENAS
+    // Arenas are blocks of the pool until they are destroyed
+    if (pool->arenas) buddy_thread_arenas_destroy(pool->arenas);
+    pool->arenas = NULL;
+    #endif
+    #ifdef BUDDY_LAZY_MERGE
+    buddy_coalesce(pool->alloc);
+    #endif
+
+    #ifdef BUDDY_SLAB
+    // The only slab of a class is kept once its last object is freed, and stays a block in use
+    for (int i = 0; i < BUDDY_SLAB_CLASSES; i++) {
+        if (pool->alloc->slab_classes[i].partial == NULL) continue;
+
+        retained[pool->alloc->slab_log2 - pool->alloc->min_log2]++;
+        retained_bytes += (size_t)1 << pool->alloc->slab_log2;
+    }
+    #endif
+
+    buddy_stats(pool->alloc, &stats);
+    buddy_census(pool->alloc, &census);
+
+    if (stats.bytes_in_use != retained_bytes) {
+        fprintf(stderr, "%zu bytes still in use\n", stats.bytes_in_use - retained_bytes);
+        ok = 0;
+    }
+    for (int i = 0; i < BUDDY_MAX_ORDERS; i++) {
+        size_t expected = pool->initial.allocated[i] + retained[i];
+
+        if (census.allocated[i] != expected || census.free[i] != stats.free_blocks[i]) {
+            fprintf(stderr, "order %d: %zu allocated and %zu free in the bit tree, %zu in the free lists\n",
+                i, census.allocated[i] - expected, census.free[i], stats.free_blocks[i]);
+            ok = 0;
+        }
+    }
+    return ok ? 0 : -1;
+}
+
+#ifdef BUDDY_THREAD_ARENAS
+static void *arena_malloc(void *ctx, size_t size) {
+    return buddy_thread_malloc(((struct buddy_pool *)ctx)->arenas, size);
+}
+
+static void arena_free(void *ctx, void *p, size_t size) {
+    buddy_thread_free(((struct buddy_pool *)ctx)->arenas, p, size);
+}
+
+// Arenas have no realloc, so every reallocation moves the block
+static void *arena_realloc(void *ctx, void *p, size_t size, size_t new_size) {
+    void *new_p = arena_malloc(ctx, new_size);
+    if (new_p) {
+        memcpy(new_p, p, size < new_size ? size : new_size);
+        arena_free(ctx, p, size);
+    }
+    return new_p;
+}
+
+static void arena_reset(void *ctx) {
+    struct buddy_pool *pool = ctx;
+
+    pool_reset(ctx);
+    pool->arenas = buddy_thread_arenas_create(pool->alloc, ARENA_LOG2);
+    if (!pool->arenas) {
+        fprintf(stderr, "buddy_thread_arenas_create: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+#endif
+
+/* RANDOM NUMBERS */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Sizes are log-uniform between 16 bytes and 2^max_log2 times 2
+static size_t random_size(uint64_t *state, size_t max_log2) {
+    uint64_t x = next_random(state);
+    size_t log2 = 4 + x % (max_log2 - 3);
+    return ((size_t)1 << log2) + (x >> 8) % ((size_t)1 << log2);
+}
+
+/* WORKLOADS */
+struct slot {
+    void *p;
+    size_t size;
+};
+
+/* Blocks handed from a thread to the next. Only the thread before writes the
+ * tail and only the thread itself writes the head, each on its own cache line.
+ */
+struct inbox {
+    void *blocks[INBOX];
+    size_t head;
+    char pad[64 - sizeof(size_t)];
+    size_t tail;
+};
+
+struct worker {
+    pthread_t thread;
+    const struct allocator *alloc;
+    pthread_barrier_t *barrier;
+    pthread_barrier_t *drain;
+    struct inbox *inboxes;
+    void (*run)(struct worker *);
+    struct result result;
+    uint64_t start;
+    uint64_t end;
+    size_t n;
+    uint64_t seed;
+    int id;
+    int threads;
+};
+
+static int inbox_push(struct inbox *in, void *p) {
+    size_t tail = __atomic_load_n(&in->tail, __ATOMIC_RELAXED);
+    if (tail - __atomic_load_n(&in->head, __ATOMIC_ACQUIRE) == INBOX) return 0;
+
+    in->blocks[tail % INBOX] = p;
+    __atomic_store_n(&in->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *inbox_pop(struct inbox *in) {
+    size_t head = __atomic_load_n(&in->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) return NULL;
+
+    void *p = in->blocks[head % INBOX];
+    __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+    return p;
+}
+
+static void free_slots(const struct allocator *a, struct slot *slots) {
+    for (size_t i = 0; i < SLOTS; i++) {
+        if (slots[i].p) a->free(a->ctx, slots[i].p, slots[i].size);
+    }
+}
+
+static void run_local(struct worker *w) {
+    const struct allocator *a = w->alloc;
+    struct slot slots[SLOTS] = {{0}};
+    uint64_t state = w->seed;
+
+    while (w->result.ops < w->n) {
+        struct slot *s = &slots[next_random(&state) % SLOTS];
+
+        bench_free(a, &w->result, s->p, s->size);
+        s->size = random_size(&state, 12);
+        s->p = bench_malloc(a, &w->result, s->size);
+    }
+    free_slots(a, slots);
+}
+
+/* Passes every block to the next thread, which frees it, as in a pipeline.
+ * The size travels in the block, so freeing it also pulls in its cache line.
+ * Blocks that do not fit in the next thread's inbox are freed locally.
+ */
+static void run_handoff(struct worker *w) {
+    const struct allocator *a = w->alloc;
+    struct inbox *in = &w->inboxes[w->id];
+    struct inbox *out = &w->inboxes[(w->id + 1) % w->threads];
+    uint64_t state = w->seed;
+
+    while (w->result.ops < w->n) {
+        size_t size = random_size(&state, 12);
+        size_t *p = bench_malloc(a, &w->result, size);
+        if (p) {
+            *p = size;
+            if (!inbox_push(out, p)) bench_free(a, &w->result, p, size);
+        }
+
+        size_t *q = inbox_pop(in);
+        if (q) bench_free(a, &w->result, q, *q);
+    }
+
+    // The thread before may still be pushing until every thread is done
+    pthread_barrier_wait(w->drain);
+    for (size_t *q; (q = inbox_pop(in)) != NULL;) a->free(a->ctx, q, *q);
+}
+
+static void run_mixed(struct worker *w) {
+    const struct allocator *a = w->alloc;
+    struct slot slots[SLOTS] = {{0}};
+    uint64_t state = w->seed;
+
+    while (w->result.ops < w->n) {
+        struct slot *s = &slots[next_random(&state) % SLOTS];
+        size_t size = random_size(&state, 16);
+
+        if (!s->p) {
+            s->p = bench_malloc(a, &w->result, size);
+            s->size = size;
+        } else if (next_random(&state) % 4 == 0) {
+            bench_free(a, &w->result, s->p, s->size);
+            s->p = NULL;
+        } else {
+            s->p = bench_realloc(a, &w->result, s->p, s->size, size);
+            s->size = size;
+        }
+    }
+    free_slots(a, slots);
+}
+
+struct workload {
+    const char *name;
+    void (*run)(struct worker *);
+};
+
+static const struct workload workloads[] = {
+    {"local", run_local},
+    {"handoff", run_handoff},
+    {"mixed", run_mixed},
+};
+
+/* REPORTING */
+static int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+static double get_throughput(const struct result *r) {
+    return r->ops * 1e9 / (r->elapsed ? r->elapsed : 1);
+}
+
+static void report(const char *workload, const char *allocator, int threads, double base, const struct result *throughput,
+        struct result *latency, int consistent) {
+    qsort(latency->latencies, latency->ops, sizeof(uint64_t), compare_latencies);
+
+    printf("%-10s %-10s %7d %14.0f %8.2f %8llu %8llu %8llu",
+        workload, allocator, threads, get_throughput(throughput), base ? get_throughput(throughput) / base : 1.0,
+        (unsigned long long)percentile(latency->latencies, latency->ops, 0.5),
+        (unsigned long long)percentile(latency->latencies, latency->ops, 0.99),
+        (unsigned long long)percentile(latency->latencies, latency->ops, 0.999));
+    if (throughput->failed) printf("  (%zu failed)", throughput->failed);
+    if (!consistent) printf("  (inconsistent)");
+    printf("\n");
+}
+
+static void print_header(void) {
+    printf("%-10s %-10s %7s %14s %8s %8s %8s %8s\n", "workload", "allocator", "threads", "ops/s", "scaling", "p50 ns", "p99 ns", "p999 ns");
+}
+
+/* RUNS */
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+
+    pthread_barrier_wait(w->barrier);
+    w->start = now_ns();
+    w->run(w);
+    w->end = now_ns();
+    return NULL;
+}
+
+static void run_threads(const struct workload *workload, const struct allocator *a, size_t n, int threads, int timed, struct result *total) {
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    struct inbox *inboxes = calloc(threads, sizeof(struct inbox));
+    pthread_barrier_t barrier, drain;
+
+    if (!workers || !inboxes) {
+        perror("calloc");
+        exit(1);
+    }
+
+    pthread_barrier_init(&barrier, NULL, threads);
+    pthread_barrier_init(&drain, NULL, threads);
+    for (int i = 0; i < threads; i++) {
+        workers[i].alloc = a;
+        workers[i].barrier = &barrier;
+        workers[i].drain = &drain;
+        workers[i].inboxes = inboxes;
+        workers[i].run = workload->run;
+        workers[i].n = n / threads;
+        workers[i].seed = 88172645463325252ull + i;
+        workers[i].id = i;
+        workers[i].threads = threads;
+        // A handoff iteration may free two blocks after its allocation
+        if (timed) workers[i].result.latencies = malloc((workers[i].n + 3) * sizeof(uint64_t));
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    }
+
+    // Threads are timed themselves, since on few cores they may be done before the main thread runs again
+    uint64_t start = UINT64_MAX, end = 0;
+    if (timed) total->latencies = malloc((n + threads * 3) * sizeof(uint64_t));
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (timed) {
+            memcpy(total->latencies + total->ops, workers[i].result.latencies, workers[i].result.ops * sizeof(uint64_t));
+            free(workers[i].result.latencies);
+        }
+        total->ops += workers[i].result.ops;
+        total->failed += workers[i].result.failed;
+        if (workers[i].start < start) start = workers[i].start;
+        if (workers[i].end > end) end = workers[i].end;
+    }
+    total->elapsed = end - start;
+
+    pthread_barrier_destroy(&barrier);
+    pthread_barrier_destroy(&drain);
+    free(inboxes);
+    free(workers);
+}
+
+// Returns the throughput of the run, so later thread counts are reported relative to a single thread
+static double run_workload(const struct workload *workload, const struct allocator *a, size_t n, int threads, double base,
+        int *consistent) {
+    struct result throughput = {0}, latency = {0};
+    int ok = 1;
+
+    a->reset(a->ctx);
+    run_threads(workload, a, n, threads, 0, &throughput);
+    if (a->check && a->check(a->ctx) != 0) ok = 0;
+
+    a->reset(a->ctx);
+    run_threads(workload, a, n, threads, 1, &latency);
+    if (a->check && a->check(a->ctx) != 0) ok = 0;
+
+    report(workload->name, a->name, threads, base, &throughput, &latency, ok);
+    free(latency.latencies);
+
+    if (!ok) *consistent = 0;
+    return get_throughput(&throughput);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n ops] [-t max threads] [-l malloc label] [workload]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t n = 1000000;
+    int max_threads = MAX_THREADS;
+    const char *label = "libc";
+    const char *filter = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) n = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) max_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) label = argv[++i];
+        else if (argv[i][0] != '-') filter = argv[i];
+        else usage(argv[0]);
+    }
+    if (n == 0 || max_threads <= 0 || max_threads > MAX_THREADS) usage(argv[0]);
+
+    struct buddy_pool pool = {0};
+    pool.memory = aligned_alloc((size_t)1 << POOL_MAX_LOG2, (size_t)1 << POOL_LOG2);
+    pool.meta_size = buddy_metadata_size(pool.memory, (size_t)1 << POOL_LOG2, POOL_MIN_LOG2, POOL_MAX_LOG2);
+    pool.meta = malloc(pool.meta_size);
+    if (!pool.memory || !pool.meta) {
+        perror("malloc");
+        return 1;
+    }
+
+    const struct allocator allocators[] = {
+        {POOL_MODE, pool_malloc, pool_free, pool_realloc, pool_reset, pool_check, &pool},
+        #ifdef BUDDY_THREAD_ARENAS
+        {"arenas", arena_malloc, arena_free, arena_realloc, arena_reset, pool_check, &pool},
+        #endif
+        {label, libc_malloc, libc_free, libc_realloc, libc_reset, NULL, NULL},
+    };
+    const size_t count = sizeof(allocators) / sizeof(allocators[0]);
+    int consistent = 1;
+
+    print_header();
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        if (filter && strcmp(filter, workloads[w].name) != 0) continue;
+
+        for (size_t i = 0; i < count; i++) {
+            double base = 0;
+            for (int threads = 1; threads <= max_threads; threads *= 2) {
+                double throughput = run_workload(&workloads[w], &allocators[i], n, threads, base, &consistent);
+                if (threads == 1) base = throughput;
+            }
+        }
+    }
+
+    if (pool.alloc) buddy_destroy(pool.alloc);
+    free(pool.memory);
+    free(pool.meta);
+    return consistent ? 0 : 1;
+}
@@ -1,299 +1,4306 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <errno.h>
+
+#include "buddy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef BUDDY_PURGE
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(BUDDY_THREADS) && !defined(BUDDY_ATOMIC)
+#define LOCK(alloc) pthread_mutex_lock(&(alloc)->lock)
+#define UNLOCK(alloc) pthread_mutex_unlock(&(alloc)->lock)
+#else
+#define LOCK(alloc)
+#define UNLOCK(alloc)
+#endif
+
+#ifdef BUDDY_ATOMIC
+#define ORDER_LOCK(alloc, order) spin_lock(&(alloc)->order_locks[order])
+#define ORDER_UNLOCK(alloc, order) spin_unlock(&(alloc)->order_locks[order])
+// The list of thread caches is otherwise guarded by the allocator lock
+#define CACHES_LOCK(alloc) spin_lock(&(alloc)->caches_lock)
+#define CACHES_UNLOCK(alloc) spin_unlock(&(alloc)->caches_lock)
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define ATOMIC_OR(p, v) __atomic_fetch_or(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_AND(p, v) __atomic_fetch_and(p, v, __ATOMIC_RELAXED)
+#else
+#define ORDER_LOCK(alloc, order)
+#define ORDER_UNLOCK(alloc, order)
+#define CACHES_LOCK(alloc)
+#define CACHES_UNLOCK(alloc)
+#define ATOMIC_LOAD(p) (*(p))
+#define ATOMIC_OR(p, v) (*(p) |= (v))
+#define ATOMIC_AND(p, v) (*(p) &= (v))
+#endif
+
+// Statistics counters are updated with relaxed atomics, since some are updated outside of any lock. Updates return the old value.
+#ifdef BUDDY_THREADS
+#define STAT_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define STAT_SUB(p, v) __atomic_fetch_sub(p, v, __ATOMIC_RELAXED)
+#define STAT_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(p, v) ({ size_t old_ = *(p); *(p) += (v); old_; })
+#define STAT_SUB(p, v) ({ size_t old_ = *(p); *(p) -= (v); old_; })
+#define STAT_LOAD(p) (*(p))
+#endif
+
+/* PER-THREAD RINGS */
+#if defined(BUDDY_TRACE) || defined(BUDDY_RECORD)
+#include <pthread.h>
+
+/* Tracing and recording write into rings owned by the calling thread, which
+ * are only read by whoever drains them. The ring of a thread that exits is
+ * handed to the next thread that needs one, so rings are never freed once
+ * registered. Each kind of ring embeds this header first.
+ */
+struct buddy_ring {
+    struct buddy_ring *next;
+    uint32_t owned;
+    uint32_t id;
+    size_t head;
+    size_t tail;
+    size_t dropped;
+};
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+#ifdef BUDDY_TRACE
+static pthread_key_t trace_ring_key;
+static _Thread_local struct buddy_ring *trace_ring;
+#endif
+#ifdef BUDDY_RECORD
+static pthread_key_t record_ring_key;
+static _Thread_local struct buddy_ring *record_ring;
+#endif
+
+/* Called on thread exit to let another thread take over the ring. The thread
+ * forgets the ring before it is handed over, since the destructors of thread
+ * caches and arenas may still trace or record. They then claim a ring again,
+ * which is released by the next round of destructors.
+ */
+static void ring_release(void *p) {
+    #ifdef BUDDY_TRACE
+    if (p == trace_ring) trace_ring = NULL;
+    #endif
+    #ifdef BUDDY_RECORD
+    if (p == record_ring) record_ring = NULL;
+    #endif
+    __atomic_store_n(&((struct buddy_ring *)p)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_keys_create(void) {
+    #ifdef BUDDY_TRACE
+    pthread_key_create(&trace_ring_key, ring_release);
+    #endif
+    #ifdef BUDDY_RECORD
+    pthread_key_create(&record_ring_key, ring_release);
+    #endif
+}
+
+// Takes over the ring of a thread that has exited, or registers a new one numbered after the last
+static struct buddy_ring *claim_ring(struct buddy_ring **rings, size_t size, pthread_key_t *key) {
+    struct buddy_ring *r;
+
+    for (r = __atomic_load_n(rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+
+    if (r == NULL) {
+        r = calloc(1, size);
+        if (r == NULL) return NULL;
+
+        r->owned = 1;
+        r->next = __atomic_load_n(rings, __ATOMIC_RELAXED);
+        do {
+            r->id = r->next ? r->next->id + 1 : 0;
+        } while (!__atomic_compare_exchange_n(rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_once(&ring_once, ring_keys_create);
+    pthread_setspecific(*key, r);
+    return r;
+}
+
+// Returns the position to write the next entry at, or SIZE_MAX after counting a drop if the ring is full
+static size_t ring_reserve(struct buddy_ring *r, size_t capacity) {
+    // Only the owning thread writes the head, so it can be read without synchronization
+    size_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == capacity) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return SIZE_MAX;
+    }
+    return head;
+}
+
+static size_t rings_dropped(struct buddy_ring **rings) {
+    size_t dropped = 0;
+
+    for (struct buddy_ring *r = __atomic_load_n(rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+#endif
+
+/* TRACING */
+#ifdef BUDDY_TRACE
+#define TRACE(alloc, event, address, order) trace(alloc, event, address, order)
+
+struct buddy_trace_ring {
+    struct buddy_ring ring;
+    struct buddy_trace_event events[BUDDY_TRACE_SIZE];
+};
+
+static struct buddy_ring *trace_rings;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void trace(buddy_t *alloc, enum buddy_event event, uintptr_t address, uint8_t order) {
+    struct buddy_trace_ring *r = (struct buddy_trace_ring *)trace_ring;
+    if (r == NULL) {
+        r = (struct buddy_trace_ring *)claim_ring(&trace_rings, sizeof(struct buddy_trace_ring), &trace_ring_key);
+        if (r == NULL) return;
+        trace_ring = &r->ring;
+    }
+
+    size_t head = ring_reserve(&r->ring, BUDDY_TRACE_SIZE);
+    if (head == SIZE_MAX) return;
+
+    struct buddy_trace_event *e = &r->events[head % BUDDY_TRACE_SIZE];
+    e->alloc = alloc;
+    e->offset = address - alloc->base;
+    e->event = event;
+    e->order = order;
+
+    __atomic_store_n(&r->ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+size_t buddy_trace_drain(buddy_trace_fn fn, void *ctx) {
+    size_t count = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (struct buddy_ring *r = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        struct buddy_trace_event *events = ((struct buddy_trace_ring *)r)->events;
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        for (size_t tail = r->tail; tail != head; tail++) {
+            fn(&events[tail % BUDDY_TRACE_SIZE], ctx);
+            count++;
+        }
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&drain_lock);
+
+    return count;
+}
+
+size_t buddy_trace_dropped(void) {
+    return rings_dropped(&trace_rings);
+}
+#else
+#define TRACE(alloc, event, address, order) ((void)0)
+#endif
+
+/* RECORDING */
+#ifdef BUDDY_RECORD
 #include <stdio.h>
+#include <time.h>
+
+#define RECORD(alloc, op, address, length) do { \
+    if (__atomic_load_n(&recorded, __ATOMIC_RELAXED) == (alloc)) record(alloc, op, address, length); \
+} while (0)
+
+struct buddy_record_ring {
+    struct buddy_ring ring;
+    struct buddy_record records[BUDDY_RECORD_SIZE];
+};
+
+static buddy_t *recorded;
+static struct buddy_ring *record_rings;
+
+// The file and flush thread of the running recording, guarded by the lock
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t record_thread;
+static FILE *record_file;
+static int record_stopping;
+
+static void record(buddy_t *alloc, enum buddy_record_op op, uintptr_t address, size_t length) {
+    struct buddy_record_ring *r = (struct buddy_record_ring *)record_ring;
+    if (r == NULL) {
+        r = (struct buddy_record_ring *)claim_ring(&record_rings, sizeof(struct buddy_record_ring), &record_ring_key);
+        if (r == NULL) return;
+        record_ring = &r->ring;
+    }
+
+    size_t head = ring_reserve(&r->ring, BUDDY_RECORD_SIZE);
+    if (head == SIZE_MAX) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    struct buddy_record *e = &r->records[head % BUDDY_RECORD_SIZE];
+    e->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    e->offset = address ? address - alloc->base : BUDDY_RECORD_FAILED;
+    e->size = length > UINT32_MAX ? UINT32_MAX : length;
+    e->thread = r->ring.id;
+    e->op = op;
+    e->reserved = 0;
+
+    __atomic_store_n(&r->ring.head, head + 1, __ATOMIC_RELEASE);
+
+    // Wake the flush thread early rather than drop records when a burst fills the ring before the interval is up
+    if (head + 1 - __atomic_load_n(&r->ring.tail, __ATOMIC_RELAXED) == BUDDY_RECORD_SIZE / 2) {
+        pthread_cond_signal(&record_cond);
+    }
+}
+
+// Writes out the records of all rings. Called with the record lock held.
+static void record_flush(void) {
+    for (struct buddy_ring *r = __atomic_load_n(&record_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        struct buddy_record *records = ((struct buddy_record_ring *)r)->records;
+        size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        size_t tail = r->tail;
+
+        // The records between the tail and head wrap around the end of the ring at most once
+        while (tail != head) {
+            size_t start = tail % BUDDY_RECORD_SIZE;
+            size_t count = head - tail;
+            if (count > BUDDY_RECORD_SIZE - start) count = BUDDY_RECORD_SIZE - start;
+
+            fwrite(&records[start], sizeof(struct buddy_record), count, record_file);
+            tail += count;
+        }
+        __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    }
+    fflush(record_file);
+}
+
+static void *record_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&record_lock);
+    while (!record_stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += BUDDY_RECORD_INTERVAL * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+
+        pthread_cond_timedwait(&record_cond, &record_lock, &ts);
+        record_flush();
+    }
+    pthread_mutex_unlock(&record_lock);
+
+    return NULL;
+}
+
+int buddy_record_start(buddy_t *alloc, const char *path) {
+    pthread_mutex_lock(&record_lock);
+    if (record_file != NULL) {
+        pthread_mutex_unlock(&record_lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        pthread_mutex_unlock(&record_lock);
+        return -1;
+    }
+
+    struct buddy_record_header header = {0};
+    memcpy(header.magic, BUDDY_RECORD_MAGIC, sizeof(header.magic));
+    header.version = BUDDY_RECORD_VERSION;
+    header.record_size = sizeof(struct buddy_record);
+    header.pool_size = alloc->size;
+    header.min_log2 = alloc->min_log2;
+    header.max_log2 = alloc->max_log2;
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        pthread_mutex_unlock(&record_lock);
+        errno = EIO;
+        return -1;
+    }
+
+    // Discard records left over from operations still in flight when the last recording stopped
+    for (struct buddy_ring *r = __atomic_load_n(&record_rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        __atomic_store_n(&r->tail, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+
+    record_file = f;
+    record_stopping = 0;
+
+    int err = pthread_create(&record_thread, NULL, record_main, NULL);
+    if (err != 0) {
+        record_file = NULL;
+        fclose(f);
+        pthread_mutex_unlock(&record_lock);
+        errno = err;
+        return -1;
+    }
+
+    __atomic_store_n(&recorded, alloc, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&record_lock);
+
+    return 0;
+}
+
+void buddy_record_stop(void) {
+    pthread_mutex_lock(&record_lock);
+    if (record_file == NULL || record_stopping) {
+        pthread_mutex_unlock(&record_lock);
+        return;
+    }
+
+    __atomic_store_n(&recorded, NULL, __ATOMIC_RELEASE);
+    record_stopping = 1;
+    pthread_cond_signal(&record_cond);
+    pthread_mutex_unlock(&record_lock);
+
+    pthread_join(record_thread, NULL);
+
+    pthread_mutex_lock(&record_lock);
+    record_flush();
+    fclose(record_file);
+    record_file = NULL;
+    pthread_mutex_unlock(&record_lock);
+}
+
+size_t buddy_record_dropped(void) {
+    return rings_dropped(&record_rings);
+}
+#else
+#define RECORD(alloc, op, address, length) ((void)0)
+#endif
+
+/* HELPER FUNCTIONS */
+#define SIZE_BITS (sizeof(unsigned long) * 8)
+
+static uint8_t floor_log2(size_t length) {
+    return SIZE_BITS - 1 - __builtin_clzl(length);
+}
+
+static uint8_t ceil_log2(size_t length) {
+    return length <= 1 ? 0 : SIZE_BITS - __builtin_clzl(length - 1);
+}
+
+// Order of the smallest block that fits the requested length
+static uint8_t get_order(buddy_t *alloc, const size_t length) {
+    uint8_t n = ceil_log2(length);
+    return n > alloc->min_log2 ? n - alloc->min_log2 : 0;
+}
+
+// Order of the largest block that fits within the given length
+static uint8_t get_floor_order(buddy_t *alloc, const size_t length) {
+    uint8_t n = floor_log2(length);
+    if (n > alloc->max_log2) n = alloc->max_log2;
+    return n - alloc->min_log2;
+}
+
+#ifdef BUDDY_ATOMIC
+static void spin_lock(struct buddy_lock *l) {
+    uint32_t *lock = &l->value;
+
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        // Spin on a plain load so waiting threads do not keep the cache line exclusive
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+        }
+    }
+}
+
+static void spin_unlock(struct buddy_lock *l) {
+    __atomic_store_n(&l->value, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+#ifdef BUDDY_BLOCKED_TREE
+// Bytes of the bit tree a subtree of a full band fills, which the tree is aligned to
+#define TREE_LINE (((size_t)1 << BUDDY_TREE_BAND_LEVELS) / 8)
+
+/* Works out where the nodes of each order sit in the blocked bit tree, and
+ * returns the number of bits in the tree. Every band takes 2^(height - bottom
+ * + 1) bits, whether or not it has all of its levels. The base of an order
+ * includes the offset of its first node in a subtree.
+ */
+static size_t get_tree_levels(uint8_t mem_log2, uint8_t min_log2, uint8_t max_log2, struct buddy_tree_level *levels) {
+    uint8_t height = mem_log2 - min_log2;
+    uint8_t max_order = max_log2 - min_log2;
+    size_t bits = 0;
+
+    for (uint8_t bottom = 0; bottom <= max_order; bottom += BUDDY_TREE_BAND_LEVELS) {
+        uint8_t top = bottom + BUDDY_TREE_BAND_LEVELS - 1;
+        if (top > max_order) top = max_order;
+
+        for (uint8_t order = bottom; levels && order <= top; order++) {
+            levels[order].depth = top - order;
+            levels[order].levels = top - bottom + 1;
+            levels[order].base = bits + ((size_t)1 << (top - order)) - 1;
+        }
+        bits += (size_t)1 << (height - bottom + 1);
+    }
+    return bits;
+}
+
+static size_t get_bit_tree_index(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    struct buddy_tree_level *level = &alloc->tree_levels[order];
+    size_t offset = (address - alloc->base) >> (alloc->min_log2 + order);
+    size_t subtree = (offset >> level->depth) << level->levels;
+
+    return level->base + subtree + (offset & (((size_t)1 << level->depth) - 1));
+}
+#else
+static size_t get_bit_tree_index(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    uint8_t height = alloc->mem_log2 - order - alloc->min_log2;
+    size_t offset = (address - alloc->base) >> (alloc->min_log2 + order);
+    size_t node_index = ((size_t)1 << height) - 1 + offset - alloc->truncated_nodes;
+
+    return node_index;
+}
+#endif
+
+static uint8_t get_state(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    size_t index = get_bit_tree_index(alloc, address, order);
+    size_t word_index = index / 32;
+    uint32_t word_offset = index % 32;
+
+    uint8_t state = ATOMIC_LOAD(&alloc->bit_tree[word_index]) >> word_offset;
+
+    // Apply mask to get the desired bit
+    return state & 1;
+}
+
+static void set_state(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t state) {
+    size_t index = get_bit_tree_index(alloc, address, order);
+    size_t word_index = index / 32;
+    uint32_t word_offset = index % 32;
+
+    // Create a mask to only set the bit at the target position. Bits of the same word can belong to blocks
+    // owned by other threads, so the word is updated with a single atomic operation in BUDDY_ATOMIC mode.
+    uint32_t mask = (uint32_t)1 << word_offset;
+
+    if (state) ATOMIC_OR(&alloc->bit_tree[word_index], mask);
+    else ATOMIC_AND(&alloc->bit_tree[word_index], ~mask);
+}
+
+/* BIT KERNELS */
+/* Bulk queries scan runs of consecutive bits of the bit tree, which start at
+ * any bit. A run is read as a stream of 32-bit words realigned to its first
+ * bit, with the bits past its end cleared. Pairs are sibling nodes, starting
+ * at the first bit of the run.
+ */
+#ifndef BUDDY_SCALAR_KERNELS
+#if defined(__x86_64__) || defined(__i386__)
+#define AVX2_KERNELS
+#include <immintrin.h>
+// The NEON kernels use across-vector reductions only AArch64 has, so 32-bit ARM uses the scalar kernels
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define NEON_KERNELS
+#include <arm_neon.h>
+#endif
+#endif
+
+#define PAIR_MASK 0x55555555u
+
+// Word j of the stream of n bits starting at bit start of the words
+static uint32_t get_stream_word(const uint32_t *words, size_t start, size_t n, size_t j) {
+    size_t bit = start + j * 32;
+    uint32_t shift = bit % 32;
+    size_t left = n - j * 32;
+
+    uint64_t x = words[bit / 32] >> shift;
+    if (shift && left > 32 - shift) x |= (uint64_t)words[bit / 32 + 1] << (32 - shift);
+    if (left < 32) x &= ((uint64_t)1 << left) - 1;
+    return (uint32_t)x;
+}
+
+// Bits of the stream word whose sibling is set and that are clear themselves, or just clear if not paired
+static uint32_t get_free_bits(uint32_t x, size_t left, int paired) {
+    if (paired) return ~x & (((x & PAIR_MASK) << 1) | ((x >> 1) & PAIR_MASK));
+    return ~x & (left < 32 ? ((uint32_t)1 << left) - 1 : ~(uint32_t)0);
+}
+
+static size_t count_bits_scalar(const uint32_t *words, size_t start, size_t n) {
+    size_t count = 0;
+
+    for (size_t j = 0; j * 32 < n; j++) count += __builtin_popcount(get_stream_word(words, start, n, j));
+    return count;
+}
+
+static size_t count_pairs_scalar(const uint32_t *words, size_t start, size_t n) {
+    size_t count = 0;
+
+    for (size_t j = 0; j * 32 < n; j++) {
+        uint32_t x = get_stream_word(words, start, n, j);
+        count += __builtin_popcount((x | x >> 1) & PAIR_MASK);
+    }
+    return count;
+}
+
+static size_t find_free_scalar(const uint32_t *words, size_t start, size_t n, int paired) {
+    for (size_t j = 0; j * 32 < n; j++) {
+        uint32_t x = get_free_bits(get_stream_word(words, start, n, j), n - j * 32, paired);
+        if (x) return j * 32 + __builtin_ctz(x);
+    }
+    return n;
+}
+
+/* The vector kernels handle 8 stream words at a time for as long as the word
+ * after them is still part of the run, so the shifted loads stay in bounds,
+ * and leave the rest to the scalar kernels.
+ */
+#define VECTOR_WORDS(n) ((n) / 32 > 8 ? ((n) / 32 - 1) & ~(size_t)7 : 0)
+
+#ifdef AVX2_KERNELS
+__attribute__((target("avx2")))
+static __m256i load_stream_avx2(const uint32_t *words, size_t start, size_t j) {
+    size_t bit = start + j * 32;
+    __m256i lo = _mm256_loadu_si256((const __m256i *)(words + bit / 32));
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(words + bit / 32 + 1));
+
+    // Shifting by 32 clears the high words, so a stream aligned to a word is just the low words
+    return _mm256_or_si256(_mm256_srl_epi32(lo, _mm_cvtsi32_si128(bit % 32)), _mm256_sll_epi32(hi, _mm_cvtsi32_si128(32 - bit % 32)));
+}
+
+// Adds the number of set bits in each 64-bit lane of x to the lanes of sum, using a nibble lookup table
+__attribute__((target("avx2")))
+static __m256i add_popcount_avx2(__m256i sum, __m256i x) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibbles = _mm256_set1_epi8(0x0f);
+
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(x, nibbles)),
+                                     _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibbles)));
+    return _mm256_add_epi64(sum, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static size_t sum_lanes_avx2(__m256i sum) {
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2")))
+static size_t count_bits_avx2(const uint32_t *words, size_t start, size_t n) {
+    size_t vector = VECTOR_WORDS(n);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (size_t j = 0; j < vector; j += 8) sum = add_popcount_avx2(sum, load_stream_avx2(words, start, j));
+    return sum_lanes_avx2(sum) + count_bits_scalar(words, start + vector * 32, n - vector * 32);
+}
+
+__attribute__((target("avx2")))
+static size_t count_pairs_avx2(const uint32_t *words, size_t start, size_t n) {
+    size_t vector = VECTOR_WORDS(n);
+    const __m256i mask = _mm256_set1_epi32(PAIR_MASK);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (size_t j = 0; j < vector; j += 8) {
+        __m256i x = load_stream_avx2(words, start, j);
+        sum = add_popcount_avx2(sum, _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi32(x, 1)), mask));
+    }
+    return sum_lanes_avx2(sum) + count_pairs_scalar(words, start + vector * 32, n - vector * 32);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free_avx2(const uint32_t *words, size_t start, size_t n, int paired) {
+    size_t vector = VECTOR_WORDS(n);
+    const __m256i mask = _mm256_set1_epi32(PAIR_MASK);
+    const __m256i ones = _mm256_set1_epi32(-1);
+
+    for (size_t j = 0; j < vector; j += 8) {
+        __m256i x = load_stream_avx2(words, start, j);
+        __m256i clear = _mm256_andnot_si256(x, ones);
+
+        if (paired) {
+            __m256i siblings = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(x, mask), 1), _mm256_and_si256(_mm256_srli_epi32(x, 1), mask));
+            clear = _mm256_and_si256(clear, siblings);
+        }
+        if (!_mm256_testz_si256(clear, clear)) return j * 32 + find_free_scalar(words, start + j * 32, 256, paired);
+    }
+    return vector * 32 + find_free_scalar(words, start + vector * 32, n - vector * 32, paired);
+}
+#elif defined(NEON_KERNELS)
+static uint32x4_t load_stream_neon(const uint32_t *words, size_t start, size_t j) {
+    size_t bit = start + j * 32;
+    uint32x4_t lo = vld1q_u32(words + bit / 32);
+    uint32x4_t hi = vld1q_u32(words + bit / 32 + 1);
+
+    // Shifting left by 32 clears the high words, so a stream aligned to a word is just the low words
+    return vorrq_u32(vshlq_u32(lo, vdupq_n_s32(-(int32_t)(bit % 32))), vshlq_u32(hi, vdupq_n_s32(32 - bit % 32)));
+}
+
+static size_t popcount_neon(uint32x4_t x) {
+    return vaddlvq_u8(vcntq_u8(vreinterpretq_u8_u32(x)));
+}
+
+static size_t count_bits_neon(const uint32_t *words, size_t start, size_t n) {
+    size_t vector = VECTOR_WORDS(n), count = 0;
+
+    for (size_t j = 0; j < vector; j += 4) count += popcount_neon(load_stream_neon(words, start, j));
+    return count + count_bits_scalar(words, start + vector * 32, n - vector * 32);
+}
+
+static size_t count_pairs_neon(const uint32_t *words, size_t start, size_t n) {
+    size_t vector = VECTOR_WORDS(n), count = 0;
+    const uint32x4_t mask = vdupq_n_u32(PAIR_MASK);
+
+    for (size_t j = 0; j < vector; j += 4) {
+        uint32x4_t x = load_stream_neon(words, start, j);
+        count += popcount_neon(vandq_u32(vorrq_u32(x, vshrq_n_u32(x, 1)), mask));
+    }
+    return count + count_pairs_scalar(words, start + vector * 32, n - vector * 32);
+}
+
+static size_t find_free_neon(const uint32_t *words, size_t start, size_t n, int paired) {
+    size_t vector = VECTOR_WORDS(n);
+    const uint32x4_t mask = vdupq_n_u32(PAIR_MASK);
+
+    for (size_t j = 0; j < vector; j += 4) {
+        uint32x4_t x = load_stream_neon(words, start, j);
+        uint32x4_t clear = vmvnq_u32(x);
+
+        if (paired) clear = vandq_u32(clear, vorrq_u32(vshlq_n_u32(vandq_u32(x, mask), 1), vandq_u32(vshrq_n_u32(x, 1), mask)));
+        if (vmaxvq_u32(clear)) return j * 32 + find_free_scalar(words, start + j * 32, 128, paired);
+    }
+    return vector * 32 + find_free_scalar(words, start + vector * 32, n - vector * 32, paired);
+}
+#endif
+
+struct bit_kernels {
+    size_t (*count_bits)(const uint32_t *, size_t, size_t);
+    size_t (*count_pairs)(const uint32_t *, size_t, size_t);
+    size_t (*find_free)(const uint32_t *, size_t, size_t, int);
+};
+
+static const struct bit_kernels scalar_kernels = {count_bits_scalar, count_pairs_scalar, find_free_scalar};
+#ifdef AVX2_KERNELS
+static const struct bit_kernels avx2_kernels = {count_bits_avx2, count_pairs_avx2, find_free_avx2};
+#elif defined(NEON_KERNELS)
+static const struct bit_kernels neon_kernels = {count_bits_neon, count_pairs_neon, find_free_neon};
+#endif
+
+static const struct bit_kernels *bit_kernels;
+
+/* Picks the kernels for the CPU on first use. NEON is part of the AArch64
+ * baseline, whereas AVX2 is only used if the CPU supports it. Threads racing
+ * on the first use pick the same kernels.
+ */
+static const struct bit_kernels *get_bit_kernels(void) {
+    const struct bit_kernels *k = __atomic_load_n(&bit_kernels, __ATOMIC_RELAXED);
+    if (k != NULL) return k;
+
+    k = &scalar_kernels;
+    #ifdef AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) k = &avx2_kernels;
+    #elif defined(NEON_KERNELS)
+    k = &neon_kernels;
+    #endif
+
+    __atomic_store_n(&bit_kernels, k, __ATOMIC_RELAXED);
+    return k;
+}
+
+#ifdef BUDDY_LAZY
+// Blocks of the max order past the frontier are free without being in the free lists
+static int has_lazy_roots(buddy_t *alloc, uint8_t order) {
+    return order == alloc->max_order && alloc->frontier < alloc->frontier_end;
+}
+#endif
+
+#ifdef BUDDY_FREE_MAPS
+// Words in a level of the free map of an order, whose bottom level has 2^bits bits
+static size_t get_map_level_words(uint8_t bits, uint8_t level) {
+    return (size_t)1 << (bits > 6 * (level + 1) ? bits - 6 * (level + 1) : 0);
+}
+
+// Words in all levels of the free map of an order
+static size_t get_map_words(uint8_t bits) {
+    size_t words = 0;
+
+    for (uint8_t level = 0; ; level++) {
+        words += get_map_level_words(bits, level);
+        if (bits <= 6 * (level + 1)) return words;
+    }
+}
+
+static void map_set(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    uint8_t bits = alloc->mem_log2 - alloc->min_log2 - order;
+    size_t index = (address - alloc->base) >> (alloc->min_log2 + order);
+    uint64_t *words = alloc->free_maps[order].bottom;
+
+    // Set the bit of the block, and the bits of the words above it that were empty until now
+    for (uint8_t level = 0; ; level++) {
+        uint64_t word = words[index / 64];
+        words[index / 64] = word | (uint64_t)1 << (index % 64);
+
+        if (word != 0 || bits <= 6 * (level + 1)) break;
+        index /= 64;
+        words -= get_map_level_words(bits, level + 1);
+    }
+}
+
+static void map_clear(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    uint8_t bits = alloc->mem_log2 - alloc->min_log2 - order;
+    size_t index = (address - alloc->base) >> (alloc->min_log2 + order);
+    uint64_t *words = alloc->free_maps[order].bottom;
+
+    // Clear the bit of the block, and the bits of the words above it that are now empty
+    for (uint8_t level = 0; ; level++) {
+        uint64_t word = words[index / 64] &= ~((uint64_t)1 << (index % 64));
+
+        if (word != 0 || bits <= 6 * (level + 1)) break;
+        index /= 64;
+        words -= get_map_level_words(bits, level + 1);
+    }
+}
+
+// Finds the free block with the lowest address in the free map of an order, which must not be empty
+static uintptr_t find_free(buddy_t *alloc, uint8_t order) {
+    uint8_t bits = alloc->mem_log2 - alloc->min_log2 - order;
+    uint8_t level = bits > 6 ? (bits - 1) / 6 : 0;
+    uint64_t *words = alloc->free_maps[order].top;
+    size_t index = 0;
+
+    for (; level > 0; level--) {
+        index = index * 64 + __builtin_ctzll(words[index]);
+        words += get_map_level_words(bits, level);
+    }
+    index = index * 64 + __builtin_ctzll(words[index]);
+
+    return alloc->base + (index << (alloc->min_log2 + order));
+}
+#endif
+
+#ifdef BUDDY_TREE_ONLY
+static void append(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    map_set(alloc, address, order);
+
+    if (alloc->free_counts[order]++ == 0) ATOMIC_OR(&alloc->free_orders, (uint64_t)1 << order);
+}
+
+static void free_list_remove(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    map_clear(alloc, address, order);
+
+    if (--alloc->free_counts[order] == 0
+        #ifdef BUDDY_LAZY
+        && !has_lazy_roots(alloc, order)
+        #endif
+        ) ATOMIC_AND(&alloc->free_orders, ~((uint64_t)1 << order));
+}
+#else
+#ifdef BUDDY_PURGE
+// Purged blocks are kept in lists of their own, right after the free lists
+#define FREE_LISTS 2
+
+/* Free blocks of orders that can be purged record the epoch they were freed
+ * in, and whether they are in the purged lists.
+ */
+struct buddy_purge_page {
+    buddy_page_t page;
+    size_t epoch;
+    uint8_t purged;
+};
+
+static int is_purged(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    return order >= alloc->purge_order && ((struct buddy_purge_page *)address)->purged;
+}
+#else
+#define FREE_LISTS 1
+#endif
+
+#ifdef BUDDY_RELOCATABLE
+// List links are offsets from the base plus one, so that NULL still ends a list wherever the pool is mapped
+#define TO_LINK(alloc, p) ((p) ? (buddy_page_t *)((uintptr_t)(p) - (alloc)->base + 1) : NULL)
+#define FROM_LINK(alloc, link) ((link) ? (buddy_page_t *)((uintptr_t)(link) + (alloc)->base - 1) : NULL)
+#else
+#define TO_LINK(alloc, p) (p)
+#define FROM_LINK(alloc, link) (link)
+#endif
+
+static void push(buddy_t *alloc, buddy_page_t **list, uintptr_t address, uint8_t order) {
+    buddy_page_t *p = (buddy_page_t *)address;
+
+    if (*list) FROM_LINK(alloc, *list)->prev = TO_LINK(alloc, p);
+    else ATOMIC_OR(&alloc->free_orders, (uint64_t)1 << order);
+
+    p->prev = NULL;
+    p->next = *list;
+
+    *list = TO_LINK(alloc, p);
+    alloc->free_counts[order]++;
+
+    #ifdef BUDDY_ADDRESS_ORDERED
+    map_set(alloc, address, order);
+    #endif
+}
+
+static void append(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    #ifdef BUDDY_PURGE
+    if (order >= alloc->purge_order) {
+        struct buddy_purge_page *p = (struct buddy_purge_page *)address;
+        p->epoch = STAT_LOAD(&alloc->purge_epoch);
+        p->purged = 0;
+    }
+    #endif
+
+    push(alloc, &alloc->free_lists[order], address, order);
+}
+
+static void free_list_remove(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    buddy_page_t *p = (buddy_page_t *)address;
+    buddy_page_t **list = &alloc->free_lists[order];
+
+    #ifdef BUDDY_PURGE
+    if (is_purged(alloc, address, order)) list = &alloc->purged_lists[order];
+    #endif
+
+    if (p->prev != NULL) FROM_LINK(alloc, p->prev)->next = p->next;
+
+    if (*list == TO_LINK(alloc, p)) {
+        *list = p->next;
+        if (p->next == NULL
+            #ifdef BUDDY_PURGE
+            && alloc->free_lists[order] == NULL && alloc->purged_lists[order] == NULL
+            #endif
+            #ifdef BUDDY_LAZY
+            && !has_lazy_roots(alloc, order)
+            #endif
+            ) ATOMIC_AND(&alloc->free_orders, ~((uint64_t)1 << order));
+    }
+
+    if (p->next != NULL) FROM_LINK(alloc, p->next)->prev = p->prev;
+
+    p->prev = NULL;
+    p->next = NULL;
+
+    alloc->free_counts[order]--;
+
+    #ifdef BUDDY_ADDRESS_ORDERED
+    map_clear(alloc, address, order);
+    #endif
+}
+#endif
+
+// Accounts for memory handed out by the free lists, keeping track of the high-water mark
+static void add_in_use(buddy_t *alloc, size_t length) {
+    size_t in_use = STAT_ADD(&alloc->in_use, length) + length;
+    size_t peak = STAT_LOAD(&alloc->peak_in_use);
+
+    #ifdef BUDDY_THREADS
+    while (in_use > peak && !__atomic_compare_exchange_n(&alloc->peak_in_use, &peak, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    #else
+    if (in_use > peak) alloc->peak_in_use = in_use;
+    #endif
+}
+
+#ifdef BUDDY_LAZY
+/* Hands out the block of the max order at the frontier, once the free lists
+ * of the max order are empty, and moves the frontier past it. Called with the
+ * lock of the max order held. Returns 0 if no block is left past the frontier.
+ */
+static uintptr_t take_lazy_root(buddy_t *alloc, uint8_t order) {
+    if (!has_lazy_roots(alloc, order)) return 0;
+
+    uintptr_t address = alloc->frontier;
+    alloc->frontier += (size_t)1 << alloc->max_log2;
+    if (alloc->frontier == alloc->frontier_end) ATOMIC_AND(&alloc->free_orders, ~((uint64_t)1 << order));
+
+    set_state(alloc, address, order, 1);
+    return address;
+}
+#endif
+
+// Removes the first block from the free list of the given order and marks it used. Returns 0 if the list is empty.
+static uintptr_t take(buddy_t *alloc, uint8_t order) {
+    #ifdef BUDDY_FREE_MAPS
+    // The free map yields the free block with the lowest address, whether its pages are purged or not
+    uintptr_t address = alloc->free_counts[order] ? find_free(alloc, order) : 0;
+    #else
+    uintptr_t address = (uintptr_t)FROM_LINK(alloc, alloc->free_lists[order]);
+    #ifdef BUDDY_PURGE
+    // Blocks whose pages are still resident are reused before purged blocks
+    if (address == 0) address = (uintptr_t)FROM_LINK(alloc, alloc->purged_lists[order]);
+    #endif
+    #endif
+    if (address == 0) {
+        #ifdef BUDDY_LAZY
+        return take_lazy_root(alloc, order);
+        #else
+        return 0;
+        #endif
+    }
+
+    free_list_remove(alloc, address, order);
+
+    // Mark block as allocated or split in the bit tree
+    set_state(alloc, address, order, 1);
+
+    return address;
+}
+
+/* Splits a block taken from the free lists down to the target order. The
+ * upper halves are returned to the free lists, and the address of the
+ * remaining block of the target order is returned. Each lower half is marked
+ * used before its buddy is published, so a thread freeing the buddy never
+ * sees it as free.
+ */
+static uintptr_t split(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t target) {
+    while (order > target) {
+        TRACE(alloc, BUDDY_EVENT_SPLIT, address, order);
+        STAT_ADD(&alloc->splits, 1);
+
+        order--;
+
+        // Mark the lower half as allocated or split in the bit tree
+        set_state(alloc, address, order, 1);
+
+        // Since the bit tree was initialized as all free, the upper buddy is already marked free in the bit tree
+        uintptr_t buddy_address = ((address - alloc->base) ^ (size_t)1 << (order + alloc->min_log2)) + alloc->base;
+
+        ORDER_LOCK(alloc, order);
+        append(alloc, buddy_address, order);
+        ORDER_UNLOCK(alloc, order);
+    }
+    return address;
+}
+
+// Allocates a block of the given order from the free lists. Returns 0 if no block is available.
+static uintptr_t alloc_block(buddy_t *alloc, uint8_t order) {
+    uintptr_t address;
+    uint8_t next_order;
+
+    // Another thread may empty a free list after its order is found in the bitmap, in which case the search is retried
+    do {
+        // Find the smallest order with a free block - this is the requested order if one is available
+        uint64_t orders = ATOMIC_LOAD(&alloc->free_orders) >> order;
+        if (orders == 0) return 0;
+
+        next_order = order + __builtin_ctzll(orders);
+
+        ORDER_LOCK(alloc, next_order);
+        address = take(alloc, next_order);
+        ORDER_UNLOCK(alloc, next_order);
+    } while (address == 0);
+
+    add_in_use(alloc, (size_t)1 << (order + alloc->min_log2));
+
+    // Split a larger block if a best fit block was not available
+    return split(alloc, address, next_order, order);
+}
+
+#ifdef BUDDY_TRIM
+/* Sized frees check the run bitmap without the lock, and bits of the same word
+ * belong to different runs, so with BUDDY_THREADS its words are always updated
+ * with atomic operations.
+ */
+#ifdef BUDDY_THREADS
+#define RUN_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define RUN_OR(p, v) __atomic_fetch_or(p, v, __ATOMIC_RELAXED)
+#define RUN_AND(p, v) __atomic_fetch_and(p, v, __ATOMIC_RELAXED)
+#else
+#define RUN_LOAD(p) (*(p))
+#define RUN_OR(p, v) (*(p) |= (v))
+#define RUN_AND(p, v) (*(p) &= (v))
+#endif
+
+static uint8_t get_run_bit(buddy_t *alloc, uintptr_t address) {
+    size_t index = (address - alloc->base) >> alloc->min_log2;
+    return (RUN_LOAD(&alloc->run_bits[index / 32]) >> (index % 32)) & 1;
+}
+
+static void set_run_bit(buddy_t *alloc, uintptr_t address, uint8_t state) {
+    size_t index = (address - alloc->base) >> alloc->min_log2;
+    uint32_t mask = (uint32_t)1 << (index % 32);
+
+    if (state) RUN_OR(&alloc->run_bits[index / 32], mask);
+    else RUN_AND(&alloc->run_bits[index / 32], ~mask);
+}
+
+// Number of minimum size blocks needed to cover the length
+static size_t get_run_blocks(buddy_t *alloc, size_t length) {
+    return length ? ((length - 1) >> alloc->min_log2) + 1 : 1;
+}
+
+/* Trims an allocated block down to a run of the given number of minimum size
+ * blocks. While the run covers more than the lower half, the lower half is
+ * kept as a block of the run and trimming continues in the upper half, which
+ * is marked as the next block of the run. Otherwise the upper half is returned
+ * to the free lists as in split.
+ */
+static void trim(buddy_t *alloc, uintptr_t address, uint8_t order, size_t blocks) {
+    while (blocks < (size_t)1 << order) {
+        TRACE(alloc, BUDDY_EVENT_SPLIT, address, order);
+        STAT_ADD(&alloc->splits, 1);
+
+        order--;
+
+        size_t half = (size_t)1 << order;
+        uintptr_t upper = address + (half << alloc->min_log2);
+
+        set_state(alloc, address, order, 1);
+
+        if (blocks > half) {
+            set_state(alloc, upper, order, 1);
+            set_run_bit(alloc, upper, 1);
+
+            address = upper;
+            blocks -= half;
+        } else {
+            STAT_SUB(&alloc->in_use, half << alloc->min_log2);
+
+            ORDER_LOCK(alloc, order);
+            append(alloc, upper, order);
+            ORDER_UNLOCK(alloc, order);
+        }
+    }
+}
+#endif
+
+/* Hands out the first count blocks of the target order from a block taken
+ * from the free lists, in address order. The rest of the block is returned to
+ * the free lists as the largest blocks possible.
+ */
+static void carve(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t target, size_t count, void **out) {
+    if (order == target) {
+        *out = (void *)address;
+        return;
+    }
+
+    TRACE(alloc, BUDDY_EVENT_SPLIT, address, order);
+    STAT_ADD(&alloc->splits, 1);
+
+    order--;
+
+    size_t half = (size_t)1 << (order - target);
+    uintptr_t buddy_address = address + ((size_t)1 << (order + alloc->min_log2));
+
+    // Mark the lower half as allocated or split in the bit tree
+    set_state(alloc, address, order, 1);
+    carve(alloc, address, order, target, count < half ? count : half, out);
+
+    if (count > half) {
+        set_state(alloc, buddy_address, order, 1);
+        carve(alloc, buddy_address, order, target, count - half, out + half);
+    } else {
+        ORDER_LOCK(alloc, order);
+        append(alloc, buddy_address, order);
+        ORDER_UNLOCK(alloc, order);
+    }
+}
+
+// Allocates up to n blocks of the given order from the free lists. Returns the number of blocks allocated.
+static size_t alloc_blocks(buddy_t *alloc, uint8_t order, void **out, size_t n) {
+    size_t count = 0;
+
+    while (count < n) {
+        // Order of the largest block that holds no more blocks than are still needed
+        uint8_t want = order + floor_log2(n - count);
+        if (want > alloc->max_order) want = alloc->max_order;
+
+        uintptr_t address;
+        uint8_t next_order;
+        do {
+            uint64_t orders = ATOMIC_LOAD(&alloc->free_orders) >> order;
+            if (orders == 0) return count;
+
+            // Prefer the largest block up to the wanted order, otherwise split the smallest larger block
+            uint64_t fitting = orders & (((uint64_t)2 << (want - order)) - 1);
+            next_order = order + (fitting ? 63 - __builtin_clzll(fitting) : __builtin_ctzll(orders));
+
+            ORDER_LOCK(alloc, next_order);
+            address = take(alloc, next_order);
+            ORDER_UNLOCK(alloc, next_order);
+        } while (address == 0);
+
+        size_t blocks = (size_t)1 << (next_order - order);
+        if (blocks > n - count) blocks = n - count;
+
+        add_in_use(alloc, blocks << (order + alloc->min_log2));
+
+        carve(alloc, address, next_order, order, blocks, out + count);
+        count += blocks;
+    }
+    return count;
+}
+
+static void free_block(buddy_t *alloc, uintptr_t address, uint8_t order);
+static void free_blocks(buddy_t *alloc, void **blocks, uint8_t order, size_t n);
+static int get_allocated_order(buddy_t *alloc, uintptr_t address);
+
+/* CHECKS */
+#ifdef BUDDY_CHECKED
+#define FREED_COOKIE 0x46524545c0ffee00
+#define CANARY 0xa5c3e17d2b964f18
+
+/* Stored in the first word of freed blocks and thread caches. It is relative
+ * to the base so it survives buddy_attach, and mixes in the offset so a block
+ * copied elsewhere does not carry a valid cookie.
+ */
+static uint64_t get_cookie(buddy_t *alloc, uintptr_t address) {
+    return FREED_COOKIE ^ (address - alloc->base);
+}
+
+static int has_cookie(buddy_t *alloc, uintptr_t address) {
+    return *(uint64_t *)address == get_cookie(alloc, address);
+}
+
+// Number of canary bytes that fit in the slack between the length and the end of the block
+static size_t get_canary_length(buddy_t *alloc, uint8_t order, size_t length) {
+    size_t slack = ((size_t)1 << (order + alloc->min_log2)) - length;
+    return slack < sizeof(uint64_t) ? slack : sizeof(uint64_t);
+}
+
+static void set_canary(buddy_t *alloc, uintptr_t address, uint8_t order, size_t length) {
+    uint64_t canary = CANARY ^ (address - alloc->base);
+    memcpy((char *)address + length, &canary, get_canary_length(alloc, order, length));
+}
+
+static int has_canary(buddy_t *alloc, uintptr_t address, uint8_t order, size_t length) {
+    uint64_t canary = CANARY ^ (address - alloc->base);
+    return memcmp((char *)address + length, &canary, get_canary_length(alloc, order, length)) == 0;
+}
+
+// Prepares a block handed out by the public API, whose cookie may still be there if it came from a cache
+static void set_live(buddy_t *alloc, uintptr_t address, uint8_t order, size_t length) {
+    *(uint64_t *)address = 0;
+    set_canary(alloc, address, order, length);
+}
+
+// Counts a failed check. Returns -1.
+static int reject_block(buddy_t *alloc) {
+    STAT_ADD(&alloc->invalid_frees, 1);
+    errno = EINVAL;
+    return -1;
+}
+
+/* Checks the contents of a block about to be freed with the length it was
+ * allocated with, which only reads the block itself. It must not hold the
+ * cookie of a freed block, and the slack after the length must still hold
+ * its canary. Returns 0 if the block is intact, or -1 otherwise.
+ */
+static int check_contents(buddy_t *alloc, uintptr_t address, uint8_t order, size_t length) {
+    if (has_cookie(alloc, address)) {
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, address, order);
+        return reject_block(alloc);
+    }
+    if (!has_canary(alloc, address, order, length)) {
+        TRACE(alloc, BUDDY_EVENT_OVERFLOW, address, order);
+        return reject_block(alloc);
+    }
+    return 0;
+}
+
+/* Checks a block about to be freed or resized with the length it was
+ * allocated with. The address must also be the start of a block allocated at
+ * the order of the length. Returns 0 if the block is live and intact, or -1
+ * with the failure counted and traced otherwise.
+ */
+static int check_block(buddy_t *alloc, uintptr_t address, uint8_t order, size_t length) {
+    LOCK(alloc);
+    int allocated = get_allocated_order(alloc, address);
+    UNLOCK(alloc);
+
+    if (allocated != order) {
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, address, order);
+        return reject_block(alloc);
+    }
+    return check_contents(alloc, address, order, length);
+}
+#endif
+
+/* THREAD CACHES */
+#ifdef BUDDY_THREADS
+struct buddy_magazine {
+    uint32_t count;
+    void *blocks[BUDDY_CACHE_SIZE];
+};
+
+struct buddy_cache {
+    #ifdef BUDDY_CHECKED
+    // Tells the cache apart from live blocks in buddy_leak_report
+    uint64_t cookie;
+    #endif
+    buddy_t *alloc;
+    // Every cache of the allocator is listed, so buddy_mark can take their blocks back
+    struct buddy_cache *prev;
+    struct buddy_cache *next;
+    struct buddy_magazine magazines[BUDDY_CACHE_ORDERS];
+};
+
+// Marks threads that could not get a cache, so allocation is not retried on every call
+static char no_cache;
+
+// Returns all cached blocks to the free lists. The allocator lock must be held.
+static void cache_flush(struct buddy_cache *cache) {
+    for (int i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+        struct buddy_magazine *m = &cache->magazines[i];
+
+        free_blocks(cache->alloc, m->blocks, i, m->count);
+        m->count = 0;
+    }
+}
+
+// Takes the cache off the list of the allocator. The allocator lock must be held.
+static void cache_unlink(buddy_t *alloc, struct buddy_cache *cache) {
+    CACHES_LOCK(alloc);
+    if (cache->prev != NULL) cache->prev->next = cache->next;
+    else alloc->caches = cache->next;
+    if (cache->next != NULL) cache->next->prev = cache->prev;
+    CACHES_UNLOCK(alloc);
+}
+
+// Returns the cache and its blocks to the pool. The allocator lock must be held.
+static void cache_release(buddy_t *alloc, struct buddy_cache *cache) {
+    cache_flush(cache);
+    free_block(alloc, (uintptr_t)cache, get_order(alloc, sizeof(struct buddy_cache)));
+}
+
+// Called on thread exit to give the thread's cache back to the allocator
+static void cache_destroy(void *p) {
+    if (p == &no_cache) return;
+
+    struct buddy_cache *cache = p;
+    buddy_t *alloc = cache->alloc;
+
+    LOCK(alloc);
+    cache_unlink(alloc, cache);
+    cache_release(alloc, cache);
+    UNLOCK(alloc);
+}
+
+#if BUDDY_CACHE_ORDERS > 0
+// Returns the calling thread's cache, allocating it from the pool on first use
+static struct buddy_cache *get_cache(buddy_t *alloc) {
+    void *p = pthread_getspecific(alloc->cache_key);
+    if (p != NULL) return p == &no_cache ? NULL : p;
+
+    struct buddy_cache *cache = NULL;
+    if (sizeof(struct buddy_cache) <= (size_t)1 << alloc->max_log2) {
+        LOCK(alloc);
+        cache = (struct buddy_cache *)alloc_block(alloc, get_order(alloc, sizeof(struct buddy_cache)));
+        if (cache != NULL) {
+            #ifdef BUDDY_CHECKED
+            cache->cookie = get_cookie(alloc, (uintptr_t)cache);
+            #endif
+            cache->alloc = alloc;
+            for (int i = 0; i < BUDDY_CACHE_ORDERS; i++) {
+                cache->magazines[i].count = 0;
+            }
+
+            CACHES_LOCK(alloc);
+            cache->prev = NULL;
+            cache->next = alloc->caches;
+            if (cache->next != NULL) cache->next->prev = cache;
+            alloc->caches = cache;
+            CACHES_UNLOCK(alloc);
+        }
+        UNLOCK(alloc);
+    }
+
+    if (cache == NULL) {
+        pthread_setspecific(alloc->cache_key, &no_cache);
+        return NULL;
+    }
+
+    pthread_setspecific(alloc->cache_key, cache);
+    return cache;
+}
+
+static uintptr_t cache_alloc(buddy_t *alloc, struct buddy_cache *cache, uint8_t order) {
+    struct buddy_magazine *m = &cache->magazines[order];
+
+    if (m->count == 0) {
+        // Refill half of the magazine from the free lists in one batch
+        LOCK(alloc);
+        m->count = alloc_blocks(alloc, order, m->blocks, BUDDY_CACHE_SIZE / 2);
+        UNLOCK(alloc);
+
+        if (m->count == 0) return 0;
+
+        #ifdef BUDDY_CHECKED
+        for (uint32_t i = 0; i < m->count; i++) *(uint64_t *)m->blocks[i] = get_cookie(alloc, (uintptr_t)m->blocks[i]);
+        #endif
+    }
+    return (uintptr_t)m->blocks[--m->count];
+}
+
+static void cache_free(buddy_t *alloc, struct buddy_cache *cache, uintptr_t address, uint8_t order) {
+    struct buddy_magazine *m = &cache->magazines[order];
+
+    if (m->count == BUDDY_CACHE_SIZE) {
+        // Drain half of the magazine back to the free lists in one batch
+        LOCK(alloc);
+        free_blocks(alloc, m->blocks + BUDDY_CACHE_SIZE / 2, order, BUDDY_CACHE_SIZE - BUDDY_CACHE_SIZE / 2);
+        UNLOCK(alloc);
+
+        m->count = BUDDY_CACHE_SIZE / 2;
+    }
+    m->blocks[m->count++] = (void *)address;
+}
+#endif
+#endif
+
+/* DEFERRED MERGING */
+#ifdef BUDDY_LAZY_MERGE
+/* Merges every deferred block, an order at a time. The blocks of an order are
+ * taken out of its ring under its lock and merged in a batch outside of it.
+ * Returns the number of blocks merged.
+ */
+static size_t deferred_flush(buddy_t *alloc) {
+    size_t total = 0;
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        struct buddy_deferred *d = &alloc->deferred[order];
+        void *blocks[BUDDY_DEFER_SIZE];
+
+        ORDER_LOCK(alloc, order);
+        size_t n = d->count;
+        for (size_t i = 0; i < n; i++) blocks[i] = d->blocks[(d->first + i) % BUDDY_DEFER_SIZE];
+        d->first = 0;
+        d->count = 0;
+        ORDER_UNLOCK(alloc, order);
+
+        if (n == 0) continue;
+
+        // The blocks already left use when they were deferred, and free_blocks counts them as leaving use
+        STAT_ADD(&alloc->in_use, n << (order + alloc->min_log2));
+        free_blocks(alloc, blocks, order, n);
+        total += n;
+    }
+    return total;
+}
+
+/* Allocates the most recently deferred block of the order, which needs no
+ * split, or else a block from the free lists. Deferred blocks of every order
+ * are merged if the free lists cannot satisfy the request.
+ */
+static uintptr_t deferred_alloc(buddy_t *alloc, uint8_t order) {
+    struct buddy_deferred *d = &alloc->deferred[order];
+    uintptr_t address = 0;
+
+    ORDER_LOCK(alloc, order);
+    if (d->count != 0) address = (uintptr_t)d->blocks[(d->first + --d->count) % BUDDY_DEFER_SIZE];
+    ORDER_UNLOCK(alloc, order);
+
+    if (address != 0) {
+        add_in_use(alloc, (size_t)1 << (order + alloc->min_log2));
+        return address;
+    }
+
+    address = alloc_block(alloc, order);
+    if (address == 0 && deferred_flush(alloc) != 0) address = alloc_block(alloc, order);
+    return address;
+}
+
+/* Whether a block is in the deferred ring of its order, where it still looks
+ * allocated in the bit tree. Called with the lock of the order held.
+ */
+static int is_deferred(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    struct buddy_deferred *d = &alloc->deferred[order];
+
+    for (uint32_t i = 0; i < d->count; i++) {
+        if ((uintptr_t)d->blocks[(d->first + i) % BUDDY_DEFER_SIZE] == address) return 1;
+    }
+    return 0;
+}
+
+/* Defers merging a freed block, which stays marked allocated in the bit tree.
+ * Once the ring is full, the oldest deferred block makes room by being merged.
+ */
+static void deferred_free(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    struct buddy_deferred *d = &alloc->deferred[order];
+    uintptr_t oldest = 0;
+
+    ORDER_LOCK(alloc, order);
+    if (get_state(alloc, address, order) == 0 || is_deferred(alloc, address, order)) {
+        ORDER_UNLOCK(alloc, order);
+
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, address, order);
+        errno = EINVAL;
+        return;
+    }
+
+    if (d->count == BUDDY_DEFER_SIZE) {
+        oldest = (uintptr_t)d->blocks[d->first];
+        d->first = (d->first + 1) % BUDDY_DEFER_SIZE;
+        d->count--;
+    }
+    d->blocks[(d->first + d->count++) % BUDDY_DEFER_SIZE] = (void *)address;
+    ORDER_UNLOCK(alloc, order);
+
+    if (oldest == 0) {
+        STAT_SUB(&alloc->in_use, (size_t)1 << (order + alloc->min_log2));
+    } else {
+        // The oldest block left use when it was deferred, and free_block counts the freed block as leaving use in its place
+        free_block(alloc, oldest, order);
+    }
+}
+
+size_t buddy_coalesce(buddy_t *alloc) {
+    LOCK(alloc);
+    size_t n = deferred_flush(alloc);
+    UNLOCK(alloc);
+
+    return n;
+}
+
+#define ALLOC_BLOCK(alloc, order) deferred_alloc(alloc, order)
+#define FREE_BLOCK(alloc, address, order) deferred_free(alloc, address, order)
+#else
+#define ALLOC_BLOCK(alloc, order) alloc_block(alloc, order)
+#define FREE_BLOCK(alloc, address, order) free_block(alloc, address, order)
+#endif
+
+// Allocates a block of the given order, going through the calling thread's cache for small orders
+static uintptr_t alloc_order(buddy_t *alloc, uint8_t order) {
+    uintptr_t address;
+
+    #ifdef BUDDY_THREADS
+    #if BUDDY_CACHE_ORDERS > 0
+    struct buddy_cache *cache = order < BUDDY_CACHE_ORDERS ? get_cache(alloc) : NULL;
+    if (cache != NULL) {
+        address = cache_alloc(alloc, cache, order);
+        if (address != 0) return address;
+    }
+    #endif
+
+    LOCK(alloc);
+    address = ALLOC_BLOCK(alloc, order);
+
+    #if BUDDY_CACHE_ORDERS > 0
+    // Blocks held in this thread's cache may be needed to satisfy the request
+    cache = pthread_getspecific(alloc->cache_key);
+    if (address == 0 && cache != NULL && (void *)cache != &no_cache) {
+        cache_flush(cache);
+        address = ALLOC_BLOCK(alloc, order);
+    }
+    #endif
+    UNLOCK(alloc);
+    #else
+    address = ALLOC_BLOCK(alloc, order);
+    #endif
+
+    return address;
+}
+
+// Deallocates a block of the given order, going through the calling thread's cache for small orders
+static void free_order(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    #ifdef BUDDY_CHECKED
+    *(uint64_t *)address = get_cookie(alloc, address);
+    #endif
+
+    #if defined(BUDDY_THREADS) && BUDDY_CACHE_ORDERS > 0
+    struct buddy_cache *cache = order < BUDDY_CACHE_ORDERS ? get_cache(alloc) : NULL;
+    if (cache != NULL) {
+        cache_free(alloc, cache, address, order);
+        return;
+    }
+    #endif
+
+    LOCK(alloc);
+    FREE_BLOCK(alloc, address, order);
+    UNLOCK(alloc);
+}
+
+/* PLACEMENT HINTS */
+#ifndef BUDDY_ATOMIC
+/* Finds the free block of at least the target order with the lowest address
+ * in the subtree of a node that is free or split, or with the highest address
+ * if high is set. Only split nodes are descended into, upper child first when
+ * searching from the high end. Sets the order of the block found, and returns
+ * 0 if the subtree has no such block.
+ */
+static uintptr_t find_hinted(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t target, int high, uint8_t *found) {
+    if (get_state(alloc, address, order) == 0) {
+        *found = order;
+        return address;
+    }
+    if (order == target) return 0;
+
+    uintptr_t upper = address + ((size_t)1 << (order - 1 + alloc->min_log2));
+
+    // A marked node without a marked child is allocated
+    if (get_state(alloc, address, order - 1) == 0 && get_state(alloc, upper, order - 1) == 0) return 0;
+
+    uintptr_t block = find_hinted(alloc, high ? upper : address, order - 1, target, high, found);
+    if (block == 0) block = find_hinted(alloc, high ? address : upper, order - 1, target, high, found);
+    return block;
+}
+
+// Splits a block like split, but keeps the upper half at each step when high is set
+static uintptr_t split_hinted(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t target, int high) {
+    if (!high) return split(alloc, address, order, target);
+
+    while (order > target) {
+        TRACE(alloc, BUDDY_EVENT_SPLIT, address, order);
+        STAT_ADD(&alloc->splits, 1);
+
+        order--;
+
+        uintptr_t lower = address;
+        address += (size_t)1 << (order + alloc->min_log2);
+
+        // Mark the upper half as allocated or split, the lower half is already marked free
+        set_state(alloc, address, order, 1);
+        append(alloc, lower, order);
+    }
+    return address;
+}
+
+/* Allocates a block of the given order from the free block with the lowest
+ * address large enough, or the highest if high is set. Called with the lock
+ * held. Blocks of the max order past the frontier are not searched. Returns 0
+ * if no block is found.
+ */
+static uintptr_t alloc_hinted(buddy_t *alloc, uint8_t target, int high) {
+    size_t roots = (size_t)1 << (alloc->mem_log2 - alloc->max_log2);
+    uintptr_t address = 0;
+    uint8_t order = 0;
+
+    for (size_t i = 0; i < roots && address == 0; i++) {
+        uintptr_t root = alloc->base + ((high ? roots - 1 - i : i) << alloc->max_log2);
+
+        #ifdef BUDDY_LAZY
+        if (root >= alloc->frontier && root < alloc->frontier_end) continue;
+        #endif
+
+        address = find_hinted(alloc, root, alloc->max_order, target, high, &order);
+    }
+    if (address == 0) return 0;
+
+    free_list_remove(alloc, address, order);
+    set_state(alloc, address, order, 1);
+
+    add_in_use(alloc, (size_t)1 << (target + alloc->min_log2));
+    return split_hinted(alloc, address, order, target, high);
+}
+#endif
+
+/* SLABS */
+#ifdef BUDDY_SLAB
+#define SLAB_MAGIC 0x534c4142
+
+#ifdef BUDDY_ATOMIC
+#define SLAB_LOCK(alloc, c) spin_lock(&(alloc)->slab_classes[c].lock)
+#define SLAB_UNLOCK(alloc, c) spin_unlock(&(alloc)->slab_classes[c].lock)
+#else
+#define SLAB_LOCK(alloc, c) LOCK(alloc)
+#define SLAB_UNLOCK(alloc, c) UNLOCK(alloc)
+#endif
+
+/* Header at the start of every slab. Set bits of the bitmap are free objects.
+ * The magic tells a slab apart from other blocks when freeing without a size.
+ */
+struct buddy_slab {
+    struct buddy_slab *prev;
+    struct buddy_slab *next;
+    uint32_t magic;
+    uint32_t size_class;
+    uint32_t used;
+    uint32_t reserved;
+    uint64_t bitmap[];
+};
+
+static int is_slab_size(buddy_t *alloc, size_t length) {
+    return length <= BUDDY_SLAB_MAX && alloc->slab_log2 != 0;
+}
+
+static uint8_t get_slab_class(size_t length) {
+    return length <= 8 ? 0 : (length + 15) >> 4;
+}
+
+static size_t get_class_size(uint8_t c) {
+    return c == 0 ? 8 : (size_t)c << 4;
+}
+
+// Lays out the slabs of every class, fitting as many objects as possible after the header and bitmap
+static void slab_setup(buddy_t *alloc) {
+    alloc->slab_log2 = alloc->min_log2 > BUDDY_SLAB_LOG2 ? alloc->min_log2 : BUDDY_SLAB_LOG2;
+    if (alloc->slab_log2 > alloc->max_log2) alloc->slab_log2 = 0;
+
+    size_t slab_size = (size_t)1 << alloc->slab_log2;
+    for (uint8_t c = 0; c < BUDDY_SLAB_CLASSES; c++) {
+        struct buddy_slab_class *cls = &alloc->slab_classes[c];
+        size_t size = get_class_size(c);
+        size_t align = size & -size;
+        size_t capacity = slab_size / size;
+        size_t first;
+
+        cls->partial = NULL;
+        #ifdef BUDDY_ATOMIC
+        cls->lock.value = 0;
+        #endif
+        if (alloc->slab_log2 == 0) continue;
+
+        for (;; capacity--) {
+            first = sizeof(struct buddy_slab) + (capacity + 63) / 64 * sizeof(uint64_t);
+            first = (first + align - 1) & ~(align - 1);
+            if (first + capacity * size <= slab_size) break;
+        }
+        cls->capacity = capacity;
+        cls->first = first;
+    }
+}
+
+static void slab_push(struct buddy_slab_class *cls, struct buddy_slab *slab) {
+    slab->prev = NULL;
+    slab->next = cls->partial;
+    if (cls->partial) cls->partial->prev = slab;
+    cls->partial = slab;
+}
+
+static void slab_remove(struct buddy_slab_class *cls, struct buddy_slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else cls->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+// Takes a block for a new slab of the class from the pool, with all of its objects free
+static struct buddy_slab *slab_create(buddy_t *alloc, uint8_t c) {
+    struct buddy_slab_class *cls = &alloc->slab_classes[c];
+    uint8_t order = alloc->slab_log2 - alloc->min_log2;
+
+    uintptr_t address = alloc_order(alloc, order);
+    if (address == 0) return NULL;
+
+    TRACE(alloc, BUDDY_EVENT_ALLOC, address, order);
+
+    struct buddy_slab *slab = (struct buddy_slab *)address;
+    slab->magic = SLAB_MAGIC;
+    slab->size_class = c;
+    slab->used = 0;
+    slab->reserved = 0;
+
+    size_t words = (cls->capacity + 63) / 64;
+    for (size_t i = 0; i < words; i++) slab->bitmap[i] = UINT64_MAX;
+    if (cls->capacity % 64) slab->bitmap[words - 1] = ((uint64_t)1 << (cls->capacity % 64)) - 1;
+
+    return slab;
+}
+
+static void *slab_malloc(buddy_t *alloc, size_t length) {
+    uint8_t c = get_slab_class(length);
+    struct buddy_slab_class *cls = &alloc->slab_classes[c];
+
+    SLAB_LOCK(alloc, c);
+    struct buddy_slab *slab = cls->partial;
+    if (slab == NULL) {
+        // The pool's own locks are taken to allocate the slab, so the class lock cannot be held
+        SLAB_UNLOCK(alloc, c);
+        slab = slab_create(alloc, c);
+        if (slab == NULL) return NULL;
+
+        SLAB_LOCK(alloc, c);
+        slab_push(cls, slab);
+    }
+
+    size_t i = 0;
+    while (slab->bitmap[i] == 0) i++;
+
+    size_t index = i * 64 + __builtin_ctzll(slab->bitmap[i]);
+    slab->bitmap[i] &= slab->bitmap[i] - 1;
+
+    if (++slab->used == cls->capacity) slab_remove(cls, slab);
+    SLAB_UNLOCK(alloc, c);
+
+    return (char *)slab + cls->first + index * get_class_size(c);
+}
+
+// Returns the slab an address belongs to, or NULL if it is not inside a slab
+static struct buddy_slab *get_slab(buddy_t *alloc, uintptr_t address) {
+    if (alloc->slab_log2 == 0) return NULL;
+    if (address < alloc->base + alloc->offset || address - alloc->base - alloc->offset >= alloc->size) return NULL;
+
+    struct buddy_slab *slab = (struct buddy_slab *)(alloc->base + ((address - alloc->base) & ~(((size_t)1 << alloc->slab_log2) - 1)));
+    if ((uintptr_t)slab < alloc->base + alloc->offset || slab->magic != SLAB_MAGIC) return NULL;
+    return slab;
+}
+
+// Returns an object to its slab, and the slab to the pool if it is empty and another slab of its class has free objects
+static int slab_free(buddy_t *alloc, struct buddy_slab *slab, uintptr_t address) {
+    uint8_t c = slab->size_class;
+    struct buddy_slab_class *cls = &alloc->slab_classes[c];
+    size_t size = get_class_size(c);
+
+    size_t offset = address - (uintptr_t)slab;
+    if (offset < cls->first || (offset - cls->first) % size != 0) return -1;
+
+    size_t index = (offset - cls->first) / size;
+    if (index >= cls->capacity) return -1;
+
+    uint64_t bit = (uint64_t)1 << (index % 64);
+
+    SLAB_LOCK(alloc, c);
+    if (slab->bitmap[index / 64] & bit) {
+        SLAB_UNLOCK(alloc, c);
+        return -1;
+    }
+
+    slab->bitmap[index / 64] |= bit;
+    if (slab->used-- == cls->capacity) slab_push(cls, slab);
+
+    int release = slab->used == 0 && (cls->partial != slab || slab->next != NULL);
+    if (release) slab_remove(cls, slab);
+    SLAB_UNLOCK(alloc, c);
+
+    if (release) {
+        uint8_t order = alloc->slab_log2 - alloc->min_log2;
+
+        slab->magic = 0;
+        TRACE(alloc, BUDDY_EVENT_FREE, (uintptr_t)slab, order);
+        free_order(alloc, (uintptr_t)slab, order);
+    }
+    return 0;
+}
+#endif
+
+// Size of the buddy struct, free lists and bit tree for the given geometry
+static size_t header_size(uint8_t mem_log2, uint8_t min_log2, uint8_t max_log2, size_t *tree_words) {
+    #ifdef BUDDY_BLOCKED_TREE
+    *tree_words = (get_tree_levels(mem_log2, min_log2, max_log2, NULL) + 31) / 32;
+    #else
+    size_t total_nodes = ((size_t)1 << (mem_log2 - min_log2 + 1)) - 1;
+    size_t truncated_nodes = ((size_t)1 << (mem_log2 - max_log2)) - 1;
+
+    *tree_words = (total_nodes - truncated_nodes + 31) / 32;
+    #endif
+
+    size_t size = sizeof(buddy_t)
+        #ifdef BUDDY_FREE_MAPS
+        + (max_log2 - min_log2 + 1) * sizeof(struct buddy_free_map)
+        #endif
+        #ifndef BUDDY_TREE_ONLY
+        + FREE_LISTS * (max_log2 - min_log2 + 1) * sizeof(buddy_page_t *)
+        #endif
+        + (max_log2 - min_log2 + 1) * sizeof(size_t)
+        #ifdef BUDDY_LAZY_MERGE
+        + (max_log2 - min_log2 + 1) * sizeof(struct buddy_deferred)
+        #endif
+        #ifdef BUDDY_ATOMIC
+        + (max_log2 - min_log2 + 1) * sizeof(struct buddy_lock)
+        #endif
+        #ifdef BUDDY_BLOCKED_TREE
+        + (max_log2 - min_log2 + 1) * sizeof(struct buddy_tree_level) + TREE_LINE - 1
+        #endif
+        + *tree_words * sizeof(uint32_t)
+        #ifdef BUDDY_TRIM
+        + (((size_t)1 << (mem_log2 - min_log2)) + 31) / 32 * sizeof(uint32_t)
+        #endif
+        ;
+
+    #ifdef BUDDY_FREE_MAPS
+    // The free maps follow, aligned for their words
+    size = (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+    for (uint8_t order = 0; order <= max_log2 - min_log2; order++) {
+        size += get_map_words(mem_log2 - min_log2 - order) * sizeof(uint64_t);
+    }
+    #endif
+
+    // Keep blocks after the header aligned for free list nodes
+    return (size + _Alignof(buddy_t) - 1) & ~(_Alignof(buddy_t) - 1);
+}
+
+// Order of the largest block aligned to its own size that starts at the address and fits before the end
+static uint8_t get_range_order(buddy_t *alloc, uintptr_t address, uintptr_t end) {
+    uint8_t order = get_floor_order(alloc, end - address);
+
+    if (address != alloc->base) {
+        uint8_t align = __builtin_ctzl(address - alloc->base) - alloc->min_log2;
+        if (align < order) order = align;
+    }
+    return order;
+}
+
+// Mark memory in the range [address, end) as reserved, using the largest aligned blocks possible
+static void reserve(buddy_t *alloc, uintptr_t address, uintptr_t end) {
+    while (address < end) {
+        uint8_t order = get_range_order(alloc, address, end);
+
+        // Mark block as reserved and its ancestors as split in the bit tree
+        for (uint8_t i = order; i <= alloc->max_order; i++) {
+            set_state(alloc, address, i, 1);
+        }
+
+        address += (size_t)1 << (order + alloc->min_log2);
+    }
+}
+
+static int valid_geometry(uint8_t min_log2, uint8_t max_log2) {
+    if (((size_t)1 << min_log2) < sizeof(buddy_page_t) || min_log2 > max_log2 || max_log2 >= sizeof(size_t) * 8) {
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Returns the base the bit tree covering the memory in [start, end) is indexed
+ * from, and the log2 of the memory the tree covers. The base is aligned to the
+ * power of 2 that covers the memory, so every block is aligned to its own size
+ * in absolute terms. The base can be below the start of the memory, in which
+ * case the tree needs to cover twice the memory.
+ */
+static uintptr_t get_tree_base(uintptr_t start, uintptr_t end, uint8_t *mem_log2) {
+    uintptr_t origin = start & ~(((uintptr_t)1 << ceil_log2(end - start)) - 1);
+
+    *mem_log2 = ceil_log2(end - origin);
+    return origin;
+}
+
+// Returns the first minimum size block at or after the address
+static uintptr_t align_start(uintptr_t address, uint8_t min_log2) {
+    size_t min_size = (size_t)1 << min_log2;
+
+    return (address + min_size - 1) & ~(min_size - 1);
+}
+
+// Empties the free lists of every order, or their free maps unless they are already zeroed
+static void clear_lists(buddy_t *alloc, int zeroed) {
+    alloc->free_orders = 0;
+    for (int i = 0; i <= alloc->max_order; i++) {
+        #ifdef BUDDY_FREE_MAPS
+        if (!zeroed) memset(alloc->free_maps[i].top, 0, get_map_words(alloc->mem_log2 - alloc->min_log2 - i) * sizeof(uint64_t));
+        #endif
+        #ifndef BUDDY_TREE_ONLY
+        alloc->free_lists[i] = NULL;
+        #endif
+        alloc->free_counts[i] = 0;
+        #ifdef BUDDY_LAZY_MERGE
+        alloc->deferred[i].first = 0;
+        alloc->deferred[i].count = 0;
+        #endif
+        #ifdef BUDDY_PURGE
+        alloc->purged_lists[i] = NULL;
+        #endif
+        #ifdef BUDDY_ATOMIC
+        alloc->order_locks[i].value = 0;
+        #endif
+    }
+    #ifndef BUDDY_FREE_MAPS
+    (void)zeroed;
+    #endif
+}
+
+/* Marks every block of an allocator laid out by setup as free, clearing the
+ * bit tree unless it is already zeroed, and adds the memory to the free lists.
+ */
+static void clear(buddy_t *alloc, int zeroed) {
+    uintptr_t origin = alloc->base, start = alloc->base + alloc->offset, end = start + alloc->size;
+
+    // Initialize bit tree - all bits initially set to 0 (free, not split)
+    if (!zeroed) memset(alloc->bit_tree, 0, alloc->tree_words * sizeof(uint32_t));
+
+    #ifdef BUDDY_TRIM
+    if (!zeroed) memset(alloc->run_bits, 0, (((size_t)1 << (alloc->mem_log2 - alloc->min_log2)) + 31) / 32 * sizeof(uint32_t));
+    #endif
+
+    clear_lists(alloc, zeroed);
+    alloc->in_use = 0;
+
+    #ifdef BUDDY_SLAB
+    slab_setup(alloc);
+    #endif
+
+    // Mark memory before the start of the pool as reserved
+    reserve(alloc, origin, start);
+
+    uintptr_t address = start;
+
+    #ifdef BUDDY_LAZY
+    alloc->frontier = 0;
+    alloc->frontier_end = 0;
+    #endif
+
+    // Add free memory blocks to free lists
+    while (end - address >= (size_t)1 << alloc->min_log2) {
+        uint8_t order = get_range_order(alloc, address, end);
+
+        #ifdef BUDDY_LAZY
+        // The blocks of the max order are consecutive, and are left past the frontier instead
+        if (order == alloc->max_order) {
+            alloc->frontier = address;
+            alloc->frontier_end = address + ((end - address) >> alloc->max_log2 << alloc->max_log2);
+            ATOMIC_OR(&alloc->free_orders, (uint64_t)1 << order);
+
+            address = alloc->frontier_end;
+            continue;
+        }
+        #endif
+
+        append(alloc, address, order);
+
+        address += (size_t)1 << (order + alloc->min_log2);
+    }
+
+    // Mark memory past the end of the pool as reserved
+    reserve(alloc, address, origin + ((size_t)1 << alloc->mem_log2));
+}
+
+/* Points the allocator at its tables, which follow the buddy struct in the
+ * metadata storage in an order that only depends on its geometry.
+ */
+static void place_tables(buddy_t *alloc) {
+    char *tables = (char *)alloc + sizeof(buddy_t);
+
+    #ifdef BUDDY_FREE_MAPS
+    alloc->free_maps = (struct buddy_free_map *)tables;
+    tables = (char *)(alloc->free_maps + (alloc->max_order + 1));
+    #endif
+    #ifndef BUDDY_TREE_ONLY
+    alloc->free_lists = (buddy_page_t **)tables;
+    tables = (char *)(alloc->free_lists + FREE_LISTS * (alloc->max_order + 1));
+    #endif
+    #ifdef BUDDY_PURGE
+    alloc->purged_lists = alloc->free_lists + (alloc->max_order + 1);
+    #endif
+    alloc->free_counts = (size_t *)tables;
+    tables = (char *)(alloc->free_counts + (alloc->max_order + 1));
+    #ifdef BUDDY_LAZY_MERGE
+    alloc->deferred = (struct buddy_deferred *)tables;
+    tables = (char *)(alloc->deferred + (alloc->max_order + 1));
+    #endif
+    #ifdef BUDDY_ATOMIC
+    alloc->order_locks = (struct buddy_lock *)tables;
+    alloc->bit_tree = (uint32_t *)(alloc->order_locks + (alloc->max_order + 1));
+    #else
+    alloc->bit_tree = (uint32_t *)tables;
+    #endif
+    #ifdef BUDDY_BLOCKED_TREE
+    alloc->tree_levels = (struct buddy_tree_level *)alloc->bit_tree;
+    alloc->bit_tree = (uint32_t *)(((uintptr_t)(alloc->tree_levels + (alloc->max_order + 1)) + TREE_LINE - 1) & ~(TREE_LINE - 1));
+    get_tree_levels(alloc->mem_log2, alloc->min_log2, alloc->max_log2, alloc->tree_levels);
+    #endif
+    #ifdef BUDDY_TRIM
+    alloc->run_bits = alloc->bit_tree + alloc->tree_words;
+    #endif
+    #ifdef BUDDY_FREE_MAPS
+    #ifdef BUDDY_TRIM
+    uintptr_t maps = (uintptr_t)(alloc->run_bits + (((size_t)1 << (alloc->mem_log2 - alloc->min_log2)) + 31) / 32);
+    #else
+    uintptr_t maps = (uintptr_t)(alloc->bit_tree + alloc->tree_words);
+    #endif
+    uint64_t *words = (uint64_t *)((maps + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
+
+    // Lay out the free map of each order, top level first, with every level empty
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        uint8_t bits = alloc->mem_log2 - alloc->min_log2 - order;
+        size_t count = get_map_words(bits);
+
+        alloc->free_maps[order].top = words;
+        alloc->free_maps[order].bottom = words + count - get_map_level_words(bits, 0);
+        words += count;
+    }
+    #endif
+}
+
+#ifdef BUDDY_RELOCATABLE
+// Identifies the header of a relocatable pool
+#define RELOCATABLE_MAGIC 0x52454c4f43425544
+
+// The size of the buddy struct and the flags the layout of the metadata depends on
+static uint64_t get_layout(void) {
+    uint64_t layout = sizeof(buddy_t);
+    #ifdef BUDDY_THREADS
+    layout |= (uint64_t)1 << 32;
+    #endif
+    #ifdef BUDDY_ATOMIC
+    layout |= (uint64_t)1 << 33;
+    #endif
+    #ifdef BUDDY_TRIM
+    layout |= (uint64_t)1 << 34;
+    #endif
+    #ifdef BUDDY_PURGE
+    layout |= (uint64_t)1 << 35;
+    #endif
+    #ifdef BUDDY_BLOCKED_TREE
+    layout |= (uint64_t)1 << 36 | (uint64_t)BUDDY_TREE_BAND_LEVELS << 48;
+    #endif
+    #ifdef BUDDY_TREE_ONLY
+    layout |= (uint64_t)1 << 37;
+    #endif
+    #ifdef BUDDY_LAZY
+    layout |= (uint64_t)1 << 38;
+    #endif
+    #ifdef BUDDY_LAZY_MERGE
+    layout |= (uint64_t)1 << 39 | (uint64_t)sizeof(struct buddy_deferred) << 40;
+    #endif
+    #ifdef BUDDY_ADDRESS_ORDERED
+    layout |= (uint64_t)1 << 56;
+    #endif
+    return layout;
+}
+#endif
+
+/* Sets up the allocator in the metadata storage for the memory in [start,
+ * end). The free lists and bit tree are placed right after the buddy struct,
+ * and the memory is added to the free lists. The storage must be large enough
+ * for the geometry. The bit tree and the other tables are only cleared if the
+ * storage is not already zeroed.
+ */
+static buddy_t *setup(char *meta, uintptr_t start, uintptr_t end, uint8_t min_log2, uint8_t max_log2, int zeroed) {
+    uint8_t mem_log2;
+    uintptr_t origin = get_tree_base(start, end, &mem_log2);
+    if (max_log2 > mem_log2) max_log2 = mem_log2;
+
+    size_t tree_words;
+    header_size(mem_log2, min_log2, max_log2, &tree_words);
+
+    buddy_t *alloc = (buddy_t *) meta;
+    alloc->base = origin;
+    alloc->offset = start - origin;
+    alloc->size = end - start;
+    alloc->min_log2 = min_log2;
+    alloc->max_log2 = max_log2;
+    alloc->mem_log2 = mem_log2;
+    alloc->max_order = max_log2 - min_log2;
+    alloc->truncated_nodes = ((size_t)1 << (mem_log2 - max_log2)) - 1;
+    alloc->tree_words = tree_words;
+    place_tables(alloc);
+
+    // Initialize statistics
+    alloc->peak_in_use = 0;
+    alloc->failed_allocs = 0;
+    alloc->splits = 0;
+    alloc->merges = 0;
+    #ifdef BUDDY_CHECKED
+    alloc->invalid_frees = 0;
+    #endif
+
+    #ifdef BUDDY_PURGE
+    // Blocks of at least two pages can release all but their first page
+    uint8_t page_log2 = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+    alloc->purge_order = page_log2 + 1 > min_log2 ? page_log2 + 1 - min_log2 : 0;
+    alloc->purge_epoch = 0;
+    #ifdef BUDDY_THREADS
+    alloc->purger.running = 0;
+    #endif
+    #endif
+
+    clear(alloc, zeroed);
+
+    #ifdef BUDDY_RELOCATABLE
+    alloc->magic = RELOCATABLE_MAGIC;
+    alloc->layout = get_layout();
+    alloc->meta = (uintptr_t)alloc;
+    #endif
+    return alloc;
+}
+
+/* Creates the lock and the thread cache key of an allocator set up to be
+ * shared between threads. Returns NULL if the allocator could not be set up
+ * or either of them cannot be created.
+ */
+static buddy_t *init_threads(buddy_t *alloc) {
+    #ifdef BUDDY_THREADS
+    if (alloc == NULL) return NULL;
+
+    #ifndef BUDDY_ATOMIC
+    int err = pthread_mutex_init(&alloc->lock, NULL);
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+    #else
+    int err;
+    #endif
+    err = pthread_key_create(&alloc->cache_key, cache_destroy);
+    if (err != 0) {
+        #ifndef BUDDY_ATOMIC
+        pthread_mutex_destroy(&alloc->lock);
+        #endif
+        errno = err;
+        return NULL;
+    }
+
+    // Caches left by a previous attach are not listed again, and stay allocated
+    alloc->caches = NULL;
+    #ifdef BUDDY_ATOMIC
+    alloc->caches_lock.value = 0;
+    #endif
+    #endif
+
+    return alloc;
+}
+
+buddy_t *buddy_init(char *base, size_t length) {
+    return buddy_init_ex(base, length, MIN_BLOCK_LOG2, MAX_BLOCK_LOG2);
+}
+
+static buddy_t *init_ex(char *base, size_t length, uint8_t min_log2, uint8_t max_log2, int zeroed) {
+    if (!valid_geometry(min_log2, max_log2)) return NULL;
+
+    size_t pad = -(uintptr_t) base & (_Alignof(buddy_t) - 1);
+    if (length < pad) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    base += pad;
+    length -= pad;
+
+    uintptr_t start, end = (uintptr_t)base + length;
+
+    // The header holds the bit tree, whose size depends on where the memory after the header starts
+    size_t header = 0;
+    for (;;) {
+        start = align_start((uintptr_t)base + header, min_log2);
+        if (start >= end || end - start < (size_t)1 << min_log2) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        uint8_t mem_log2;
+        size_t tree_words;
+        get_tree_base(start, end, &mem_log2);
+
+        size_t need = header_size(mem_log2, min_log2, max_log2 > mem_log2 ? mem_log2 : max_log2, &tree_words);
+        if (need <= header) break;
+        header = need;
+    }
+
+    return setup(base, start, end, min_log2, max_log2, zeroed);
+}
+
+buddy_t *buddy_init_ex(char *base, size_t length, uint8_t min_log2, uint8_t max_log2) {
+    return init_threads(init_ex(base, length, min_log2, max_log2, 0));
+}
+
+size_t buddy_metadata_size(char *base, size_t length, uint8_t min_log2, uint8_t max_log2) {
+    if (!valid_geometry(min_log2, max_log2)) return 0;
+
+    uintptr_t start = align_start((uintptr_t)base, min_log2), end = (uintptr_t)base + length;
+    if (start >= end || end - start < (size_t)1 << min_log2) return 0;
+
+    uint8_t mem_log2;
+    size_t tree_words;
+    get_tree_base(start, end, &mem_log2);
+
+    // Leave room to align the buddy struct within the metadata storage
+    return header_size(mem_log2, min_log2, max_log2 > mem_log2 ? mem_log2 : max_log2, &tree_words) + _Alignof(buddy_t) - 1;
+}
+
+static buddy_t *init_oob(char *meta, size_t meta_length, char *base, size_t length, uint8_t min_log2, uint8_t max_log2, int zeroed) {
+    if (!valid_geometry(min_log2, max_log2)) return NULL;
+
+    size_t need = buddy_metadata_size(base, length, min_log2, max_log2);
+    if (need == 0 || meta_length < need) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    meta += -(uintptr_t) meta & (_Alignof(buddy_t) - 1);
+
+    return setup(meta, align_start((uintptr_t)base, min_log2), (uintptr_t)base + length, min_log2, max_log2, zeroed);
+}
+
+buddy_t *buddy_init_oob(char *meta, size_t meta_length, char *base, size_t length, uint8_t min_log2, uint8_t max_log2) {
+    return init_threads(init_oob(meta, meta_length, base, length, min_log2, max_log2, 0));
+}
+
+#ifdef BUDDY_LAZY
+buddy_t *buddy_init_zeroed(char *base, size_t length, uint8_t min_log2, uint8_t max_log2) {
+    return init_threads(init_ex(base, length, min_log2, max_log2, 1));
+}
+
+buddy_t *buddy_init_oob_zeroed(char *meta, size_t meta_length, char *base, size_t length, uint8_t min_log2, uint8_t max_log2) {
+    return init_threads(init_oob(meta, meta_length, base, length, min_log2, max_log2, 1));
+}
+#endif
+
+#ifdef BUDDY_RELOCATABLE
+/* Returns the allocator in the metadata storage after moving it by delta, the
+ * distance the pool moved, or NULL if the storage holds no allocator built
+ * with the same flags. The storage is aligned as it was by setup.
+ */
+static buddy_t *attach(char *meta, uintptr_t delta) {
+    buddy_t *alloc = (buddy_t *)meta;
+    if (alloc->magic != RELOCATABLE_MAGIC || alloc->layout != get_layout()) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    place_tables(alloc);
+    alloc->meta = (uintptr_t)alloc;
+    alloc->base += delta;
+
+    #ifdef BUDDY_LAZY
+    alloc->frontier += delta;
+    alloc->frontier_end += delta;
+    #endif
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        #ifdef BUDDY_LAZY_MERGE
+        struct buddy_deferred *d = &alloc->deferred[order];
+        for (uint32_t i = 0; i < d->count; i++) {
+            void **block = &d->blocks[(d->first + i) % BUDDY_DEFER_SIZE];
+            *block = (char *)*block + delta;
+        }
+        #endif
+        #ifdef BUDDY_ATOMIC
+        // Locks held when the pool was last used were held by threads that are gone
+        alloc->order_locks[order].value = 0;
+        #endif
+    }
+
+    #if defined(BUDDY_PURGE) && defined(BUDDY_THREADS)
+    alloc->purger.running = 0;
+    #endif
+    return alloc;
+}
+
+buddy_t *buddy_attach(char *base) {
+    char *meta = base + (-(uintptr_t) base & (_Alignof(buddy_t) - 1));
+
+    return init_threads(attach(meta, (uintptr_t)meta - ((buddy_t *)meta)->meta));
+}
+
+buddy_t *buddy_attach_oob(char *meta, char *base) {
+    meta += -(uintptr_t) meta & (_Alignof(buddy_t) - 1);
+    buddy_t *alloc = (buddy_t *)meta;
+
+    return init_threads(attach(meta, align_start((uintptr_t)base, alloc->min_log2) - (alloc->base + alloc->offset)));
+}
+#endif
+
+void *buddy_malloc(buddy_t *alloc, size_t length) {
+    #ifdef BUDDY_SLAB
+    if (is_slab_size(alloc, length)) {
+        void *addr = slab_malloc(alloc, length);
+        if (addr == NULL) {
+            STAT_ADD(&alloc->failed_allocs, 1);
+            errno = ENOMEM;
+        }
+        RECORD(alloc, BUDDY_RECORD_MALLOC, (uintptr_t)addr, length);
+        return addr;
+    }
+    #endif
+
+    if (length > (size_t)1 << alloc->max_log2) {
+        RECORD(alloc, BUDDY_RECORD_MALLOC, 0, length);
+        STAT_ADD(&alloc->failed_allocs, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uint8_t order = get_order(alloc, length);
+
+    uintptr_t address = alloc_order(alloc, order);
+    if (address == 0) {
+        TRACE(alloc, BUDDY_EVENT_OOM, alloc->base, order);
+        RECORD(alloc, BUDDY_RECORD_MALLOC, 0, length);
+        STAT_ADD(&alloc->failed_allocs, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    #ifdef BUDDY_CHECKED
+    set_live(alloc, address, order, length);
+    #endif
+
+    TRACE(alloc, BUDDY_EVENT_ALLOC, address, order);
+    RECORD(alloc, BUDDY_RECORD_MALLOC, address, length);
+    return (char *)address;
+}
+
+/* Blocks are aligned to their own size, so a block at least as large as the
+ * alignment is aligned. Rounding up to a multiple of the alignment gives the
+ * same block, and a slab class whose objects are aligned. Sizes too large for
+ * a block are left alone, as buddy_malloc rejects them either way.
+ */
+static size_t get_aligned_length(buddy_t *alloc, size_t align, size_t length) {
+    if (length > (size_t)1 << alloc->max_log2) return length;
+    return length ? (length + align - 1) & ~(align - 1) : align;
+}
+
+void *buddy_aligned_alloc(buddy_t *alloc, size_t align, size_t length) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return buddy_malloc(alloc, get_aligned_length(alloc, align, length));
+}
+
+void buddy_aligned_free(buddy_t *alloc, void *addr, size_t align, size_t length) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return;
+    }
+
+    buddy_free(alloc, addr, get_aligned_length(alloc, align, length));
+}
+
+size_t buddy_malloc_batch(buddy_t *alloc, size_t length, void **out, size_t n) {
+    #ifdef BUDDY_SLAB
+    if (is_slab_size(alloc, length)) {
+        size_t count = 0;
+        while (count < n && (out[count] = buddy_malloc(alloc, length)) != NULL) count++;
+        return count;
+    }
+    #endif
+
+    if (length > (size_t)1 << alloc->max_log2) {
+        #ifdef BUDDY_RECORD
+        for (size_t i = 0; i < n; i++) RECORD(alloc, BUDDY_RECORD_MALLOC, 0, length);
+        #endif
+        STAT_ADD(&alloc->failed_allocs, n);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    uint8_t order = get_order(alloc, length);
+
+    LOCK(alloc);
+    size_t count = alloc_blocks(alloc, order, out, n);
+    #ifdef BUDDY_LAZY_MERGE
+    // Deferred blocks may hold the memory the rest of the batch needs
+    if (count < n && deferred_flush(alloc) != 0) count += alloc_blocks(alloc, order, out + count, n - count);
+    #endif
+    UNLOCK(alloc);
+
+    #ifdef BUDDY_CHECKED
+    for (size_t i = 0; i < count; i++) set_live(alloc, (uintptr_t)out[i], order, length);
+    #endif
+
+    #if defined(BUDDY_TRACE) || defined(BUDDY_RECORD)
+    for (size_t i = 0; i < count; i++) {
+        TRACE(alloc, BUDDY_EVENT_ALLOC, (uintptr_t)out[i], order);
+        RECORD(alloc, BUDDY_RECORD_MALLOC, (uintptr_t)out[i], length);
+    }
+    #endif
+
+    if (count < n) {
+        TRACE(alloc, BUDDY_EVENT_OOM, alloc->base, order);
+        #ifdef BUDDY_RECORD
+        for (size_t i = count; i < n; i++) RECORD(alloc, BUDDY_RECORD_MALLOC, 0, length);
+        #endif
+        STAT_ADD(&alloc->failed_allocs, n - count);
+        errno = ENOMEM;
+    }
+    return count;
+}
+
+void *buddy_malloc_hint(buddy_t *alloc, size_t length, int flags) {
+    if ((flags & ~(BUDDY_HINT_SHORT_LIVED | BUDDY_HINT_LONG_LIVED)) != 0 || flags == (BUDDY_HINT_SHORT_LIVED | BUDDY_HINT_LONG_LIVED)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    #ifndef BUDDY_ATOMIC
+    #ifdef BUDDY_SLAB
+    // Slab objects are placed by their size class
+    if (is_slab_size(alloc, length)) flags = 0;
+    #endif
+
+    if (flags != 0 && length <= (size_t)1 << alloc->max_log2) {
+        uint8_t order = get_order(alloc, length);
+
+        LOCK(alloc);
+        uintptr_t address = alloc_hinted(alloc, order, flags == BUDDY_HINT_LONG_LIVED);
+        UNLOCK(alloc);
+
+        if (address != 0) {
+            #ifdef BUDDY_CHECKED
+            set_live(alloc, address, order, length);
+            #endif
+
+            TRACE(alloc, BUDDY_EVENT_ALLOC, address, order);
+            RECORD(alloc, BUDDY_RECORD_MALLOC, address, length);
+            return (char *)address;
+        }
+    }
+    #endif
+
+    // Blocks in thread caches, deferred blocks and blocks past the frontier are only reached by buddy_malloc
+    return buddy_malloc(alloc, length);
+}
+
+#ifdef BUDDY_TRIM
+void *buddy_malloc_trimmed(buddy_t *alloc, size_t length) {
+    size_t blocks = get_run_blocks(alloc, length);
+
+    // A request filling its block has nothing to trim
+    if (length > (size_t)1 << alloc->max_log2 || (blocks & (blocks - 1)) == 0) return buddy_malloc(alloc, length);
+    #ifdef BUDDY_SLAB
+    if (is_slab_size(alloc, length)) return buddy_malloc(alloc, length);
+    #endif
+
+    uint8_t order = get_order(alloc, length);
+
+    uintptr_t address = alloc_order(alloc, order);
+    if (address == 0) {
+        TRACE(alloc, BUDDY_EVENT_OOM, alloc->base, order);
+        RECORD(alloc, BUDDY_RECORD_MALLOC, 0, length);
+        STAT_ADD(&alloc->failed_allocs, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    #ifdef BUDDY_CHECKED
+    *(uint64_t *)address = 0;
+    #endif
+
+    LOCK(alloc);
+    trim(alloc, address, order, blocks);
+    UNLOCK(alloc);
+
+    TRACE(alloc, BUDDY_EVENT_ALLOC, address, order);
+    RECORD(alloc, BUDDY_RECORD_MALLOC, address, length);
+    return (char *)address;
+}
+#endif
+
+/* Recovers the order of an allocated block from the bit tree. Descendants of
+ * an allocated block are always free, so walking up from the leaf, the first
+ * node marked in the bit tree is the block itself. A split node always has a
+ * marked child, which tells it apart from an allocated block. Returns -1 if
+ * the address is not the start of an allocated block.
+ */
+static int get_allocated_order(buddy_t *alloc, uintptr_t address) {
+    if (address < alloc->base + alloc->offset || address - alloc->base - alloc->offset >= alloc->size) return -1;
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        size_t partition_size = (size_t)1 << (order + alloc->min_log2);
+
+        // The address is inside a larger block rather than at its start
+        if ((address - alloc->base) & (partition_size - 1)) return -1;
+
+        if (get_state(alloc, address, order) == 0) continue;
+
+        // The lower child was already found free, so a marked upper child means the block is split
+        if (order > 0 && get_state(alloc, address + (partition_size >> 1), order - 1) == 1) return -1;
+
+        return order;
+    }
+    return -1;
+}
+
+#ifdef BUDDY_SLAB
+/* Returns the slab an address belongs to when its size is not known. Unlike
+ * a sized free, the address may be anything, so the slab must also be an
+ * allocated block of the slab order. Called with the lock held.
+ */
+static struct buddy_slab *find_slab(buddy_t *alloc, uintptr_t address) {
+    struct buddy_slab *slab = get_slab(alloc, address);
+    if (slab == NULL || get_allocated_order(alloc, (uintptr_t)slab) != alloc->slab_log2 - alloc->min_log2) return NULL;
+    return slab;
+}
+#endif
+
+/* Returns a block to the free lists, merging it with its buddy for as long as
+ * the buddy is free. In BUDDY_ATOMIC mode, the state of blocks of an order and
+ * the free list of that order only change while its lock is held, so a free
+ * buddy is claimed by removing it from its free list under the lock. The
+ * merged block stays marked split until it is returned to the free lists.
+ */
+static void free_block(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    ORDER_LOCK(alloc, order);
+
+    uint8_t state = get_state(alloc, address, order);
+
+    if (state == 0) {
+        ORDER_UNLOCK(alloc, order);
+
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, address, order);
+        errno = EINVAL;
+        return;
+    }
+
+    STAT_SUB(&alloc->in_use, (size_t)1 << (order + alloc->min_log2));
+
+    // Blocks of the max order have no buddy to merge with
+    while (order < alloc->max_order) {
+        uintptr_t buddy_address = ((address - alloc->base) ^ (size_t)1 << (order + alloc->min_log2)) + alloc->base;
+
+        // Buddy is either split or allocated - stop merging
+        if (get_state(alloc, buddy_address, order) != 0) break;
+
+        // Buddy is free - merge
+        free_list_remove(alloc, buddy_address, order);
+
+        // Mark first buddy as free in the bit tree
+        set_state(alloc, address, order, 0);
+
+        TRACE(alloc, BUDDY_EVENT_MERGE, address < buddy_address ? address : buddy_address, order + 1);
+        STAT_ADD(&alloc->merges, 1);
+
+        ORDER_UNLOCK(alloc, order);
+
+        // The merged block starts at the lower of the two buddies
+        if (buddy_address < address) address = buddy_address;
+        order++;
+
+        ORDER_LOCK(alloc, order);
+    }
+
+    // Mark the final, merged block as free in the bit tree and add it back to free lists
+    set_state(alloc, address, order, 0);
+    append(alloc, address, order);
+
+    ORDER_UNLOCK(alloc, order);
+}
+
+#ifdef BUDDY_TRIM
+// A sized free is of a run if the block after its largest block continues the run
+static int is_run(buddy_t *alloc, uintptr_t address, size_t length) {
+    size_t blocks = get_run_blocks(alloc, length);
+    if ((blocks & (blocks - 1)) == 0 || blocks > (size_t)1 << alloc->max_order) return 0;
+
+    if (address < alloc->base) return 0;
+
+    size_t next = address - alloc->base + ((size_t)1 << (floor_log2(blocks) + alloc->min_log2));
+    if (next >= (size_t)1 << alloc->mem_log2) return 0;
+
+    return get_run_bit(alloc, alloc->base + next);
+}
+
+// Counts the minimum size blocks of the run starting with an allocated block of the given order
+static size_t get_run_length(buddy_t *alloc, uintptr_t address, int order) {
+    size_t blocks = 0;
+
+    do {
+        blocks += (size_t)1 << order;
+        address += (size_t)1 << (order + alloc->min_log2);
+    } while (address - alloc->base < (size_t)1 << alloc->mem_log2 && get_run_bit(alloc, address)
+        && (order = get_allocated_order(alloc, address)) >= 0);
+
+    return blocks;
+}
+
+/* Frees the blocks of a run. The run bits are cleared before any block is
+ * freed, since the first block can be handed out again as soon as it is freed,
+ * and the blocks after it must not be taken as a continuation of the new block.
+ */
+static void free_run(buddy_t *alloc, uintptr_t address, size_t blocks) {
+    for (size_t i = (size_t)1 << floor_log2(blocks); i < blocks; i += (size_t)1 << floor_log2(blocks - i)) {
+        set_run_bit(alloc, address + (i << alloc->min_log2), 0);
+    }
+
+    while (blocks != 0) {
+        uint8_t order = floor_log2(blocks);
+
+        free_block(alloc, address, order);
+
+        address += (size_t)1 << (order + alloc->min_log2);
+        blocks -= (size_t)1 << order;
+    }
+}
+#endif
+
+/* Grows an allocated block in place to the target order by claiming its
+ * buddies from the free lists, one order at a time. The block must be the
+ * lower buddy at every order on the way. If any buddy is not free, the claimed
+ * buddies are returned to the free lists. Returns 1 if the block was grown.
+ */
+static int grow_block(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t target) {
+    uint8_t i;
+
+    for (i = order; i < target; i++) {
+        size_t partition_size = (size_t)1 << (i + alloc->min_log2);
+
+        // The block is the upper buddy, so it would have to move to grow
+        if ((address - alloc->base) & partition_size) break;
+
+        ORDER_LOCK(alloc, i);
+        if (get_state(alloc, address + partition_size, i) != 0) {
+            ORDER_UNLOCK(alloc, i);
+            break;
+        }
+        free_list_remove(alloc, address + partition_size, i);
+        ORDER_UNLOCK(alloc, i);
+    }
+
+    if (i < target) {
+        while (i-- > order) {
+            ORDER_LOCK(alloc, i);
+            append(alloc, address + ((size_t)1 << (i + alloc->min_log2)), i);
+            ORDER_UNLOCK(alloc, i);
+        }
+        return 0;
+    }
+
+    // The block at the target order was marked split, and now marks the grown block as allocated
+    for (i = order; i < target; i++) {
+        set_state(alloc, address, i, 0);
+
+        TRACE(alloc, BUDDY_EVENT_MERGE, address, i + 1);
+    }
+
+    STAT_ADD(&alloc->merges, target - order);
+    add_in_use(alloc, ((size_t)1 << (target + alloc->min_log2)) - ((size_t)1 << (order + alloc->min_log2)));
+    return 1;
+}
+
+void *buddy_realloc(buddy_t *alloc, void *addr, size_t old_length, size_t new_length) {
+    if (addr == NULL) return buddy_malloc(alloc, new_length);
+
+    if (new_length == 0) {
+        buddy_free(alloc, addr, old_length);
+        return NULL;
+    }
+
+    if (new_length > (size_t)1 << alloc->max_log2) {
+        STAT_ADD(&alloc->failed_allocs, 1);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    #ifdef BUDDY_SLAB
+    // Objects only fit in place within their size class, and move between slabs and blocks otherwise
+    if (is_slab_size(alloc, old_length) || is_slab_size(alloc, new_length)) {
+        if (is_slab_size(alloc, old_length) && is_slab_size(alloc, new_length)
+                && get_slab_class(old_length) == get_slab_class(new_length)) {
+            RECORD(alloc, BUDDY_RECORD_REALLOC, (uintptr_t)addr, new_length);
+            return addr;
+        }
+
+        void *new_addr = buddy_malloc(alloc, new_length);
+        if (new_addr == NULL) return NULL;
+
+        memcpy(new_addr, addr, old_length < new_length ? old_length : new_length);
+        buddy_free(alloc, addr, old_length);
+
+        return new_addr;
+    }
+    #endif
+
+    #ifdef BUDDY_TRIM
+    // Runs are not resized in place unless they keep the same number of blocks
+    if (is_run(alloc, (uintptr_t)addr, old_length)) {
+        if (get_run_blocks(alloc, old_length) == get_run_blocks(alloc, new_length)) {
+            RECORD(alloc, BUDDY_RECORD_REALLOC, (uintptr_t)addr, new_length);
+            return addr;
+        }
+
+        void *new_addr = buddy_malloc_trimmed(alloc, new_length);
+        if (new_addr == NULL) return NULL;
+
+        memcpy(new_addr, addr, old_length < new_length ? old_length : new_length);
+        buddy_free(alloc, addr, old_length);
+
+        return new_addr;
+    }
+    #endif
+
+    uintptr_t address = (uintptr_t)addr;
+    uint8_t order = get_order(alloc, old_length);
+    uint8_t new_order = get_order(alloc, new_length);
+
+    #ifdef BUDDY_CHECKED
+    if (check_block(alloc, address, order, old_length) != 0) return NULL;
+    #endif
+
+    if (new_order == order) {
+        #ifdef BUDDY_CHECKED
+        set_canary(alloc, address, new_order, new_length);
+        #endif
+        RECORD(alloc, BUDDY_RECORD_REALLOC, address, new_length);
+        return addr;
+    }
+
+    // Shrink in place by splitting the block and returning the upper halves to the free lists
+    if (new_order < order) {
+        LOCK(alloc);
+        split(alloc, address, order, new_order);
+        UNLOCK(alloc);
+
+        STAT_SUB(&alloc->in_use, ((size_t)1 << (order + alloc->min_log2)) - ((size_t)1 << (new_order + alloc->min_log2)));
+        #ifdef BUDDY_CHECKED
+        set_canary(alloc, address, new_order, new_length);
+        #endif
+
+        TRACE(alloc, BUDDY_EVENT_FREE, address, order);
+        TRACE(alloc, BUDDY_EVENT_ALLOC, address, new_order);
+        RECORD(alloc, BUDDY_RECORD_REALLOC, address, new_length);
+        return addr;
+    }
+
+    LOCK(alloc);
+    int grown = grow_block(alloc, address, order, new_order);
+    UNLOCK(alloc);
+    if (grown) {
+        #ifdef BUDDY_CHECKED
+        set_canary(alloc, address, new_order, new_length);
+        #endif
+        TRACE(alloc, BUDDY_EVENT_FREE, address, order);
+        TRACE(alloc, BUDDY_EVENT_ALLOC, address, new_order);
+        RECORD(alloc, BUDDY_RECORD_REALLOC, address, new_length);
+        return addr;
+    }
+
+    // The block cannot grow in place - move it
+    void *new_addr = buddy_malloc(alloc, new_length);
+    if (new_addr == NULL) return NULL;
+
+    memcpy(new_addr, addr, old_length);
+    buddy_free(alloc, addr, old_length);
+
+    return new_addr;
+}
+
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(void * const *)a;
+    uintptr_t y = (uintptr_t)*(void * const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Returns a batch of blocks of the same order to the free lists. The blocks
+ * are sorted by address so buddies that are both in the batch are merged
+ * directly, without going through the free lists. The merged blocks are then
+ * freed together at the next order. The array is used as scratch space.
+ */
+static void free_blocks(buddy_t *alloc, void **blocks, uint8_t order, size_t n) {
+    qsort(blocks, n, sizeof(void *), compare_addresses);
+
+    while (n > 1 && order < alloc->max_order) {
+        size_t partition_size = (size_t)1 << (order + alloc->min_log2);
+        size_t merged = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t address = (uintptr_t)blocks[i];
+
+            if (i + 1 < n && ((address - alloc->base) & partition_size) == 0
+                && (uintptr_t)blocks[i + 1] == address + partition_size
+                && get_state(alloc, address, order) == 1
+                && get_state(alloc, address + partition_size, order) == 1) {
+                // Both buddies are in the batch - the parent block stays marked split and is freed at the next order
+                set_state(alloc, address, order, 0);
+                set_state(alloc, address + partition_size, order, 0);
+
+                TRACE(alloc, BUDDY_EVENT_MERGE, address, order + 1);
+                STAT_ADD(&alloc->merges, 1);
+
+                blocks[merged++] = (void *)address;
+                i++;
+            } else {
+                free_block(alloc, address, order);
+            }
+        }
+
+        n = merged;
+        order++;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        free_block(alloc, (uintptr_t)blocks[i], order);
+    }
+}
+
+void buddy_free_batch(buddy_t *alloc, void **addrs, size_t length, size_t n) {
+    #ifdef BUDDY_SLAB
+    if (is_slab_size(alloc, length)) {
+        for (size_t i = 0; i < n; i++) buddy_free(alloc, addrs[i], length);
+        return;
+    }
+    #endif
+
+    uint8_t order = get_order(alloc, length);
+
+    #ifdef BUDDY_CHECKED
+    // Blocks failing a check are left out of the batch
+    size_t valid = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (check_block(alloc, (uintptr_t)addrs[i], order, length) == 0) addrs[valid++] = addrs[i];
+    }
+    n = valid;
+    #endif
+
+    #if defined(BUDDY_TRACE) || defined(BUDDY_RECORD)
+    for (size_t i = 0; i < n; i++) {
+        TRACE(alloc, BUDDY_EVENT_FREE, (uintptr_t)addrs[i], order);
+        RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addrs[i], length);
+    }
+    #endif
+
+    LOCK(alloc);
+    #ifdef BUDDY_LAZY_MERGE
+    // Blocks already waiting in the deferred ring are left out of the batch
+    size_t kept = 0;
+    ORDER_LOCK(alloc, order);
+    for (size_t i = 0; i < n; i++) {
+        if (!is_deferred(alloc, (uintptr_t)addrs[i], order)) {
+            addrs[kept++] = addrs[i];
+            continue;
+        }
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, (uintptr_t)addrs[i], order);
+        errno = EINVAL;
+    }
+    ORDER_UNLOCK(alloc, order);
+    n = kept;
+    #endif
+
+    free_blocks(alloc, addrs, order, n);
+    UNLOCK(alloc);
+}
+
+void buddy_free(buddy_t *alloc, void *addr, size_t length) {
+    #ifdef BUDDY_SLAB
+    if (is_slab_size(alloc, length)) {
+        struct buddy_slab *slab = get_slab(alloc, (uintptr_t)addr);
+
+        if (slab == NULL || slab->size_class != get_slab_class(length) || slab_free(alloc, slab, (uintptr_t)addr) != 0) {
+            TRACE(alloc, BUDDY_EVENT_INVALID_FREE, (uintptr_t)addr, 0);
+            #ifdef BUDDY_CHECKED
+            STAT_ADD(&alloc->invalid_frees, 1);
+            #endif
+            errno = EINVAL;
+            return;
+        }
+        RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addr, length);
+        return;
+    }
+    #endif
+
+    #ifdef BUDDY_TRIM
+    if (is_run(alloc, (uintptr_t)addr, length)) {
+        TRACE(alloc, BUDDY_EVENT_FREE, (uintptr_t)addr, get_order(alloc, length));
+        RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addr, length);
+
+        LOCK(alloc);
+        free_run(alloc, (uintptr_t)addr, get_run_blocks(alloc, length));
+        UNLOCK(alloc);
+        return;
+    }
+    #endif
+
+    uint8_t order = get_order(alloc, length);
+
+    #ifdef BUDDY_CHECKED
+    if (check_block(alloc, (uintptr_t)addr, order, length) != 0) return;
+    #endif
+
+    TRACE(alloc, BUDDY_EVENT_FREE, (uintptr_t)addr, order);
+    RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addr, length);
+    free_order(alloc, (uintptr_t)addr, order);
+}
+
+void buddy_free_unsized(buddy_t *alloc, void *addr) {
+    LOCK(alloc);
+    int order = get_allocated_order(alloc, (uintptr_t)addr);
+
+    #ifdef BUDDY_TRIM
+    // Blocks that continue a run follow the block at the address
+    size_t blocks = order >= 0 ? get_run_length(alloc, (uintptr_t)addr, order) : 0;
+    if (order >= 0 && blocks > (size_t)1 << order) {
+        free_run(alloc, (uintptr_t)addr, blocks);
+        UNLOCK(alloc);
+
+        TRACE(alloc, BUDDY_EVENT_FREE, (uintptr_t)addr, order);
+        RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addr, 0);
+        return;
+    }
+    #endif
+
+    #ifdef BUDDY_SLAB
+    struct buddy_slab *slab = order < 0 ? find_slab(alloc, (uintptr_t)addr) : NULL;
+    #endif
+    UNLOCK(alloc);
+
+    #ifdef BUDDY_SLAB
+    if (slab != NULL && slab_free(alloc, slab, (uintptr_t)addr) == 0) {
+        RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addr, 0);
+        return;
+    }
+    #endif
+
+    #ifdef BUDDY_CHECKED
+    // Without a length there is no canary to check, but the block may already be in a cache
+    if (order >= 0 && has_cookie(alloc, (uintptr_t)addr)) order = -1;
+    if (order < 0) STAT_ADD(&alloc->invalid_frees, 1);
+    #endif
+
+    if (order < 0) {
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, (uintptr_t)addr, 0);
+        errno = EINVAL;
+        return;
+    }
+
+    TRACE(alloc, BUDDY_EVENT_FREE, (uintptr_t)addr, order);
+    RECORD(alloc, BUDDY_RECORD_FREE, (uintptr_t)addr, 0);
+    free_order(alloc, (uintptr_t)addr, order);
+}
+
+size_t buddy_usable_size(buddy_t *alloc, void *addr) {
+    LOCK(alloc);
+    int order = get_allocated_order(alloc, (uintptr_t)addr);
+    #ifdef BUDDY_SLAB
+    struct buddy_slab *slab = order < 0 ? find_slab(alloc, (uintptr_t)addr) : NULL;
+    #endif
+    UNLOCK(alloc);
+
+    #ifdef BUDDY_SLAB
+    if (slab != NULL) return get_class_size(slab->size_class);
+    #endif
+
+    if (order < 0) return 0;
+
+    #ifdef BUDDY_TRIM
+    LOCK(alloc);
+    size_t blocks = get_run_length(alloc, (uintptr_t)addr, order);
+    UNLOCK(alloc);
+
+    return blocks << alloc->min_log2;
+    #else
+    return (size_t)1 << (order + alloc->min_log2);
+    #endif
+}
+
+void buddy_stats(buddy_t *alloc, struct buddy_stats *out) {
+    out->bytes_free = 0;
+
+    LOCK(alloc);
+    for (int i = 0; i < BUDDY_MAX_ORDERS; i++) {
+        out->free_blocks[i] = 0;
+        if (i > alloc->max_order) continue;
+
+        ORDER_LOCK(alloc, i);
+        out->free_blocks[i] = alloc->free_counts[i];
+        #ifdef BUDDY_LAZY
+        if (i == alloc->max_order) out->free_blocks[i] += (alloc->frontier_end - alloc->frontier) >> alloc->max_log2;
+        #endif
+        #ifdef BUDDY_LAZY_MERGE
+        out->free_blocks[i] += alloc->deferred[i].count;
+        #endif
+        ORDER_UNLOCK(alloc, i);
+
+        out->bytes_free += out->free_blocks[i] << (i + alloc->min_log2);
+    }
+    UNLOCK(alloc);
+
+    out->bytes_in_use = STAT_LOAD(&alloc->in_use);
+    out->peak_bytes_in_use = STAT_LOAD(&alloc->peak_in_use);
+    out->failed_allocs = STAT_LOAD(&alloc->failed_allocs);
+    out->splits = STAT_LOAD(&alloc->splits);
+    out->merges = STAT_LOAD(&alloc->merges);
+    #ifdef BUDDY_CHECKED
+    out->invalid_frees = STAT_LOAD(&alloc->invalid_frees);
+    #endif
+}
+
+/* The nodes of an order are kept in runs of consecutive bits of the bit tree,
+ * in address order. A level order tree keeps each order in a single run,
+ * whereas a blocked tree keeps an order in a run per subtree of its band.
+ */
+struct tree_runs {
+    size_t first;
+    size_t length;
+    size_t stride;
+    size_t count;
+};
+
+static void get_tree_runs(buddy_t *alloc, uint8_t order, struct tree_runs *runs) {
+    size_t nodes = (size_t)1 << (alloc->mem_log2 - alloc->min_log2 - order);
+
+    #ifdef BUDDY_BLOCKED_TREE
+    struct buddy_tree_level *level = &alloc->tree_levels[order];
+
+    runs->first = level->base;
+    runs->length = (size_t)1 << level->depth;
+    runs->stride = (size_t)1 << level->levels;
+    runs->count = nodes >> level->depth;
+    #else
+    runs->first = get_bit_tree_index(alloc, alloc->base, order);
+    runs->length = nodes;
+    runs->stride = nodes;
+    runs->count = 1;
+    #endif
+}
+
+static uint8_t get_bit(buddy_t *alloc, size_t index) {
+    return (ATOMIC_LOAD(&alloc->bit_tree[index / 32]) >> (index % 32)) & 1;
+}
+
+/* Counts the nodes of an order that are marked, and the sibling pairs of the
+ * order with a marked node, which are the split blocks of the order above.
+ * Siblings are in different runs when the runs hold a single node.
+ */
+static void count_level(buddy_t *alloc, const struct bit_kernels *k, uint8_t order, size_t *marked, size_t *pairs) {
+    struct tree_runs runs;
+    get_tree_runs(alloc, order, &runs);
+
+    *marked = 0;
+    *pairs = 0;
+    for (size_t i = 0; i < runs.count; i++) {
+        size_t first = runs.first + i * runs.stride;
+
+        if (runs.length == 1) {
+            uint8_t bit = get_bit(alloc, first);
+            *marked += bit;
+            if (i % 2 == 1) *pairs += bit | get_bit(alloc, first - runs.stride);
+            continue;
+        }
+
+        *marked += k->count_bits(alloc->bit_tree, first, runs.length);
+        *pairs += k->count_pairs(alloc->bit_tree, first, runs.length);
+    }
+}
+
+/* A marked block is split if either child is marked, and allocated or
+ * reserved otherwise, and a block below max_order is free if it is not marked
+ * but its sibling or parent's other descendants keep its parent split. The
+ * split blocks of an order are the sibling pairs below it with a marked node,
+ * and every split block has two children that are either marked or free.
+ */
+void buddy_census(buddy_t *alloc, struct buddy_census *out) {
+    const struct bit_kernels *k = get_bit_kernels();
+    size_t marked[BUDDY_MAX_ORDERS], pairs[BUDDY_MAX_ORDERS];
+
+    LOCK(alloc);
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        count_level(alloc, k, order, &marked[order], &pairs[order]);
+    }
+    UNLOCK(alloc);
+
+    for (int i = 0; i < BUDDY_MAX_ORDERS; i++) {
+        out->allocated[i] = 0;
+        out->split[i] = 0;
+        out->free[i] = 0;
+        if (i > alloc->max_order) continue;
+
+        out->split[i] = i > 0 ? pairs[i - 1] : 0;
+        out->allocated[i] = marked[i] - out->split[i];
+        if (i < alloc->max_order) out->free[i] = 2 * pairs[i] - marked[i];
+        else out->free[i] = ((size_t)1 << (alloc->mem_log2 - alloc->max_log2)) - marked[i];
+    }
+}
+
+void *buddy_find_free(buddy_t *alloc, uint8_t order) {
+    if (order > alloc->max_order) return NULL;
+
+    const struct bit_kernels *k = get_bit_kernels();
+    struct tree_runs runs;
+    get_tree_runs(alloc, order, &runs);
+
+    // Blocks of the max order have no parent, so any block not marked is free
+    int paired = order < alloc->max_order;
+    uintptr_t address = 0;
+
+    LOCK(alloc);
+    for (size_t i = 0; i < runs.count && address == 0; i++) {
+        size_t first = runs.first + i * runs.stride;
+        size_t node;
+
+        if (runs.length == 1) {
+            uint8_t sibling = paired ? get_bit(alloc, i % 2 ? first - runs.stride : first + runs.stride) : 1;
+            if (get_bit(alloc, first) || !sibling) continue;
+            node = 0;
+        } else {
+            node = k->find_free(alloc->bit_tree, first, runs.length, paired);
+            if (node == runs.length) continue;
+        }
+
+        address = alloc->base + ((i * runs.length + node) << (order + alloc->min_log2));
+    }
+    UNLOCK(alloc);
+
+    return (void *)address;
+}
+
+void buddy_fragmentation(buddy_t *alloc, struct buddy_fragmentation *out) {
+    struct buddy_census census;
+    buddy_census(alloc, &census);
+
+    out->largest_order = -1;
+    out->largest_free = 0;
+    out->bytes_free = 0;
+
+    for (int i = 0; i <= alloc->max_order; i++) {
+        if (census.free[i] == 0) continue;
+
+        out->bytes_free += census.free[i] << (i + alloc->min_log2);
+        out->largest_order = i;
+        out->largest_free = (size_t)1 << (i + alloc->min_log2);
+    }
+
+    out->ratio = out->bytes_free ? 1.0 - (double)out->largest_free / out->bytes_free : 0.0;
+}
+
+#ifdef BUDDY_CHECKED
+/* Reports a marked block if it is live, which it is if neither child is
+ * marked, it is inside the pool rather than reserved, and it holds no cookie.
+ * Returns the number of live allocations the block holds.
+ */
+static size_t report_block(buddy_t *alloc, uintptr_t address, uint8_t order, buddy_leak_fn fn, void *ctx) {
+    size_t partition_size = (size_t)1 << (order + alloc->min_log2);
+
+    if (address < alloc->base + alloc->offset || address - alloc->base - alloc->offset >= alloc->size) return 0;
+    if (order > 0 && (get_state(alloc, address, order - 1) || get_state(alloc, address + partition_size / 2, order - 1))) return 0;
+    if (has_cookie(alloc, address)) return 0;
+
+    #ifdef BUDDY_SLAB
+    struct buddy_slab *slab = get_slab(alloc, address);
+    if ((uintptr_t)slab == address && order == alloc->slab_log2 - alloc->min_log2) {
+        struct buddy_slab_class *cls = &alloc->slab_classes[slab->size_class];
+        size_t size = get_class_size(slab->size_class);
+        size_t count = 0;
+
+        // Clear bits of the bitmap are live objects
+        for (size_t i = 0; i < cls->capacity; i++) {
+            if (slab->bitmap[i / 64] >> (i % 64) & 1) continue;
+
+            if (fn != NULL) fn((char *)slab + cls->first + i * size, size, ctx);
+            count++;
+        }
+        return count;
+    }
+    #endif
+
+    #ifdef BUDDY_TRIM
+    // Blocks continuing a run are reported with the first block of the run
+    if (get_run_bit(alloc, address)) return 0;
+    size_t length = get_run_length(alloc, address, order) << alloc->min_log2;
+    #else
+    size_t length = partition_size;
+    #endif
+
+    if (fn != NULL) fn((void *)address, length, ctx);
+    return 1;
+}
+
+// Reports the live blocks of the bit tree. Called with the lock held, if the allocator has one.
+static size_t report_tree(buddy_t *alloc, buddy_leak_fn fn, void *ctx) {
+    size_t count = 0;
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        struct tree_runs runs;
+        get_tree_runs(alloc, order, &runs);
+
+        for (size_t i = 0; i < runs.count; i++) {
+            size_t first = runs.first + i * runs.stride;
+
+            // Only the marked nodes of the run are looked at
+            for (size_t j = 0; j * 32 < runs.length; j++) {
+                for (uint32_t x = get_stream_word(alloc->bit_tree, first, runs.length, j); x != 0; x &= x - 1) {
+                    size_t node = i * runs.length + j * 32 + __builtin_ctz(x);
+                    count += report_block(alloc, alloc->base + (node << (order + alloc->min_log2)), order, fn, ctx);
+                }
+            }
+        }
+    }
+    return count;
+}
+
+size_t buddy_leak_report(buddy_t *alloc, buddy_leak_fn fn, void *ctx) {
+    LOCK(alloc);
+    size_t count = report_tree(alloc, fn, ctx);
+    UNLOCK(alloc);
+
+    return count;
+}
+#endif
+
+/* PURGING */
+#ifdef BUDDY_PURGE
+/* Returns a block taken out of the free lists for purging. A buddy freed in
+ * the meantime could not be merged with the block, so the block is freed as
+ * usual to merge them, and the merged block is no longer purged as a whole.
+ * Otherwise the block goes to the purged lists if its pages were released.
+ * Called with the lock held.
+ */
+static void return_purged(buddy_t *alloc, uintptr_t address, uint8_t order, int purged) {
+    ORDER_LOCK(alloc, order);
+
+    uintptr_t buddy_address = ((address - alloc->base) ^ (size_t)1 << (order + alloc->min_log2)) + alloc->base;
+
+    if (!purged || (order < alloc->max_order && get_state(alloc, buddy_address, order) == 0)) {
+        ORDER_UNLOCK(alloc, order);
+
+        // The block was never counted as in use, and free_block counts it as leaving use
+        STAT_ADD(&alloc->in_use, (size_t)1 << (order + alloc->min_log2));
+        free_block(alloc, address, order);
+        return;
+    }
+
+    set_state(alloc, address, order, 0);
+    ((struct buddy_purge_page *)address)->purged = 1;
+    push(alloc, &alloc->purged_lists[order], address, order);
+
+    ORDER_UNLOCK(alloc, order);
+}
+
+size_t buddy_purge(buddy_t *alloc, unsigned decay) {
+    size_t epoch = STAT_ADD(&alloc->purge_epoch, 1);
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t released = 0;
+
+    for (int order = alloc->max_order; order >= alloc->purge_order; order--) {
+        size_t partition_size = (size_t)1 << (order + alloc->min_log2);
+        uintptr_t batch[BUDDY_PURGE_BATCH];
+        size_t n;
+
+        do {
+            n = 0;
+
+            // Take blocks that stayed free long enough out of the free lists, so they cannot be allocated while purged
+            LOCK(alloc);
+            ORDER_LOCK(alloc, order);
+            for (buddy_page_t *p = FROM_LINK(alloc, alloc->free_lists[order]), *next; p != NULL && n < BUDDY_PURGE_BATCH; p = next) {
+                next = FROM_LINK(alloc, p->next);
+
+                // Blocks freed since the epoch ended carry the next epoch
+                if (((struct buddy_purge_page *)p)->epoch + decay > epoch) continue;
+
+                free_list_remove(alloc, (uintptr_t)p, order);
+                set_state(alloc, (uintptr_t)p, order, 1);
+                batch[n++] = (uintptr_t)p;
+            }
+            ORDER_UNLOCK(alloc, order);
+            UNLOCK(alloc);
+
+            int purged[BUDDY_PURGE_BATCH];
+            for (size_t i = 0; i < n; i++) {
+                purged[i] = madvise((char *)batch[i] + page_size, partition_size - page_size, BUDDY_PURGE_ADVICE) == 0;
+                if (purged[i]) released += partition_size - page_size;
+            }
+
+            LOCK(alloc);
+            for (size_t i = 0; i < n; i++) {
+                return_purged(alloc, batch[i], order, purged[i]);
+            }
+            UNLOCK(alloc);
+        } while (n == BUDDY_PURGE_BATCH);
+    }
+
+    return released;
+}
+
+#ifdef BUDDY_THREADS
+static void *purge_main(void *arg) {
+    buddy_t *alloc = arg;
+    struct buddy_purger *purger = &alloc->purger;
+
+    pthread_mutex_lock(&purger->lock);
+    while (!purger->stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += purger->interval / 1000;
+        ts.tv_nsec += purger->interval % 1000 * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+
+        if (pthread_cond_timedwait(&purger->cond, &purger->lock, &ts) == 0 && purger->stopping) break;
+
+        pthread_mutex_unlock(&purger->lock);
+        buddy_purge(alloc, purger->decay);
+        pthread_mutex_lock(&purger->lock);
+    }
+    pthread_mutex_unlock(&purger->lock);
+
+    return NULL;
+}
+
+int buddy_purge_start(buddy_t *alloc, unsigned interval, unsigned decay) {
+    struct buddy_purger *purger = &alloc->purger;
+    if (purger->running) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    purger->interval = interval;
+    purger->decay = decay;
+    purger->stopping = 0;
+    pthread_mutex_init(&purger->lock, NULL);
+    pthread_cond_init(&purger->cond, NULL);
+
+    int err = pthread_create(&purger->thread, NULL, purge_main, alloc);
+    if (err != 0) {
+        pthread_cond_destroy(&purger->cond);
+        pthread_mutex_destroy(&purger->lock);
+        errno = err;
+        return -1;
+    }
+
+    purger->running = 1;
+    return 0;
+}
+
+void buddy_purge_stop(buddy_t *alloc) {
+    struct buddy_purger *purger = &alloc->purger;
+    if (!purger->running) return;
+
+    pthread_mutex_lock(&purger->lock);
+    purger->stopping = 1;
+    pthread_cond_signal(&purger->cond);
+    pthread_mutex_unlock(&purger->lock);
+
+    pthread_join(purger->thread, NULL);
+
+    pthread_cond_destroy(&purger->cond);
+    pthread_mutex_destroy(&purger->lock);
+    purger->running = 0;
+}
+#endif
+#endif
+
+/* RESETS */
+#ifdef BUDDY_THREADS
+/* Replaces the thread cache key, so that every thread starts over without a
+ * cache. The caches of the old key must already be back in the pool, as their
+ * destructors no longer run. Returns the error of pthread_key_create, in which
+ * case nothing changes.
+ */
+static int cache_forget(buddy_t *alloc) {
+    pthread_key_t key;
+    int err = pthread_key_create(&key, cache_destroy);
+    if (err != 0) return err;
+
+    pthread_key_delete(alloc->cache_key);
+    alloc->cache_key = key;
+
+    CACHES_LOCK(alloc);
+    alloc->caches = NULL;
+    CACHES_UNLOCK(alloc);
+    return 0;
+}
+#endif
+
+int buddy_reset(buddy_t *alloc) {
+    LOCK(alloc);
+    #ifdef BUDDY_THREADS
+    int err = cache_forget(alloc);
+    if (err != 0) {
+        UNLOCK(alloc);
+        errno = err;
+        return -1;
+    }
+    #endif
+
+    clear(alloc, 0);
+    UNLOCK(alloc);
+    return 0;
+}
+
+#ifndef BUDDY_SLAB
+// The bit tree, along with the run bits that follow it, as recorded when the mark was taken
+struct buddy_mark {
+    size_t in_use;
+    #ifdef BUDDY_LAZY
+    size_t frontier;
+    #endif
+    uint32_t words[];
+};
+
+static size_t get_mark_words(buddy_t *alloc) {
+    size_t words = alloc->tree_words;
+    #ifdef BUDDY_TRIM
+    words += (((size_t)1 << (alloc->mem_log2 - alloc->min_log2)) + 31) / 32;
+    #endif
+    return words;
+}
+
+static void add_unmarked(buddy_t *alloc, size_t index, uint8_t order) {
+    uintptr_t address = alloc->base + (index << (order + alloc->min_log2));
+
+    #ifdef BUDDY_LAZY
+    // Blocks past the frontier are not marked either, but they are not in the free lists
+    if (address >= alloc->frontier && address < alloc->frontier_end) return;
+    #endif
+
+    append(alloc, address, order);
+}
+
+/* Adds the free blocks of the bit tree to the empty free lists. As counted by
+ * buddy_census, a block below max_order is free if it is not marked but its
+ * sibling is, and a block of the max order if it is not marked.
+ */
+static void rebuild_lists(buddy_t *alloc) {
+    const struct bit_kernels *k = get_bit_kernels();
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        struct tree_runs runs;
+        get_tree_runs(alloc, order, &runs);
+        int paired = order < alloc->max_order;
+
+        for (size_t i = 0; i < runs.count; i++) {
+            size_t first = runs.first + i * runs.stride;
+
+            if (runs.length == 1) {
+                uint8_t sibling = paired ? get_bit(alloc, i % 2 ? first - runs.stride : first + runs.stride) : 1;
+                if (!get_bit(alloc, first) && sibling) add_unmarked(alloc, i, order);
+                continue;
+            }
+
+            for (size_t node = 0; node < runs.length; ) {
+                size_t found = k->find_free(alloc->bit_tree, first + node, runs.length - node, paired);
+                if (found == runs.length - node) break;
+
+                node += found;
+                add_unmarked(alloc, i * runs.length + node, order);
+
+                // The sibling of a free block is marked, so the scan resumes at the next pair
+                node = paired ? (node | 1) + 1 : node + 1;
+            }
+        }
+    }
 
-#include "buddy.h"
+    #ifdef BUDDY_LAZY
+    if (alloc->frontier < alloc->frontier_end) ATOMIC_OR(&alloc->free_orders, (uint64_t)1 << alloc->max_order);
+    #endif
+}
 
-#include <stdlib.h>
+buddy_mark_t *buddy_mark(buddy_t *alloc) {
+    size_t size = sizeof(buddy_mark_t) + get_mark_words(alloc) * sizeof(uint32_t);
+    if (size > (size_t)1 << alloc->max_log2) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-/* HELPER FUNCTIONS */
-static uint8_t get_order(const size_t length) {
-    for (int n = MAX_BLOCK_LOG2; n >= MIN_BLOCK_LOG2; n--) {
-        if ((unsigned)(1 << n) <= length) return n - MIN_BLOCK_LOG2;
+    LOCK(alloc);
+    #ifdef BUDDY_THREADS
+    /* Every cache goes back to the pool along with its blocks, so that no block
+     * the tree copy marks allocated is held by a cache when the pool is rolled
+     * back. Threads then get new caches from the scope under a new key.
+     */
+    struct buddy_cache *cache = alloc->caches;
+    int err = cache_forget(alloc);
+    if (err != 0) {
+        UNLOCK(alloc);
+        errno = err;
+        return NULL;
+    }
+    while (cache != NULL) {
+        struct buddy_cache *next = cache->next;
+        cache_release(alloc, cache);
+        cache = next;
+    }
+    #endif
+    #ifdef BUDDY_LAZY_MERGE
+    // Deferred blocks are marked in the bit tree, so they are merged before it is recorded
+    deferred_flush(alloc);
+    #endif
+
+    buddy_mark_t *mark = (buddy_mark_t *)alloc_block(alloc, get_order(alloc, size));
+    if (mark != NULL) {
+        mark->in_use = STAT_LOAD(&alloc->in_use);
+        #ifdef BUDDY_LAZY
+        mark->frontier = alloc->frontier - alloc->base;
+        #endif
+        memcpy(mark->words, alloc->bit_tree, get_mark_words(alloc) * sizeof(uint32_t));
+    }
+    UNLOCK(alloc);
+
+    if (mark == NULL) errno = ENOMEM;
+    return mark;
+}
+
+int buddy_release_to(buddy_t *alloc, buddy_mark_t *mark) {
+    LOCK(alloc);
+    #ifdef BUDDY_THREADS
+    int err = cache_forget(alloc);
+    if (err != 0) {
+        UNLOCK(alloc);
+        errno = err;
+        return -1;
     }
+    #endif
+
+    memcpy(alloc->bit_tree, mark->words, get_mark_words(alloc) * sizeof(uint32_t));
+    alloc->in_use = mark->in_use;
+    #ifdef BUDDY_LAZY
+    alloc->frontier = alloc->base + mark->frontier;
+    #endif
+
+    clear_lists(alloc, 0);
+    rebuild_lists(alloc);
+
+    // The mark itself was allocated when the tree was recorded
+    free_block(alloc, (uintptr_t)mark, get_order(alloc, sizeof(buddy_mark_t) + get_mark_words(alloc) * sizeof(uint32_t)));
+    UNLOCK(alloc);
     return 0;
 }
+#endif
+
+void buddy_destroy(buddy_t *alloc) {
+    #if defined(BUDDY_PURGE) && defined(BUDDY_THREADS)
+    buddy_purge_stop(alloc);
+    #endif
+    #ifdef BUDDY_THREADS
+    pthread_key_delete(alloc->cache_key);
+    #ifndef BUDDY_ATOMIC
+    pthread_mutex_destroy(&alloc->lock);
+    #endif
+    #else
+    (void)alloc;
+    #endif
+}
 
-static uint32_t get_bit_tree_index(buddy_t *alloc, uintptr_t address, uint8_t order) {
-    uint8_t height = MEM_BLOCK_LOG2 - order - MIN_BLOCK_LOG2;
-    uint32_t offset = (address - alloc->base) / (1 << (MIN_BLOCK_LOG2 + order));
-    uint32_t node_index = (1 << height) - 1 + offset - TRUNCATED_TREE_NODES;
+/* HEAPS */
+#ifdef BUDDY_HEAP
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 
-    return node_index;
+#ifdef BUDDY_THREADS
+#define HEAP_READ_LOCK(heap) pthread_rwlock_rdlock(&(heap)->lock)
+#define HEAP_WRITE_LOCK(heap) pthread_rwlock_wrlock(&(heap)->lock)
+#define HEAP_UNLOCK(heap) pthread_rwlock_unlock(&(heap)->lock)
+#define HINT_LOAD(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define HINT_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#else
+#define HEAP_READ_LOCK(heap)
+#define HEAP_WRITE_LOCK(heap)
+#define HEAP_UNLOCK(heap)
+#define HINT_LOAD(p) (*(p))
+#define HINT_STORE(p, v) (*(p) = (v))
+#endif
+
+#define NODE_BITS (sizeof(unsigned long) * 8)
+
+// Node of the calling thread, looked up again every BUDDY_HEAP_NODE_REFRESH calls
+static _Thread_local int heap_node = -1;
+static _Thread_local uint32_t heap_node_calls;
+
+static int get_node(buddy_heap_t *heap) {
+    if (!(heap->flags & BUDDY_HEAP_NUMA)) return 0;
+
+    if (heap_node < 0 || ++heap_node_calls % BUDDY_HEAP_NODE_REFRESH == 0) {
+        unsigned cpu, node;
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0 || node >= BUDDY_HEAP_NODES) node = 0;
+        heap_node = node;
+    }
+    return heap_node;
 }
 
-static uint8_t get_state(buddy_t *alloc, uintptr_t address, uint8_t order) {
-    uint32_t index = get_bit_tree_index(alloc, address, order);
-    uint32_t word_index = index / 32;
-    uint32_t word_offset = index % 32;
+// Binds memory that has not been touched yet to a node. On failure, the memory is placed by the default policy.
+static void bind_node(void *address, size_t length, int node) {
+    unsigned long mask[(BUDDY_HEAP_NODES + NODE_BITS - 1) / NODE_BITS] = {0};
+    mask[node / NODE_BITS] = 1UL << (node % NODE_BITS);
+
+    // The kernel reads one bit less than the maximum node passed
+    syscall(SYS_mbind, address, length, MPOL_BIND, mask, BUDDY_HEAP_NODES + 1, 0);
+}
 
-    uint8_t state = alloc->bit_tree[word_index] >> word_offset;
+/* Maps memory of a power of 2 size aligned to its size. A mapping that happens
+ * to be aligned is used as is. Otherwise twice the size is mapped, and the
+ * unaligned ends are unmapped. Returns NULL if the memory cannot be mapped.
+ */
+static char *map_aligned(size_t size, int flags) {
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    if (((uintptr_t)p & (size - 1)) == 0) return p;
 
-    // Apply mask to get the desired bit
-    return state & 1;
+    munmap(p, size);
+
+    p = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    size_t head = -(uintptr_t)p & (size - 1);
+    if (head != 0) munmap(p, head);
+    munmap(p + head + size, size - head);
+
+    return p + head;
 }
 
-static void set_state(buddy_t *alloc, uintptr_t address, uint8_t order, uint8_t state) {
-    uint32_t index = get_bit_tree_index(alloc, address, order);
-    uint32_t word_index = index / 32;
-    uint32_t word_offset = index % 32;
+/* Huge pages are reserved when mapped, so the mapping fails rather than the
+ * first access when not enough are available. Arenas then fall back to normal
+ * pages, advised to be backed by transparent huge pages.
+ */
+static char *map_pool(size_t size, int hugetlb) {
+    if (hugetlb) {
+        char *p = map_aligned(size, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB);
+        if (p != NULL) return p;
+    }
+
+    char *p = map_aligned(size, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+    if (p != NULL && hugetlb) madvise(p, size, MADV_HUGEPAGE);
+    return p;
+}
+
+/* Maps an arena of 2^log2 bytes and its metadata, bound to the node if the
+ * heap is NUMA aware. Binding happens before the allocator touches either
+ * mapping. Returns 0 if the arena cannot be mapped.
+ */
+static int map_arena(buddy_heap_t *heap, struct buddy_arena *arena, uint8_t log2, int node) {
+    arena->size = (size_t)1 << log2;
+    arena->base = map_pool(arena->size, heap->flags & BUDDY_HEAP_HUGETLB);
+    if (arena->base == NULL) return 0;
 
-    // Create a mask to only set the bit at the target position
-    uint32_t mask = ~(1 << word_offset);
+    arena->meta_size = buddy_metadata_size(arena->base, arena->size, heap->min_log2, log2);
+    arena->meta = mmap(NULL, arena->meta_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena->meta == MAP_FAILED) {
+        munmap(arena->base, arena->size);
+        return 0;
+    }
 
-    alloc->bit_tree[word_index] = (alloc->bit_tree[word_index] & mask) | state << word_offset;
+    if (heap->flags & BUDDY_HEAP_NUMA) {
+        bind_node(arena->base, arena->size, node);
+        bind_node(arena->meta, arena->meta_size, node);
+    }
 
-    #ifdef LOGGING
-    printf("Block at order %u marked %u\n", order, state);
+    // The metadata is a fresh mapping, so it is already zeroed
+    #ifdef BUDDY_LAZY
+    arena->alloc = buddy_init_oob_zeroed(arena->meta, arena->meta_size, arena->base, arena->size, heap->min_log2, log2);
+    #else
+    arena->alloc = buddy_init_oob(arena->meta, arena->meta_size, arena->base, arena->size, heap->min_log2, log2);
     #endif
+    if (arena->alloc == NULL) {
+        munmap(arena->meta, arena->meta_size);
+        munmap(arena->base, arena->size);
+        return 0;
+    }
+
+    arena->node = node;
+    return 1;
 }
 
-static void append(buddy_t *alloc, uintptr_t address, uint8_t order) {
-    buddy_page_t *p = (buddy_page_t *)address;
+static void unmap_arena(struct buddy_arena *arena) {
+    buddy_destroy(arena->alloc);
+    munmap(arena->meta, arena->meta_size);
+    munmap(arena->base, arena->size);
+}
 
-    if (alloc->free_lists[order]) alloc->free_lists[order]->prev = p;
+// Returns the index of the first arena starting after the address
+static size_t search_arenas(buddy_heap_t *heap, uintptr_t address) {
+    size_t low = 0, high = heap->count;
 
-    p->prev = NULL;
-    p->next = alloc->free_lists[order];
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
 
-    alloc->free_lists[order] = p;
+        if ((uintptr_t)heap->arenas[mid].base <= address) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
 
-    #ifdef LOGGING
-    printf("Block added to free list of order %u\n", order);
-    #endif
+// Returns the arena holding the address, or NULL if none does. Called with the lock held.
+static struct buddy_arena *find_arena(buddy_heap_t *heap, uintptr_t address) {
+    size_t i = search_arenas(heap, address);
+    if (i == 0) return NULL;
+
+    struct buddy_arena *arena = &heap->arenas[i - 1];
+    if (address - (uintptr_t)arena->base >= arena->size) return NULL;
+
+    return arena;
 }
 
-static void free_list_remove(buddy_t *alloc, uintptr_t address, uint8_t order) {
-    buddy_page_t *p = (buddy_page_t *)address;
+static int fits_arena(struct buddy_arena *arena, size_t length) {
+    return length <= (size_t)1 << arena->alloc->max_log2;
+}
 
-    if (p->prev != NULL) p->prev->next = p->next;
+// Tries the arena the node last allocated from, then the other arenas of the node. Called with the lock held.
+static void *malloc_local(buddy_heap_t *heap, size_t length, int node) {
+    uintptr_t current = HINT_LOAD(&heap->current[node]);
+    struct buddy_arena *hint = current ? find_arena(heap, current) : NULL;
 
-    if (alloc->free_lists[order] == p) alloc->free_lists[order] = p->next;
+    if (hint != NULL && hint->node == node && fits_arena(hint, length)) {
+        void *addr = buddy_malloc(hint->alloc, length);
+        if (addr != NULL) return addr;
+    }
 
-    if (p->next != NULL) p->next->prev = p->prev;
+    for (size_t i = 0; i < heap->count; i++) {
+        struct buddy_arena *arena = &heap->arenas[i];
+        if (arena == hint || arena->node != node || !fits_arena(arena, length)) continue;
 
-    p->prev = NULL;
-    p->next = NULL;
+        void *addr = buddy_malloc(arena->alloc, length);
+        if (addr != NULL) {
+            if (arena->size == (size_t)1 << heap->arena_log2) HINT_STORE(&heap->current[node], (uintptr_t)arena->base);
+            return addr;
+        }
+    }
+    return NULL;
+}
+
+// Maps a new arena on the node, large enough for the request, and allocates from it
+static void *malloc_new(buddy_heap_t *heap, size_t length, int node) {
+    uint8_t log2 = heap->arena_log2;
+    while (log2 < sizeof(size_t) * 8 - 1 && length > (size_t)1 << log2) log2++;
+    if (length > (size_t)1 << log2) return NULL;
+
+    struct buddy_arena arena;
+    if (!map_arena(heap, &arena, log2, node)) return NULL;
+
+    void *addr = buddy_malloc(arena.alloc, length);
+
+    HEAP_WRITE_LOCK(heap);
+    if (heap->count == BUDDY_HEAP_ARENAS) {
+        HEAP_UNLOCK(heap);
+        unmap_arena(&arena);
+        return NULL;
+    }
+
+    size_t i = search_arenas(heap, (uintptr_t)arena.base);
+    memmove(&heap->arenas[i + 1], &heap->arenas[i], (heap->count - i) * sizeof(struct buddy_arena));
+    heap->arenas[i] = arena;
+    heap->count++;
+
+    // Arenas sized for a single large request are not allocated from first
+    if (log2 == heap->arena_log2) HINT_STORE(&heap->current[node], (uintptr_t)arena.base);
+    HEAP_UNLOCK(heap);
+
+    return addr;
+}
+
+/* Unmaps the arena at the index if it is fully free, unless it is the arena
+ * its node allocates from and that arena is to be kept. Returns the number of
+ * bytes unmapped. Called with the write lock held.
+ */
+static size_t release_arena(buddy_heap_t *heap, size_t i, int keep_current) {
+    struct buddy_arena *arena = &heap->arenas[i];
+    int current = heap->current[arena->node] == (uintptr_t)arena->base;
+
+    if (STAT_LOAD(&arena->alloc->in_use) != 0 || (current && keep_current)) return 0;
+
+    if (current) heap->current[arena->node] = 0;
+
+    size_t size = arena->size;
+    unmap_arena(arena);
+
+    memmove(&heap->arenas[i], &heap->arenas[i + 1], (heap->count - i - 1) * sizeof(struct buddy_arena));
+    heap->count--;
+
+    return size;
+}
+
+// Unmaps the arena holding the address if a free left it fully free
+static void release_after_free(buddy_heap_t *heap, uintptr_t address) {
+    HEAP_WRITE_LOCK(heap);
+
+    // Another thread may have released the arena or allocated from it since the free
+    struct buddy_arena *arena = find_arena(heap, address);
+    if (arena != NULL) release_arena(heap, arena - heap->arenas, 1);
+
+    HEAP_UNLOCK(heap);
+}
 
-    #ifdef LOGGING
-    printf("Block removed from free list of order %u\n", order);
+buddy_heap_t *buddy_heap_create(uint8_t arena_log2, uint8_t min_log2, int flags) {
+    if (!valid_geometry(min_log2, arena_log2)) return NULL;
+
+    if (((size_t)1 << arena_log2) < (size_t)sysconf(_SC_PAGESIZE)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    buddy_heap_t *heap = mmap(NULL, sizeof(buddy_heap_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (heap == MAP_FAILED) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Anonymous mappings are zeroed, so the heap starts with no arenas and no current arena for any node
+    heap->arena_log2 = arena_log2;
+    heap->min_log2 = min_log2;
+    heap->flags = flags;
+
+    #ifdef BUDDY_THREADS
+    int err = pthread_rwlock_init(&heap->lock, NULL);
+    if (err != 0) {
+        munmap(heap, sizeof(buddy_heap_t));
+        errno = err;
+        return NULL;
+    }
     #endif
+
+    return heap;
 }
 
-static uint8_t split(buddy_t *alloc, int order, int target) {
-    while (order > target) {
-        buddy_page_t *partition = alloc->free_lists[order];
+void buddy_heap_destroy(buddy_heap_t *heap) {
+    for (size_t i = 0; i < heap->count; i++) {
+        unmap_arena(&heap->arenas[i]);
+    }
+
+    #ifdef BUDDY_THREADS
+    pthread_rwlock_destroy(&heap->lock);
+    #endif
+    munmap(heap, sizeof(buddy_heap_t));
+}
 
-        uintptr_t address = (uintptr_t)partition;
-        uintptr_t buddy_address = ((address - alloc->base) ^ 1 << (order - 1 + MIN_BLOCK_LOG2)) + alloc->base;
+void *buddy_heap_malloc(buddy_heap_t *heap, size_t length) {
+    return buddy_heap_malloc_node(heap, length, get_node(heap));
+}
 
-        free_list_remove(alloc, address, order);
+void *buddy_heap_malloc_node(buddy_heap_t *heap, size_t length, int node) {
+    if (node < 0 || node >= BUDDY_HEAP_NODES) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-        // Mark the parent block as split in the bit tree
-        set_state(alloc, address, order, 1);
+    HEAP_READ_LOCK(heap);
+    void *addr = malloc_local(heap, length, node);
+    HEAP_UNLOCK(heap);
+    if (addr != NULL) return addr;
 
-        #ifdef LOGGING
-        printf("Block of order %u split\n", order);
-        #endif
+    addr = malloc_new(heap, length, node);
+    if (addr != NULL) return addr;
 
-        order--;
+    // Fall back to the arenas of other nodes
+    HEAP_READ_LOCK(heap);
+    for (size_t i = 0; i < heap->count && addr == NULL; i++) {
+        struct buddy_arena *arena = &heap->arenas[i];
+        if (arena->node != node && fits_arena(arena, length)) addr = buddy_malloc(arena->alloc, length);
+    }
+    HEAP_UNLOCK(heap);
 
-        // Since the bit tree was initialized as all free, these buddies are already marked free in the bit tree
-        append(alloc, address, order);
-        append(alloc, buddy_address, order);
+    if (addr == NULL) errno = ENOMEM;
+    return addr;
+}
 
-        if (order == target) return order;
+void buddy_heap_free(buddy_heap_t *heap, void *addr, size_t length) {
+    HEAP_READ_LOCK(heap);
+    struct buddy_arena *arena = find_arena(heap, (uintptr_t)addr);
+    if (arena == NULL) {
+        HEAP_UNLOCK(heap);
+        errno = EINVAL;
+        return;
     }
-    return MAX_ORDER + 1;
+
+    buddy_free(arena->alloc, addr, length);
+    int empty = STAT_LOAD(&arena->alloc->in_use) == 0;
+    HEAP_UNLOCK(heap);
+
+    if (empty) release_after_free(heap, (uintptr_t)addr);
 }
 
-buddy_t *buddy_init(char *base, size_t length) {
-    buddy_t *alloc;
-    size_t pad;
-    {
-        pad = -(uintptr_t) base & (_Alignof(buddy_t) - 1);
-        if (length < pad) {
-            #ifdef ERR_LOGGING
-            printf("Error: Not enough memory to fit padding\n");
-            #endif
-            return NULL;
-        }
-        base += pad;
-        length -= pad;
+void buddy_heap_free_unsized(buddy_heap_t *heap, void *addr) {
+    HEAP_READ_LOCK(heap);
+    struct buddy_arena *arena = find_arena(heap, (uintptr_t)addr);
+    if (arena == NULL) {
+        HEAP_UNLOCK(heap);
+        errno = EINVAL;
+        return;
+    }
 
-        if (length < sizeof(buddy_t)) {
-            #ifdef ERR_LOGGING
-            printf("Error: Not enough memory to fit buddy struct\n");
-            #endif
-            return NULL;
-        }
-        alloc = (buddy_t *) base;
-        base += sizeof(buddy_t);
-        length -= sizeof(buddy_t);
+    buddy_free_unsized(arena->alloc, addr);
+    int empty = STAT_LOAD(&arena->alloc->in_use) == 0;
+    HEAP_UNLOCK(heap);
+
+    if (empty) release_after_free(heap, (uintptr_t)addr);
+}
+
+void *buddy_heap_realloc(buddy_heap_t *heap, void *addr, size_t old_length, size_t new_length) {
+    if (addr == NULL) return buddy_heap_malloc(heap, new_length);
+
+    if (new_length == 0) {
+        buddy_heap_free(heap, addr, old_length);
+        return NULL;
     }
 
-    alloc->base = (uintptr_t)base;
-    alloc->size = length;
+    HEAP_READ_LOCK(heap);
+    struct buddy_arena *arena = find_arena(heap, (uintptr_t)addr);
+    if (arena == NULL) {
+        HEAP_UNLOCK(heap);
+        errno = EINVAL;
+        return NULL;
+    }
 
-    // Initialize bit tree - all bits initially set to 0 (free, not split)
-    for (int i = 0; i < TREE_WORDS; i++) {
-        alloc->bit_tree[i] = 0;
+    void *new_addr = NULL;
+    int err = ENOMEM;
+    if (fits_arena(arena, new_length)) {
+        new_addr = buddy_realloc(arena->alloc, addr, old_length, new_length);
+        err = errno;
     }
+    HEAP_UNLOCK(heap);
+    if (new_addr != NULL) return new_addr;
 
-    // Initialize free lists
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        alloc->free_lists[i] = NULL;
+    // A block that is not allocated, or fails a check, must not be copied or freed
+    if (err != ENOMEM) {
+        errno = err;
+        return NULL;
     }
 
-    uintptr_t address = alloc->base;
+    // The arena cannot hold the new size - move the block to another arena
+    new_addr = buddy_heap_malloc(heap, new_length);
+    if (new_addr == NULL) return NULL;
 
-    // Add free memory blocks to free lists
-    while (length >= 1 << MIN_BLOCK_LOG2) {
-        uint8_t order = get_order(length);
-        size_t partition_size = 1 << (order + MIN_BLOCK_LOG2);
+    memcpy(new_addr, addr, old_length < new_length ? old_length : new_length);
+    buddy_heap_free(heap, addr, old_length);
 
-        append(alloc, address, order);
+    return new_addr;
+}
+
+size_t buddy_heap_usable_size(buddy_heap_t *heap, void *addr) {
+    HEAP_READ_LOCK(heap);
+    struct buddy_arena *arena = find_arena(heap, (uintptr_t)addr);
+    size_t size = arena != NULL ? buddy_usable_size(arena->alloc, addr) : 0;
+    HEAP_UNLOCK(heap);
+
+    return size;
+}
+
+#ifdef BUDDY_PURGE
+size_t buddy_heap_purge(buddy_heap_t *heap, unsigned decay) {
+    size_t released = 0;
 
-        address += partition_size;
-        length -= partition_size;
+    HEAP_READ_LOCK(heap);
+    for (size_t i = 0; i < heap->count; i++) {
+        released += buddy_purge(heap->arenas[i].alloc, decay);
     }
+    HEAP_UNLOCK(heap);
 
-    // Mark memory reserved by buddy struct
-    size_t used = pad + sizeof(buddy_t);
-    while (used >= 1 << MIN_BLOCK_LOG2) {
-        uint8_t order = get_order(used);
-        size_t partition_size = 1 << (order + MIN_BLOCK_LOG2);
+    return released;
+}
+#endif
 
-        // Mark block as reserved in the bit tree
-        set_state(alloc, address, order, 1);
+size_t buddy_heap_trim(buddy_heap_t *heap) {
+    size_t released = 0;
 
-        address += partition_size;
-        used -= partition_size;
+    HEAP_WRITE_LOCK(heap);
+    for (size_t i = heap->count; i > 0; i--) {
+        released += release_arena(heap, i - 1, 0);
     }
+    HEAP_UNLOCK(heap);
+
+    return released;
+}
+#endif
 
-    #ifdef LOGGING
-    printf("%llu bytes available for allocation\n\n", alloc->size - pad - length);
+/* THREAD ARENAS */
+#ifdef BUDDY_THREAD_ARENAS
+// Order of blocks pushed on a remote free list without their size, which the owner looks up
+#define REMOTE_UNSIZED -1
+
+// A block freed by another thread, waiting on the remote free list of its arena
+struct buddy_remote {
+    struct buddy_remote *next;
+    #ifdef BUDDY_CHECKED
+    // The cookie of the block tagged with its order, which has no room of its own beside it
+    uint64_t cookie;
+    #else
+    int order;
     #endif
-    return alloc;
+};
+
+BUDDY_STATIC_ASSERT(sizeof(struct buddy_remote) <= sizeof(buddy_page_t), "remote frees must fit in a free list node");
+
+// The start of an arena, followed by the header of its allocator and its blocks
+struct buddy_thread_arena {
+    buddy_t *alloc;
+    buddy_thread_arenas_t *arenas;
+    struct buddy_remote *remote;
+    struct buddy_thread_arena *next;
+};
+
+// Marks threads that could not get an arena, so creating one is not retried on every call
+static char no_arena;
+
+/* Returns an arena to the parent. Arenas are carved without going through
+ * buddy_malloc, so that recordings and leak reports only see the blocks
+ * allocated from them.
+ */
+static void free_arena(buddy_thread_arenas_t *arenas, struct buddy_thread_arena *arena) {
+    uint8_t order = get_order(arenas->parent, (size_t)1 << arenas->arena_log2);
+
+    TRACE(arenas->parent, BUDDY_EVENT_FREE, (uintptr_t)arena, order);
+    free_order(arenas->parent, (uintptr_t)arena, order);
 }
 
-void *buddy_malloc(buddy_t *alloc, size_t length) {
-    if (length > 1 << MAX_BLOCK_LOG2) {
-        #ifdef ERR_LOGGING
-        printf("Error: Requested size is too large\n");
+static size_t get_slot(buddy_thread_arenas_t *arenas, uintptr_t address) {
+    return (address - arenas->parent->base) >> arenas->arena_log2;
+}
+
+// Returns the arena holding the address, or NULL if the address is not in any arena
+static struct buddy_thread_arena *find_thread_arena(buddy_thread_arenas_t *arenas, uintptr_t address) {
+    if (address < arenas->parent->base || get_slot(arenas, address) >= arenas->slot_count) return NULL;
+    return __atomic_load_n(&arenas->slots[get_slot(arenas, address)], __ATOMIC_ACQUIRE);
+}
+
+/* Frees a block of the arena, of the given order or REMOTE_UNSIZED. Called
+ * by its owner only. With BUDDY_CHECKED, the freeing thread has checked the
+ * contents of the block, and the owner checks it is allocated at the order.
+ * Returns -1 if the block is not.
+ */
+static int free_owned(struct buddy_thread_arena *arena, uintptr_t address, int order) {
+    buddy_t *alloc = arena->alloc;
+
+    #ifdef BUDDY_CHECKED
+    int allocated = get_allocated_order(alloc, address);
+    if (allocated < 0 || (order != REMOTE_UNSIZED && order != allocated)) {
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, address, 0);
+        return reject_block(alloc);
+    }
+    order = allocated;
+    *(uint64_t *)address = get_cookie(alloc, address);
+    #else
+    if (order == REMOTE_UNSIZED) order = get_allocated_order(alloc, address);
+    if (order < 0) {
+        TRACE(alloc, BUDDY_EVENT_INVALID_FREE, address, 0);
+        return -1;
+    }
+    #endif
+
+    FREE_BLOCK(alloc, address, order);
+    return 0;
+}
+
+#ifdef BUDDY_CHECKED
+// The order is kept in the top byte, offset so the tag is never zero
+static uint64_t get_remote_cookie(buddy_t *alloc, uintptr_t address, int order) {
+    return get_cookie(alloc, address) ^ ((uint64_t)(order - REMOTE_UNSIZED + 1) << 56);
+}
+
+/* Returns whether the block is on a remote free list, so that freeing it again
+ * does not push it twice and loop the list. Blocks are taken off the list with
+ * their tag cleared, so a stale one is never found in a live block.
+ */
+static int is_remote(buddy_t *alloc, uintptr_t address) {
+    uint64_t tag = ((struct buddy_remote *)address)->cookie ^ get_cookie(alloc, address);
+    return tag != 0 && (tag << 8) == 0;
+}
+
+static int get_remote_order(buddy_t *alloc, struct buddy_remote *r) {
+    return (int)((r->cookie ^ get_cookie(alloc, (uintptr_t)r)) >> 56) + REMOTE_UNSIZED - 1;
+}
+#endif
+
+// Frees the blocks other threads pushed on the remote free list of the arena. Called by its owner only.
+static void drain_remote(struct buddy_thread_arena *arena) {
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL) return;
+
+    struct buddy_remote *r = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    while (r != NULL) {
+        struct buddy_remote *next = r->next;
+        #ifdef BUDDY_CHECKED
+        int order = get_remote_order(arena->alloc, r);
+        r->cookie = 0;
+        #else
+        int order = r->order;
         #endif
+        free_owned(arena, (uintptr_t)r, order);
+        r = next;
+    }
+}
+
+// Called on thread exit to return the thread's arena to the parent, or leave it for another thread if it is still in use
+static void release_thread_arena(void *p) {
+    if (p == &no_arena) return;
+
+    struct buddy_thread_arena *arena = p;
+    buddy_thread_arenas_t *arenas = arena->arenas;
+
+    drain_remote(arena);
+
+    // A fully free arena holds no block another thread could still free
+    if (STAT_LOAD(&arena->alloc->in_use) == 0) {
+        __atomic_store_n(&arenas->slots[get_slot(arenas, (uintptr_t)arena)], NULL, __ATOMIC_RELAXED);
+        free_arena(arenas, arena);
+        return;
+    }
+
+    pthread_mutex_lock(&arenas->lock);
+    arena->next = arenas->abandoned;
+    arenas->abandoned = arena;
+    pthread_mutex_unlock(&arenas->lock);
+}
+
+// Carves a new arena from the parent and sets up its allocator. Returns NULL if the parent is out of memory.
+static struct buddy_thread_arena *create_thread_arena(buddy_thread_arenas_t *arenas) {
+    size_t size = (size_t)1 << arenas->arena_log2;
+    struct buddy_thread_arena *arena = (struct buddy_thread_arena *)alloc_order(arenas->parent, get_order(arenas->parent, size));
+    if (arena == NULL) return NULL;
+    TRACE(arenas->parent, BUDDY_EVENT_ALLOC, (uintptr_t)arena, get_order(arenas->parent, size));
+
+    // The allocator of the arena is only used by its owner, so it gets no lock or thread caches
+    arena->alloc = init_ex((char *)(arena + 1), size - sizeof(struct buddy_thread_arena), arenas->parent->min_log2, arenas->arena_log2, 0);
+    if (arena->alloc == NULL) {
+        free_arena(arenas, arena);
         return NULL;
     }
+    arena->arenas = arenas;
+    arena->remote = NULL;
+    arena->next = NULL;
 
-    uint8_t order = get_order(length);
+    __atomic_store_n(&arenas->slots[get_slot(arenas, (uintptr_t)arena)], arena, __ATOMIC_RELEASE);
+    return arena;
+}
 
-    // Block of the requested order is available - no need to split
-    if (alloc->free_lists[order] != NULL) {
-        buddy_page_t *partition = alloc->free_lists[order];
+// Returns the calling thread's arena, adopting an abandoned arena or creating one on first use
+static struct buddy_thread_arena *get_thread_arena(buddy_thread_arenas_t *arenas) {
+    void *p = pthread_getspecific(arenas->key);
+    if (p != NULL) return p == &no_arena ? NULL : p;
 
-        uintptr_t address = (uintptr_t)partition;
+    pthread_mutex_lock(&arenas->lock);
+    struct buddy_thread_arena *arena = arenas->abandoned;
+    if (arena != NULL) arenas->abandoned = arena->next;
+    pthread_mutex_unlock(&arenas->lock);
 
-        free_list_remove(alloc, address, order);
+    if (arena == NULL) arena = create_thread_arena(arenas);
 
-        // Mark block as used in the bit tree
-        set_state(alloc, address, order, 1);
+    pthread_setspecific(arenas->key, arena != NULL ? (void *)arena : &no_arena);
+    return arena;
+}
 
-        #ifdef LOGGING
-        printf("%u bytes allocated for a requested size of %llu bytes\n\n", 1 << (order + MIN_BLOCK_LOG2), length);
-        #endif
-        return (char *)address;
+/* Frees a block of the arena. The owner frees it straight away, while other
+ * threads push it on the remote free list of the arena for its owner to free.
+ */
+static void free_thread_block(buddy_thread_arenas_t *arenas, struct buddy_thread_arena *arena, uintptr_t address, int order) {
+    if (pthread_getspecific(arenas->key) == arena) {
+        if (free_owned(arena, address, order) != 0) errno = EINVAL;
+        return;
     }
 
-    // A best fit block was not available - search for a larger block to split
-    for (int i = order + 1; i <= MAX_ORDER; i++) {
-        if (alloc->free_lists[i] != NULL) {
-            // A larger partition found, split
-            uint8_t next_order = split(alloc, i, order);
+    struct buddy_remote *r = (struct buddy_remote *)address;
+    #ifdef BUDDY_CHECKED
+    r->cookie = get_remote_cookie(arena->alloc, address, order);
+    #else
+    r->order = order;
+    #endif
+    r->next = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&arena->remote, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-            if (next_order == MAX_ORDER + 1) {
-                #ifdef ERR_LOGGING
-                printf("Error: Failed to split partition\n");
-                #endif
-                return NULL;
-            }
+buddy_thread_arenas_t *buddy_thread_arenas_create(buddy_t *parent, uint8_t arena_log2) {
+    // An arena holds its own header, so it must be larger than the smallest block and no larger than the parent's largest
+    if (arena_log2 > parent->max_log2 || arena_log2 <= parent->min_log2) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t slot_count = (size_t)1 << (parent->mem_log2 - arena_log2);
+    buddy_thread_arenas_t *arenas = buddy_malloc(parent, sizeof(buddy_thread_arenas_t) + slot_count * sizeof(struct buddy_thread_arena *));
+    if (arenas == NULL) return NULL;
+
+    arenas->parent = parent;
+    arenas->arena_log2 = arena_log2;
+    arenas->abandoned = NULL;
+    arenas->slot_count = slot_count;
+    arenas->slots = (struct buddy_thread_arena **)(arenas + 1);
+    memset(arenas->slots, 0, slot_count * sizeof(struct buddy_thread_arena *));
 
-            buddy_page_t *partition = alloc->free_lists[next_order];
+    int err = pthread_mutex_init(&arenas->lock, NULL);
+    if (err == 0) {
+        err = pthread_key_create(&arenas->key, release_thread_arena);
+        if (err != 0) pthread_mutex_destroy(&arenas->lock);
+    }
+    if (err != 0) {
+        buddy_free_unsized(parent, arenas);
+        errno = err;
+        return NULL;
+    }
+
+    return arenas;
+}
+
+void buddy_thread_arenas_destroy(buddy_thread_arenas_t *arenas) {
+    pthread_key_delete(arenas->key);
+
+    for (size_t i = 0; i < arenas->slot_count; i++) {
+        if (arenas->slots[i] != NULL) free_arena(arenas, arenas->slots[i]);
+    }
 
-            uintptr_t address = (uintptr_t)partition;
+    pthread_mutex_destroy(&arenas->lock);
+    buddy_free_unsized(arenas->parent, arenas);
+}
 
-            free_list_remove(alloc, address, next_order);
+void *buddy_thread_malloc(buddy_thread_arenas_t *arenas, size_t length) {
+    struct buddy_thread_arena *arena = get_thread_arena(arenas);
 
-            // Mark block as used in the bit tree
-            set_state(alloc, address, next_order, 1);
+    if (arena != NULL && length <= (size_t)1 << arena->alloc->max_log2) {
+        drain_remote(arena);
 
-            #ifdef LOGGING
-            printf("%u bytes allocated for a requested size of %llu bytes\n\n", 1 << (order + MIN_BLOCK_LOG2), length);
+        uint8_t order = get_order(arena->alloc, length);
+        uintptr_t address = ALLOC_BLOCK(arena->alloc, order);
+        if (address != 0) {
+            #ifdef BUDDY_CHECKED
+            set_live(arena->alloc, address, order, length);
             #endif
-            return (char *)address;
+
+            // Arena blocks are recorded as blocks of the parent, whose memory they are carved from
+            TRACE(arena->alloc, BUDDY_EVENT_ALLOC, address, order);
+            RECORD(arenas->parent, BUDDY_RECORD_MALLOC, address, length);
+            return (void *)address;
         }
     }
-    #ifdef ERR_LOGGING
-    printf("Error: Not enough memory available to allocate %llu bytes\n", length);
-    #endif
-    return NULL;
-}
 
-void buddy_free(buddy_t *alloc, void *addr, size_t length) {
-    uint8_t order = get_order(length);
+    // Requests the arena cannot satisfy are served by the parent
+    return buddy_malloc(arenas->parent, length);
+}
 
-    uintptr_t address = (uintptr_t)addr;
-    uint8_t state = get_state(alloc, address, order);
+void buddy_thread_free(buddy_thread_arenas_t *arenas, void *addr, size_t length) {
+    struct buddy_thread_arena *arena = find_thread_arena(arenas, (uintptr_t)addr);
+    if (arena == NULL) {
+        buddy_free(arenas->parent, addr, length);
+        return;
+    }
 
-    if (state == 0) {
-        #ifdef ERR_LOGGING
-        printf("Error: Block at address %llu is already free\n", address);
+    if (length > (size_t)1 << arena->alloc->max_log2) {
+        TRACE(arena->alloc, BUDDY_EVENT_INVALID_FREE, (uintptr_t)addr, 0);
+        errno = EINVAL;
         return;
-        #endif
     }
 
-    uintptr_t buddy_address = ((address - alloc->base) ^ 1 << (order + MIN_BLOCK_LOG2)) + alloc->base;
-    uint8_t buddy_state = get_state(alloc, buddy_address, order);
+    uint8_t order = get_order(arena->alloc, length);
 
-    // Buddy is either split or allocated - immediately return the block to free lists
-    if (buddy_state == 1) {
-        append(alloc, address, order);
+    #ifdef BUDDY_CHECKED
+    // The cookie and canary are in the block, so any thread can check them before it is handed to the owner
+    if (is_remote(arena->alloc, (uintptr_t)addr)) {
+        TRACE(arena->alloc, BUDDY_EVENT_INVALID_FREE, (uintptr_t)addr, order);
+        reject_block(arena->alloc);
+        return;
+    }
+    if (check_contents(arena->alloc, (uintptr_t)addr, order, length) != 0) return;
+    #endif
 
-        // Mark block as free in the bit tree
-        set_state(alloc, address, order, 0);
+    TRACE(arena->alloc, BUDDY_EVENT_FREE, (uintptr_t)addr, order);
+    RECORD(arenas->parent, BUDDY_RECORD_FREE, (uintptr_t)addr, length);
+    free_thread_block(arenas, arena, (uintptr_t)addr, order);
+}
 
-        #ifdef LOGGING
-        printf("Buddy not available for merging. Block returned to free list of order %u\n\n", order);
-        #endif
+void buddy_thread_free_unsized(buddy_thread_arenas_t *arenas, void *addr) {
+    struct buddy_thread_arena *arena = find_thread_arena(arenas, (uintptr_t)addr);
+    if (arena == NULL) {
+        buddy_free_unsized(arenas->parent, addr);
         return;
     }
 
-    // Buddy is free - merge
-    while (order < MAX_ORDER) {
-        free_list_remove(alloc, buddy_address, order);
+    #ifdef BUDDY_CHECKED
+    // Without a length there is no canary to check, but the block may already be deferred or pending
+    if (has_cookie(arena->alloc, (uintptr_t)addr) || is_remote(arena->alloc, (uintptr_t)addr)) {
+        TRACE(arena->alloc, BUDDY_EVENT_INVALID_FREE, (uintptr_t)addr, 0);
+        reject_block(arena->alloc);
+        return;
+    }
+    #endif
 
-        // Mark first buddy as free in the bit tree
-        set_state(alloc, address, order, 0);
+    RECORD(arenas->parent, BUDDY_RECORD_FREE, (uintptr_t)addr, 0);
+    free_thread_block(arenas, arena, (uintptr_t)addr, REMOTE_UNSIZED);
+}
 
-        #ifdef LOGGING
-        printf("Buddies of order %u merged\n", order);
-        #endif
+#ifdef BUDDY_CHECKED
+struct thread_leaks {
+    buddy_thread_arenas_t *arenas;
+    struct buddy_thread_arena *arena;
+    buddy_leak_fn fn;
+    void *ctx;
+    size_t count;
+};
 
-        order++;
+// Passes on the live blocks of the parent or of an arena, leaving out the set, its arenas and pending remote frees
+static void report_thread_leak(void *addr, size_t length, void *p) {
+    struct thread_leaks *leaks = p;
 
-        // Mark the parent block as free in the bit tree
-        set_state(alloc, address, order, 0);
+    if (leaks->arena == NULL) {
+        if (addr == (void *)leaks->arenas || (void *)find_thread_arena(leaks->arenas, (uintptr_t)addr) == addr) return;
+    } else if (is_remote(leaks->arena->alloc, (uintptr_t)addr)) {
+        return;
+    }
 
-        // Get state of buddy of the parent block
-        buddy_address = ((address - alloc->base) ^ 1 << (order + MIN_BLOCK_LOG2)) + alloc->base;
-        buddy_state = get_state(alloc, buddy_address, order);
+    if (leaks->fn != NULL) leaks->fn(addr, length, leaks->ctx);
+    leaks->count++;
+}
 
-        if (buddy_state != 0) break;
-    }
+size_t buddy_thread_leak_report(buddy_thread_arenas_t *arenas, buddy_leak_fn fn, void *ctx) {
+    struct thread_leaks leaks = { arenas, NULL, fn, ctx, 0 };
 
-    // Add the final, merged block back to free lists
-    append(alloc, address, order);
+    buddy_leak_report(arenas->parent, report_thread_leak, &leaks);
 
-    #ifdef LOGGING
-    printf("Cannot merge further. Block returned to free list of order %u\n\n", order);
-    #endif
-}
\ No newline at end of file
+    // The allocators of the arenas have no lock, so their owners must not be using them
+    for (size_t i = 0; i < arenas->slot_count; i++) {
+        leaks.arena = __atomic_load_n(&arenas->slots[i], __ATOMIC_ACQUIRE);
+        if (leaks.arena != NULL) report_tree(leaks.arena->alloc, report_thread_leak, &leaks);
+    }
+
+    return leaks.count;
+}
+#endif
+#endif
\ No newline at end of file
@@ -4,8 +4,33 @@
 #include <stdint.h>
 #include <stddef.h>
 
-//#define LOGGING
-#define ERR_LOGGING
+// The header is shared with C++, which spells static assertions differently
+#ifdef __cplusplus
+#define BUDDY_STATIC_ASSERT(cond, msg) static_assert(cond, msg)
+#else
+#define BUDDY_STATIC_ASSERT(cond, msg) _Static_assert(cond, msg)
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//#define BUDDY_TRACE
+//#define BUDDY_RECORD
+//#define BUDDY_THREADS
+//#define BUDDY_ATOMIC
+//#define BUDDY_SLAB
+//#define BUDDY_TRIM
+//#define BUDDY_HEAP
+//#define BUDDY_THREAD_ARENAS
+//#define BUDDY_PURGE
+//#define BUDDY_BLOCKED_TREE
+//#define BUDDY_TREE_ONLY
+//#define BUDDY_ADDRESS_ORDERED
+//#define BUDDY_LAZY
+//#define BUDDY_LAZY_MERGE
+//#define BUDDY_RELOCATABLE
+//#define BUDDY_CHECKED
 
 /* ================================= BUDDIES ==================================
  * The buddy allocator assumes that the memory pool it manages is a power of 2.
@@ -16,15 +41,27 @@
  * To find the correct buddy to merge, the buddy block's address can be
  * calculated using XOR:
  *
- * buddy address = (address - base) XOR 2^(order + MIN_BLOCK_LOG2)
+ * buddy address = (address - base) XOR 2^(order + min_log2)
+ *
+ * ================================= GEOMETRY =================================
+ * The geometry of a pool is chosen at runtime when it is initialized. It is
+ * described by three values stored in the allocator:
+ *
+ * min_log2     - log2 of the smallest block size
+ * max_log2     - log2 of the largest block size
+ * mem_log2     - log2 of the memory pool size, rounded up to a power of 2
+ *
+ * buddy_init uses MIN_BLOCK_LOG2 and MAX_BLOCK_LOG2 as the default geometry.
+ * Pools with other geometries can live side by side in the same process by
+ * initializing them with buddy_init_ex.
  *
  * ================================ FREE LISTS ================================
  * Allocated block sizes are always powers of 2. The smallest block size will
- * be of order 0. The largest block size will be of order MAX_ORDER.
+ * be of order 0. The largest block size will be of order max_order.
  *
- * MAX_ORDER    = MAX_BLOCK_LOG2 - MIN_BLOCK_LOG2
- * order        = BLOCK_LOG2 - MIN_BLOCK_LOG2
- * block size   = 2^(order + MIN_BLOCK_LOG2)
+ * max_order    = max_log2 - min_log2
+ * order        = BLOCK_LOG2 - min_log2
+ * block size   = 2^(order + min_log2)
  *
  * A collection of linked lists called free lists is maintained for all blocks
  * of free memory. Memory blocks of the same order are linked in the same list.
@@ -32,9 +69,14 @@
  * done by casting the base address of the block to a linked list node pointer.
  * Blocks that are split or allocated should not be in the free lists.
  *
+ * A bitmap of orders with non-empty free lists is kept alongside the free
+ * lists. Bit n is set when the free list of order n holds at least one block,
+ * so the smallest order that can satisfy a request is found with a single bit
+ * scan instead of walking the free lists.
+ *
  * The minimum block size should be set to greater than the size of a linked
  * list node. This is 8 bytes on 32-bit systems and 16 bytes on 64-bit. The
- * maximum block size should not be greater than the total memory size.
+ * maximum block size is clamped to the memory pool size.
  *
  * ================================= BIT TREE =================================
  * The bit tree maps the entire memory pool, with each bit representing a block
@@ -42,8 +84,8 @@
  * is a power of 2. This structure allows the height and total number of nodes
  * to be calculated as:
  *
- * height           = MEM_BLOCK_LOG2 - MIN_BLOCK_LOG2
- * TOTAL_TREE_NODES = 2^(height + 1) - 1
+ * height           = mem_log2 - min_log2
+ * total tree nodes = 2^(height + 1) - 1
  *
  * The bit tree is used for easy and fast tracking of memory block states. The
  * bit tree tracks two states:
@@ -56,8 +98,8 @@
  * With the base address of the memory pool and given a block's address and
  * order, the block's bit tree index and array index can be calculated with:
  *
- * offset       = (address - base) / 2^(MIN_BLOCK_LOG2 + order)
- * index        = 2^height - 1 + offset
+ * offset       = (address - base) / 2^(min_log2 + order)
+ * index        = 2^(height - order) - 1 + offset
  *
  * array index  = index / 32
  * word offset  = index % 32
@@ -67,24 +109,462 @@
  * order, the array can be truncated to skip these nodes. The bit tree index
  * calculation needs to be modified to account for the truncated nodes.
  *
- * TRUNCATED_TREE_NODES = 2^(MEM_BLOCK_LOG2 - MAX_BLOCK_LOG2) - 1
- * index                = 2^height - 1 + offset - TRUNCATED_TREE_NODES
+ * truncated tree nodes = 2^(mem_log2 - max_log2) - 1
+ * index                = 2^(height - order) - 1 + offset - truncated tree nodes
+ *
+ * In a deep tree every level lives in a different part of the array, so a
+ * merge climbing from order 0 touches one cache line per level. Defining
+ * BUDDY_BLOCKED_TREE stores the tree in bands of BUDDY_TREE_BAND_LEVELS levels
+ * instead, counted up from order 0. Each band is cut into subtrees, each with
+ * the levels of the band and stored in level order in 2^levels bits, which is
+ * one 64-byte cache line for the default of 9 levels. The bands follow each
+ * other from order 0 up, and the band holding max_order may have fewer levels.
+ * With the bit offset of each band kept in the allocator for every order, the
+ * index becomes:
+ *
+ * band         = order / BUDDY_TREE_BAND_LEVELS
+ * bottom       = band * BUDDY_TREE_BAND_LEVELS
+ * top          = min(bottom + BUDDY_TREE_BAND_LEVELS - 1, max_order)
+ * depth        = top - order
+ * index        = band offset + (offset >> depth) * 2^(top - bottom + 1)
+ *                + 2^depth - 1 + offset % 2^depth
+ *
+ * A merge then touches a single cache line for every BUDDY_TREE_BAND_LEVELS
+ * levels it climbs. The bands take about as much space as the level order
+ * array, and the tree is aligned to a cache line. Finding a node takes a
+ * lookup and a few more instructions, so this only pays off for trees much
+ * larger than the cache. A climb that crosses into the next band touches a
+ * second line after those lookups, and can end up slower than with the level
+ * order array.
+ *
+ * Bulk queries such as buddy_census scan the tree an order at a time, using
+ * kernels that count the marked nodes of a run of bits, count the sibling
+ * pairs with a marked node, and find the first node that is not marked while
+ * its sibling is, which is the first free block of the order. The kernels use
+ * AVX2 when the CPU supports it and NEON on AArch64, picked at runtime on
+ * first use, and fall back to scalar code. Defining BUDDY_SCALAR_KERNELS
+ * always uses the scalar code.
+ *
+ * ================================ FREE MAPS =================================
+ * Free list nodes are stored in the free blocks themselves, so every free and
+ * split writes to memory the program no longer uses, faulting in pages that
+ * were never touched or were released with madvise. Defining BUDDY_TREE_ONLY
+ * replaces the free lists with a free map per order, kept in the header, so
+ * free blocks are never written. The free map of an order has one bit per
+ * block of that order, set while the block is free, and is summarized by
+ * levels of 64-bit words where each bit is set while the word below it is
+ * nonzero:
+ *
+ * level 0 bits = 2^(height - order)
+ * level n bits = level n - 1 bits / 64, until a level fits in a single word
+ *
+ * A free block of an order is found by descending from the top word through
+ * the first set bit at every level, which always yields the free block with
+ * the lowest address. Adding and removing a block update its bit, and only
+ * climb the levels while a word becomes nonzero or zero. The free maps take
+ * about as much space as the bit tree. BUDDY_TREE_ONLY does not combine with
+ * BUDDY_PURGE, which keeps the state of free blocks in the blocks.
+ *
+ * Free lists hand out the block of an order freed last, so over time the
+ * blocks in use scatter across the pool. Defining BUDDY_ADDRESS_ORDERED keeps
+ * the free lists, and adds the free maps as an index of the blocks in them,
+ * so that allocations take the free block with the lowest address instead.
+ * A block added to or removed from a list is set or cleared in the map of its
+ * order as well, which only climbs the levels of the map as described above.
+ * Blocks in use pack towards the low end of the pool, and the free memory at
+ * the high end stays in large blocks, which merge and can be purged. Unlike
+ * BUDDY_TREE_ONLY, it combines with BUDDY_PURGE, in which case a purged block
+ * is taken before resident blocks at higher addresses. With BUDDY_LAZY_MERGE,
+ * blocks waiting to be merged are still reused before the free lists.
+ *
+ * ================================== HEADER ==================================
+ * The buddy struct, the free lists and the bit tree are placed at the start
+ * of the memory pool, in that order. Their combined size depends on the pool
+ * geometry, so the memory left over for allocation is only known once the
+ * pool is initialized. Memory past the end of the pool that is still covered
+ * by the bit tree is marked reserved, so blocks are never merged with it.
+ * With BUDDY_TREE_ONLY or BUDDY_ADDRESS_ORDERED, the free maps are placed
+ * after the bit tree.
+ *
+ * =========================== LAZY INITIALIZATION ============================
+ * Initializing a pool adds every block of the largest order to the free
+ * lists, writing a free list node into each of them, and clears the whole bit
+ * tree, so a large pool mapped with mmap is mostly faulted in before the first
+ * allocation. Defining BUDDY_LAZY leaves the blocks of the largest order past
+ * a frontier instead, starting at the first such block of the pool. They are
+ * free in the bit tree but not in the free lists, and the order stays in the
+ * bitmap of orders with free blocks while any remain. Once the free list of
+ * the largest order is empty, the block at the frontier is handed out and the
+ * frontier moves up by a block, so the pages of a block are only touched once
+ * the blocks below it are used up. Blocks above the frontier are counted as
+ * free by buddy_stats. Only the few smaller blocks at both ends of the pool
+ * are added to the free lists up front.
+ *
+ * buddy_init_zeroed and buddy_init_oob_zeroed also skip clearing the bit tree
+ * and the other tables of the metadata, which must then be filled with zeros,
+ * as memory fresh from mmap is. Initialization then only writes the buddy
+ * struct, the per order tables and the nodes marking memory outside of the
+ * pool as reserved, which takes time independent of the pool size. Heap arenas
+ * are initialized this way.
+ *
+ * =============================== LAZY MERGING ===============================
+ * A freed block is merged with its buddy all the way up, so a program that
+ * frees a block and then allocates one of the same size splits the merged
+ * block all the way down again. Defining BUDDY_LAZY_MERGE defers merging
+ * instead: a freed block is kept on its order's deferred array, still marked
+ * allocated in the bit tree so its buddy never merges with it, and is handed
+ * out first by the next allocation of that order. Once BUDDY_DEFER_SIZE blocks
+ * of an order are deferred, each further free merges the oldest deferred block
+ * instead, so the most recently freed blocks are the ones kept for reuse and
+ * every free does a bounded amount of work. When an allocation finds no large
+ * enough free block, every deferred block is merged and the allocation is
+ * retried. buddy_coalesce merges every deferred block on demand.
+ *
+ * Deferred blocks are not in use, and buddy_stats counts them as free blocks
+ * of their order, but the bit tree still shows them as allocated. Freeing a
+ * deferred block again is rejected by searching the ring of its order, which
+ * holds at most BUDDY_DEFER_SIZE blocks. Batch frees and blocks drained from
+ * thread caches are merged straight away.
+ *
+ * =================================== SLABS ==================================
+ * Every block is at least a minimum size block, which must hold the two free
+ * list pointers, so small objects waste much of their block. Defining
+ * BUDDY_SLAB serves requests of up to BUDDY_SLAB_MAX bytes from slabs
+ * instead. A slab is a block of 2^BUDDY_SLAB_LOG2 bytes, or a minimum size
+ * block if that is larger, holding objects of a single size class. The size
+ * classes are 8 bytes and then every multiple of 16 up to BUDDY_SLAB_MAX. The
+ * slab starts with a header and a bitmap of its free objects, followed by the
+ * objects. Objects are aligned to the largest power of 2 dividing their class.
+ * Slabs with free objects are kept on a list per class, and a slab is returned
+ * to the pool when its last object is freed, unless it is the only slab of its
+ * class with free objects.
+ *
+ * Slabs are blocks aligned to their size, so the slab of an object is found by
+ * aligning its address down. An object is told apart from a block by its
+ * address being inside an allocated block rather than at its start. Pools
+ * whose largest block is smaller than a slab do not use slabs.
+ *
+ * ================================= TRIMMING =================================
+ * A request just over a power of 2 wastes nearly half of its block. Defining
+ * BUDDY_TRIM adds buddy_malloc_trimmed, which allocates a run instead: only
+ * the minimum size blocks needed to cover the request are kept, as the
+ * fewest blocks aligned to their own size, and the rest of the best-fit block
+ * is returned to the free lists straight away. A run is the binary expansion
+ * of its length in minimum size blocks, with the largest block first:
+ *
+ * 65 KiB request in a 128 KiB block = 64 KiB block + 1 KiB block, with 32, 16,
+ *                                     8, 4, 2 and 1 KiB blocks freed
+ *
+ * Each block of a run is allocated in the bit tree like any other block. A
+ * run bitmap with one bit per minimum size block marks the start of every
+ * block of a run after the first, so freeing without the size can follow the
+ * run to its end, and a sized free can tell a run from a single block.
+ *
+ * ============================== PLACEMENT HINTS =============================
+ * Blocks with different lifetimes that share a region keep each other from
+ * merging, as a single long-lived block pins every larger block containing
+ * it. buddy_malloc_hint takes a hint of how long the block will live, and
+ * places short-lived blocks in the free block with the lowest address large
+ * enough, and long-lived blocks in the one with the highest address. The
+ * block is split towards its own end of the pool. Churn stays at the low end,
+ * long-lived blocks pack together at the high end, and the memory between
+ * them is left in large blocks that can still merge. Hot data is hinted as
+ * short-lived and cold data as long-lived, so hot blocks share fewer pages.
+ *
+ * The free block is found by walking down the bit tree from the blocks of the
+ * max order at that end of the pool, only into split blocks larger than the
+ * request. Hinted requests take the lock and bypass the thread caches. With
+ * BUDDY_ATOMIC, blocks are merged outside of any single lock, and a block
+ * being merged looks free in the bit tree, so hints are ignored. With
+ * BUDDY_LAZY, blocks past the frontier are not searched. Requests for which
+ * the search finds no block are served as by buddy_malloc.
+ *
+ * ================================= PURGING ==================================
+ * Memory freed back to the pool stays resident, so the pool's footprint never
+ * shrinks after a spike. Defining BUDDY_PURGE lets free blocks of at least two
+ * pages give their pages back to the OS with madvise once they have stayed
+ * free for a while. Time is counted in epochs, each ended by a call to
+ * buddy_purge, which purges the blocks freed at least the given number of
+ * epochs ago. buddy_purge_start runs it from a background thread at a fixed
+ * interval, so blocks are purged after staying free for between decay and
+ * decay + 1 intervals. The first page of a purged block stays resident, since
+ * the free list node is stored there.
+ *
+ * Free blocks large enough to be purged record the epoch they were freed in.
+ * Purged blocks are kept in free lists of their own, and allocations take
+ * blocks whose pages are still resident first. Blocks are purged outside of
+ * the lock in batches of up to BUDDY_PURGE_BATCH blocks, which are taken out
+ * of the free lists while their pages are released, so allocations may
+ * transiently fail while the only large enough blocks are being purged. A
+ * purged block that is split or merged is no longer purged as a whole, and is
+ * purged again once it stays free. The contents of purged memory are
+ * undefined, as pages released with MADV_FREE may keep their old contents.
+ *
+ * =============================== RELOCATION =================================
+ * The header holds the addresses of the pool and of its own tables, and the
+ * free list nodes link to each other, so a pool only works at the address it
+ * was set up at. Defining BUDDY_RELOCATABLE stores the free list links as
+ * offsets from the base instead, so that a pool kept in a memory mapped file
+ * or shared memory segment can be reopened at another address with
+ * buddy_attach. Attaching only points the header at its tables again and
+ * moves the few addresses it holds, such as the lazy frontier and the
+ * deferred blocks, and never walks the free lists or the bit tree.
+ *
+ * The header records the flags its layout depends on, and a pool can only
+ * be attached by code built with the same flags. Blocks keep their offsets in
+ * the pool, so they stay aligned to their size only as far as the new
+ * address is aligned like the old one. The lock and thread cache key are
+ * created again, so a pool is attached by one process at a time once the
+ * previous one stopped using it, and the blocks held in that process's
+ * thread caches stay allocated. Cannot be combined with BUDDY_SLAB, whose
+ * slabs link to each other by address.
+ *
+ * ================================== THREADS =================================
+ * Defining BUDDY_THREADS makes the allocator safe to use from multiple
+ * threads. The free lists and the bit tree are protected by a lock, so blocks
+ * are only split and merged while it is held.
+ *
+ * Each thread also gets a cache of free blocks, allocated from the pool on the
+ * thread's first use. The cache holds a magazine of up to BUDDY_CACHE_SIZE
+ * blocks for each of the BUDDY_CACHE_ORDERS smallest orders. Allocations and
+ * deallocations of these orders are served from the magazine without taking
+ * the lock. An empty magazine is refilled, and a full magazine is drained,
+ * by half of its size in a single batch under the lock. Larger orders always
+ * go straight to the free lists. Cached blocks are marked allocated in the bit
+ * tree, so they are never merged while they sit in a magazine. A thread's
+ * cache is returned to the pool when the thread exits, and every cache when
+ * buddy_mark is called.
+ *
+ * Defining BUDDY_ATOMIC, which implies BUDDY_THREADS, replaces the single lock
+ * with a spinlock per order. Blocks are marked in the bit tree with atomic
+ * operations on its words, since bits of the same word can belong to blocks
+ * owned by different threads. The state of the blocks of an order and the
+ * free list of that order only change under that order's lock. A free buddy
+ * is claimed for merging by removing it from its free list under the lock,
+ * and the merged block stays marked split until it is returned to the free
+ * lists of the next order. Allocation may transiently fail while another
+ * thread holds the only large enough block in the middle of a merge.
  */
 
-#define MEM_BLOCK_LOG2 8
-#define MAX_BLOCK_LOG2 8
-#define MIN_BLOCK_LOG2 4
+#if (defined(BUDDY_ATOMIC) || defined(BUDDY_THREAD_ARENAS)) && !defined(BUDDY_THREADS)
+#define BUDDY_THREADS
+#endif
+
+/* ================================== ERRORS ==================================
+ * Functions that fail return NULL or 0 and set errno to EINVAL for invalid
+ * arguments, or to ENOMEM when there is not enough memory. Deallocating an
+ * address that is not an allocated block leaves the allocator untouched and
+ * sets errno to EINVAL. Nothing is ever printed.
+ *
+ * ================================= CHECKING =================================
+ * A sized free trusts its size, so freeing with the wrong size or an address
+ * inside a block corrupts the pool, and blocks held in thread caches and
+ * deferred arrays look allocated, so freeing them again goes unnoticed.
+ * Defining BUDDY_CHECKED checks every block freed or resized through the
+ * public API before touching it. The address must be the start of a block
+ * allocated with the order of the size, which is looked up in the bit tree
+ * as by buddy_free_unsized, so in BUDDY_THREADS mode without BUDDY_ATOMIC
+ * every check takes the lock. Freed blocks get a cookie in their first word,
+ * which catches blocks freed again while they are held in a cache or array,
+ * and is cleared when they are handed out again. Up to 8 bytes of the slack
+ * between the requested size and the end of a block hold a canary, which
+ * catches small overflows when the block is freed with its size. Requests
+ * filling their block have no canary, and runs of BUDDY_TRIM and objects of
+ * BUDDY_SLAB are not checked beyond what their frees already validate.
+ *
+ * A block failing a check is left as it is, errno is set to EINVAL, and the
+ * failure is counted in buddy_stats and traced as an invalid free or, for a
+ * canary that was overwritten, an overflow. buddy_leak_report lists the live
+ * blocks left in a pool, such as at exit.
+ *
+ * ================================== TRACING =================================
+ * Defining BUDDY_TRACE records allocator events, such as allocations, splits,
+ * merges and failed allocations, as they happen. When it is not defined, the
+ * trace points compile to nothing. Each thread records events into its own
+ * ring of BUDDY_TRACE_SIZE events without taking any lock, and events are
+ * dropped while the ring is full. buddy_trace_drain hands the recorded events
+ * of all threads to a callback.
+ */
+
+/* ================================= RECORDING ================================
+ * Defining BUDDY_RECORD allows the allocations and frees made through the
+ * public API to be recorded to a file, to be replayed offline against other
+ * configurations. Recording is started and stopped at runtime for one pool at
+ * a time, and costs a timestamp and a few stores per operation while it runs.
+ * As with tracing, each thread writes into its own ring of BUDDY_RECORD_SIZE
+ * records without taking any lock, and records are dropped while the ring is
+ * full. A background thread writes the rings to the file every
+ * BUDDY_RECORD_INTERVAL milliseconds.
+ *
+ * The file starts with a buddy_record_header followed by buddy_record
+ * structs in the byte order of the recording machine. Each thread's records
+ * are in order, but records of different threads are interleaved by flush, so
+ * a replay should order them by timestamp.
+ */
+
+#ifdef BUDDY_RECORD
+#ifndef BUDDY_RECORD_SIZE
+#define BUDDY_RECORD_SIZE 8192
+#endif
+#ifndef BUDDY_RECORD_INTERVAL
+#define BUDDY_RECORD_INTERVAL 10
+#endif
+
+BUDDY_STATIC_ASSERT((BUDDY_RECORD_SIZE & (BUDDY_RECORD_SIZE - 1)) == 0, "BUDDY_RECORD_SIZE must be a power of 2");
+#endif
+
+#ifdef BUDDY_TRACE
+#ifndef BUDDY_TRACE_SIZE
+#define BUDDY_TRACE_SIZE 4096
+#endif
+
+BUDDY_STATIC_ASSERT((BUDDY_TRACE_SIZE & (BUDDY_TRACE_SIZE - 1)) == 0, "BUDDY_TRACE_SIZE must be a power of 2");
+#endif
+
+#ifdef BUDDY_BLOCKED_TREE
+// Levels of the bit tree stored together, so that a subtree of the band fills 2^levels bits
+#ifndef BUDDY_TREE_BAND_LEVELS
+#define BUDDY_TREE_BAND_LEVELS 9
+#endif
+#endif
+
+#if defined(BUDDY_TREE_ONLY) && defined(BUDDY_PURGE)
+#error "BUDDY_TREE_ONLY cannot be combined with BUDDY_PURGE"
+#endif
+
+// The free maps replace the free lists with BUDDY_TREE_ONLY, and index them with BUDDY_ADDRESS_ORDERED
+#if defined(BUDDY_TREE_ONLY) || defined(BUDDY_ADDRESS_ORDERED)
+#define BUDDY_FREE_MAPS
+#endif
+
+#if defined(BUDDY_RELOCATABLE) && defined(BUDDY_SLAB)
+#error "BUDDY_RELOCATABLE cannot be combined with BUDDY_SLAB"
+#endif
+
+#ifdef BUDDY_PURGE
+#ifndef BUDDY_PURGE_BATCH
+#define BUDDY_PURGE_BATCH 64
+#endif
+// Passed to madvise to release the pages of purged blocks, such as MADV_DONTNEED or MADV_FREE
+#ifndef BUDDY_PURGE_ADVICE
+#define BUDDY_PURGE_ADVICE MADV_DONTNEED
+#endif
+#endif
+
+#ifdef BUDDY_LAZY_MERGE
+#ifndef BUDDY_DEFER_SIZE
+#define BUDDY_DEFER_SIZE 32
+#endif
 
-_Static_assert(MIN_BLOCK_LOG2 > 3);
-_Static_assert(MIN_BLOCK_LOG2 <= MAX_BLOCK_LOG2);
-_Static_assert(MAX_BLOCK_LOG2 <= MEM_BLOCK_LOG2);
+BUDDY_STATIC_ASSERT(BUDDY_DEFER_SIZE >= 2, "BUDDY_DEFER_SIZE must be at least 2");
+#endif
 
-#define MAX_ORDER (MAX_BLOCK_LOG2 - MIN_BLOCK_LOG2)
+#ifdef BUDDY_SLAB
+#ifndef BUDDY_SLAB_LOG2
+#define BUDDY_SLAB_LOG2 12
+#endif
 
-#define TOTAL_TREE_NODES ((1 << (MEM_BLOCK_LOG2 - MIN_BLOCK_LOG2 + 1)) - 1)
-#define TRUNCATED_TREE_NODES ((1 << (MEM_BLOCK_LOG2 - MAX_BLOCK_LOG2)) - 1)
-#define TREE_NODES (TOTAL_TREE_NODES - TRUNCATED_TREE_NODES)
-#define TREE_WORDS ((TREE_NODES + 31) / 32)
+#define BUDDY_SLAB_MAX 128
+#define BUDDY_SLAB_CLASSES (BUDDY_SLAB_MAX / 16 + 1)
+
+BUDDY_STATIC_ASSERT(BUDDY_SLAB_LOG2 >= 9, "BUDDY_SLAB_LOG2 must be at least 9");
+#endif
+
+#ifdef BUDDY_THREADS
+#include <pthread.h>
+
+#ifndef BUDDY_CACHE_ORDERS
+#define BUDDY_CACHE_ORDERS 4
+#endif
+#ifndef BUDDY_CACHE_SIZE
+#define BUDDY_CACHE_SIZE 32
+#endif
+
+BUDDY_STATIC_ASSERT(BUDDY_CACHE_SIZE >= 2, "BUDDY_CACHE_SIZE must be at least 2");
+#endif
+
+/* ================================== HEAPS ===================================
+ * A pool managed by buddy_init is fixed in size. Defining BUDDY_HEAP adds a
+ * heap that owns a set of pools, called arenas, and maps new arenas with mmap
+ * when the existing ones cannot satisfy a request. Each arena is a power of 2
+ * aligned to its size, so it can hand out a block of its full size, and its
+ * metadata is mapped separately as for buddy_init_oob. Requests larger than
+ * an arena get an arena of their own. Arenas can be backed by huge pages, in
+ * which case the arena size must be a multiple of the huge page size. When no
+ * huge pages are reserved, arenas fall back to normal pages, advised to be
+ * backed by transparent huge pages.
+ *
+ * The heap keeps its arenas in a table sorted by address, so a free is routed
+ * to its arena with a binary search. An arena that becomes fully free is
+ * unmapped, unless it is the arena its node allocates from, which is kept to
+ * avoid mapping a new arena on the next allocation. buddy_heap_trim unmaps
+ * every fully free arena. Blocks held in thread caches and slabs keep their
+ * arena in use, so an arena only becomes fully free once the threads that
+ * used it exit.
+ *
+ * On NUMA machines, each arena can be bound to the node of the thread that
+ * caused it to be mapped with mbind. Threads then allocate from the arenas of
+ * their own node first, mapping a new arena on their node before falling back
+ * to the arenas of other nodes. The node of a thread is looked up every
+ * BUDDY_HEAP_NODE_REFRESH allocations, since threads rarely migrate between
+ * nodes. A heap holds up to BUDDY_HEAP_ARENAS arenas.
+ */
+
+#ifdef BUDDY_HEAP
+#ifndef BUDDY_HEAP_ARENAS
+#define BUDDY_HEAP_ARENAS 256
+#endif
+#ifndef BUDDY_HEAP_NODES
+#define BUDDY_HEAP_NODES 64
+#endif
+#ifndef BUDDY_HEAP_NODE_REFRESH
+#define BUDDY_HEAP_NODE_REFRESH 256
+#endif
+
+// Flags of buddy_heap_create
+#define BUDDY_HEAP_HUGETLB 1
+#define BUDDY_HEAP_NUMA 2
+#endif
+
+/* ============================== THREAD ARENAS ===============================
+ * Thread caches only keep a few blocks of the smallest orders away from the
+ * lock. Defining BUDDY_THREAD_ARENAS, which implies BUDDY_THREADS, adds a set
+ * of thread arenas instead: each thread that allocates gets an arena of its
+ * own, a block of 2^arena_log2 bytes carved from a parent allocator, holding
+ * an allocator of its own that only its thread uses.
+ * Allocations and frees of the owner never take a lock. Requests that do not
+ * fit in the arena, or that it cannot satisfy, go to the parent.
+ *
+ * Arenas are aligned to their size, so the arena of a block is found in a
+ * table with a slot for every arena sized block of the parent. A block freed
+ * by another thread is pushed on the lock-free remote free list of its arena,
+ * which the owner drains on its next allocation. Frees pushed on the remote
+ * list are only checked against the bit tree when they are drained, while
+ * the checks of BUDDY_CHECKED on the contents of a block are made by the
+ * freeing thread. When a thread exits, its arena goes back to the parent if
+ * it is fully free, and is otherwise left for the next thread that needs an
+ * arena to adopt, along with the blocks still allocated from it.
+ *
+ * Blocks allocated from arenas are traced by the allocator of their arena,
+ * and recorded by BUDDY_RECORD as blocks of the parent, which is the pool to
+ * record. The arenas themselves are left out of recordings, so a recording
+ * replays the blocks the program asked for. With BUDDY_CHECKED,
+ * buddy_thread_leak_report reports the blocks of the parent and of every
+ * arena.
+ */
+
+#ifndef MIN_BLOCK_LOG2
+#define MIN_BLOCK_LOG2 4
+#endif
+#ifndef MAX_BLOCK_LOG2
+#define MAX_BLOCK_LOG2 8
+#endif
+
+BUDDY_STATIC_ASSERT(MIN_BLOCK_LOG2 > 3, "blocks must hold a free list node");
+BUDDY_STATIC_ASSERT(MIN_BLOCK_LOG2 <= MAX_BLOCK_LOG2, "the smallest block must not be larger than the largest");
+
+// Upper bound on the number of orders of any pool, used to size statistics arrays
+#define BUDDY_MAX_ORDERS 64
 
 struct buddy_page {
     struct buddy_page *prev;
@@ -92,14 +572,230 @@ struct buddy_page {
 };
 typedef struct buddy_page buddy_page_t;
 
+#ifdef BUDDY_ATOMIC
+// Each lock is padded to a cache line so threads spinning on different orders do not contend
+struct buddy_lock {
+    uint32_t value;
+    uint8_t pad[60];
+};
+#endif
+
+#ifdef BUDDY_BLOCKED_TREE
+// Where the nodes of an order sit in the blocked bit tree, so that finding a node is a few shifts and masks
+struct buddy_tree_level {
+    size_t base;
+    uint8_t depth;
+    uint8_t levels;
+};
+#endif
+
+#ifdef BUDDY_FREE_MAPS
+// The levels of the free map of an order, from the single top word down to one bit per block
+struct buddy_free_map {
+    uint64_t *top;
+    uint64_t *bottom;
+};
+#endif
+
+#if defined(BUDDY_PURGE) && defined(BUDDY_THREADS)
+// Background thread purging an allocator at a fixed interval
+struct buddy_purger {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t interval;
+    uint32_t decay;
+    uint8_t running;
+    uint8_t stopping;
+};
+#endif
+
+#ifdef BUDDY_LAZY_MERGE
+// Ring of freed blocks of an order whose merging is deferred, starting with the oldest
+struct buddy_deferred {
+    uint32_t first;
+    uint32_t count;
+    void *blocks[BUDDY_DEFER_SIZE];
+};
+#endif
+
+#ifdef BUDDY_SLAB
+struct buddy_slab;
+
+// Slabs with free objects of a size class, and the layout of its slabs
+struct buddy_slab_class {
+    struct buddy_slab *partial;
+    uint32_t capacity;
+    uint32_t first;
+    #ifdef BUDDY_ATOMIC
+    struct buddy_lock lock;
+    #endif
+};
+#endif
+
 struct buddy {
+    #ifdef BUDDY_RELOCATABLE
+    uint64_t magic;
+    uint64_t layout;
+    uintptr_t meta;
+    #endif
     uintptr_t base;
+    size_t offset;
     size_t size;
-    uint32_t bit_tree[TREE_WORDS];
-    buddy_page_t *free_lists[MAX_ORDER + 1];
+    uint8_t min_log2;
+    uint8_t max_log2;
+    uint8_t mem_log2;
+    uint8_t max_order;
+    size_t truncated_nodes;
+    size_t tree_words;
+    #ifdef BUDDY_BLOCKED_TREE
+    struct buddy_tree_level *tree_levels;
+    #endif
+    uint64_t free_orders;
+    uint32_t *bit_tree;
+    #ifdef BUDDY_FREE_MAPS
+    struct buddy_free_map *free_maps;
+    #endif
+    #ifndef BUDDY_TREE_ONLY
+    buddy_page_t **free_lists;
+    #endif
+    size_t *free_counts;
+    #ifdef BUDDY_LAZY_MERGE
+    struct buddy_deferred *deferred;
+    #endif
+    size_t in_use;
+    size_t peak_in_use;
+    size_t failed_allocs;
+    size_t splits;
+    size_t merges;
+    #ifdef BUDDY_CHECKED
+    size_t invalid_frees;
+    #endif
+    #ifdef BUDDY_TRIM
+    uint32_t *run_bits;
+    #endif
+    #ifdef BUDDY_LAZY
+    uintptr_t frontier;
+    uintptr_t frontier_end;
+    #endif
+    #ifdef BUDDY_PURGE
+    buddy_page_t **purged_lists;
+    uint8_t purge_order;
+    size_t purge_epoch;
+    #ifdef BUDDY_THREADS
+    struct buddy_purger purger;
+    #endif
+    #endif
+    #ifdef BUDDY_SLAB
+    uint8_t slab_log2;
+    struct buddy_slab_class slab_classes[BUDDY_SLAB_CLASSES];
+    #endif
+    #ifdef BUDDY_ATOMIC
+    struct buddy_lock *order_locks;
+    #elif defined(BUDDY_THREADS)
+    pthread_mutex_t lock;
+    #endif
+    #ifdef BUDDY_THREADS
+    pthread_key_t cache_key;
+    struct buddy_cache *caches;
+    #endif
+    #ifdef BUDDY_ATOMIC
+    struct buddy_lock caches_lock;
+    #endif
 };
 typedef struct buddy buddy_t;
 
+#ifdef BUDDY_TRACE
+enum buddy_event {
+    BUDDY_EVENT_ALLOC,
+    BUDDY_EVENT_FREE,
+    BUDDY_EVENT_SPLIT,
+    BUDDY_EVENT_MERGE,
+    BUDDY_EVENT_OOM,
+    BUDDY_EVENT_INVALID_FREE,
+    BUDDY_EVENT_OVERFLOW
+};
+
+/* A recorded event. The offset is the address of the block relative to the
+ * allocator's base, and the order is the order of the block. Splits describe
+ * the block being split, and merges the block resulting from the merge. Failed
+ * allocations only record the requested order.
+ */
+struct buddy_trace_event {
+    const buddy_t *alloc;
+    size_t offset;
+    uint8_t event;
+    uint8_t order;
+};
+
+typedef void (*buddy_trace_fn)(const struct buddy_trace_event *, void *);
+
+/* Calls the callback with each event recorded since the last drain, along
+ * with the provided context, and removes the events from the rings. Returns
+ * the number of events drained.
+ */
+size_t buddy_trace_drain(buddy_trace_fn, void *);
+
+/* Returns the number of events dropped because a thread's ring was full. */
+size_t buddy_trace_dropped(void);
+#endif
+
+// Identifies a recording, followed by the version of its format
+#define BUDDY_RECORD_MAGIC "BUDDYREC"
+#define BUDDY_RECORD_VERSION 1
+
+// Offset of allocations that failed
+#define BUDDY_RECORD_FAILED UINT64_MAX
+
+enum buddy_record_op {
+    BUDDY_RECORD_MALLOC,
+    BUDDY_RECORD_FREE,
+    BUDDY_RECORD_REALLOC
+};
+
+/* Describes the pool a recording was made from. */
+struct buddy_record_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t pool_size;
+    uint8_t min_log2;
+    uint8_t max_log2;
+    uint8_t reserved[6];
+};
+
+/* A recorded operation. The time is in nanoseconds of CLOCK_MONOTONIC. The
+ * offset is the address of the block relative to the allocator's base, and
+ * the size is the requested length, which is 0 for unsized frees and clamped
+ * to 32 bits. Reallocations in place record the block and its new length, and
+ * reallocations that move the block record an allocation and a free. The
+ * thread is a small number identifying the ring that recorded the operation,
+ * which is reused by a later thread once its thread exits.
+ */
+struct buddy_record {
+    uint64_t time;
+    uint64_t offset;
+    uint32_t size;
+    uint16_t thread;
+    uint8_t op;
+    uint8_t reserved;
+};
+
+#ifdef BUDDY_RECORD
+/* Starts recording the operations on the allocator to the file at the given
+ * path, replacing its contents. Only one allocator can be recorded at a time.
+ * Returns 0 on success, or -1 with errno set to EBUSY if a recording is
+ * already running, or as set by opening the file or starting the thread.
+ */
+int buddy_record_start(buddy_t *, const char *);
+
+/* Stops recording, writes the remaining records and closes the file. */
+void buddy_record_stop(void);
+
+/* Returns the number of records dropped because a thread's ring was full. */
+size_t buddy_record_dropped(void);
+#endif
+
 /* Initializes the allocator. The buddy struct is allocated within the provided
  * memory pool. The bit tree is initialized as all free, only marking memory
  * allocated for the buddy struct as used. Free blocks of memory are added to
@@ -108,15 +804,414 @@ typedef struct buddy buddy_t;
  */
 buddy_t *buddy_init(char *, size_t);
 
+/* Initializes the allocator with the given minimum and maximum block sizes,
+ * passed as log2 values. The free lists and the bit tree are sized for the
+ * provided memory pool and placed right after the buddy struct. buddy_init is
+ * equivalent to calling this with MIN_BLOCK_LOG2 and MAX_BLOCK_LOG2. Returns
+ * NULL if initialization fails.
+ */
+buddy_t *buddy_init_ex(char *, size_t, uint8_t, uint8_t);
+
+/* Returns the size of the metadata storage buddy_init_oob needs to manage the
+ * provided memory pool with the given minimum and maximum block sizes, passed
+ * as log2 values. Returns 0 if the pool cannot hold a minimum size block.
+ */
+size_t buddy_metadata_size(char *, size_t, uint8_t, uint8_t);
+
+/* Initializes the allocator with its buddy struct, free lists and bit tree in
+ * separate metadata storage, followed by the memory pool and its geometry as
+ * for buddy_init_ex. Since no header is carved out of the pool, the whole pool
+ * is available for allocation. A power of 2 pool aligned to its size can hand
+ * out a single block of its full size. Returns NULL if initialization fails.
+ */
+buddy_t *buddy_init_oob(char *, size_t, char *, size_t, uint8_t, uint8_t);
+
+#ifdef BUDDY_LAZY
+/* Initializes the allocator as buddy_init_ex, for a memory pool whose start
+ * is filled with zeros, such as a fresh mapping. The bit tree and the other
+ * tables in the header are not cleared. Returns NULL if initialization fails.
+ */
+buddy_t *buddy_init_zeroed(char *, size_t, uint8_t, uint8_t);
+
+/* Initializes the allocator as buddy_init_oob, with metadata storage filled
+ * with zeros, such as a fresh mapping. The bit tree and the other tables in
+ * the metadata are not cleared. Returns NULL if initialization fails.
+ */
+buddy_t *buddy_init_oob_zeroed(char *, size_t, char *, size_t, uint8_t, uint8_t);
+#endif
+
+#ifdef BUDDY_RELOCATABLE
+/* Reopens a pool set up with buddy_init or buddy_init_ex in the given memory,
+ * which holds the pool after being mapped again at this address, possibly a
+ * different one. Returns NULL and sets errno to EINVAL if the memory holds no
+ * pool built with the same flags.
+ */
+buddy_t *buddy_attach(char *);
+
+/* Reopens a pool set up with buddy_init_oob, given its metadata storage and
+ * its memory, either of which may be at a different address than before.
+ * Returns NULL and sets errno to EINVAL if the metadata holds no pool built
+ * with the same flags.
+ */
+buddy_t *buddy_attach_oob(char *, char *);
+#endif
+
 /* Allocates a best-fit block of memory for the requested size. Larger blocks
- * may be split to obtain the best-fit block size. Returns NULL if allocation
- * fails.
+ * may be split to obtain the best-fit block size. With BUDDY_SLAB, requests
+ * of up to BUDDY_SLAB_MAX bytes are served from slabs. Returns NULL if
+ * allocation fails.
  */
 void *buddy_malloc(buddy_t *, size_t);
 
+/* Allocates a block of memory for the requested size whose address is a
+ * multiple of the requested alignment, which must be a power of 2. Since
+ * blocks are aligned to their own size, this allocates a block at least as
+ * large as the alignment. The block is deallocated with buddy_aligned_free
+ * or buddy_free_unsized. Returns NULL if allocation fails.
+ */
+void *buddy_aligned_alloc(buddy_t *, size_t, size_t);
+
+/* Deallocates a block allocated with buddy_aligned_alloc, given the same
+ * alignment and size it was allocated with. Sets errno to EINVAL if the
+ * alignment is not a power of 2.
+ */
+void buddy_aligned_free(buddy_t *, void *, size_t, size_t);
+
+/* Allocates up to n blocks of memory for the requested size and stores their
+ * addresses in the provided array. A single larger block is split to hand out
+ * several blocks at once where possible, so the blocks tend to be contiguous.
+ * Returns the number of blocks allocated, which is less than n if memory runs
+ * out.
+ */
+size_t buddy_malloc_batch(buddy_t *, size_t, void **, size_t);
+
+// Flags of buddy_malloc_hint
+#define BUDDY_HINT_SHORT_LIVED 1
+#define BUDDY_HINT_LONG_LIVED 2
+
+/* Allocates a best-fit block of memory for the requested size as
+ * buddy_malloc does, placed at the low end of the pool if the flags are
+ * BUDDY_HINT_SHORT_LIVED and at the high end if they are
+ * BUDDY_HINT_LONG_LIVED. Without flags, this is buddy_malloc. The block is
+ * deallocated as any other. Returns NULL with errno set to EINVAL if both
+ * flags are set, and NULL if allocation fails.
+ */
+void *buddy_malloc_hint(buddy_t *, size_t, int);
+
+#ifdef BUDDY_TRIM
+/* Allocates a run of blocks covering the requested size, returning the tail
+ * of the best-fit block that the request does not need to the free lists.
+ * Requests that fill their block, or are small enough for a slab, are
+ * allocated as by buddy_malloc. A run is deallocated with buddy_free and the
+ * requested size, or with buddy_free_unsized, but not with buddy_free_batch,
+ * and resized by moving it to a new run. Returns NULL if allocation fails.
+ */
+void *buddy_malloc_trimmed(buddy_t *, size_t);
+#endif
+
 /* Deallocates a memory block allocated by buddy_malloc. Blocks deallocated are
  * continuously merged with its buddy block if possible.
  */
 void buddy_free(buddy_t *, void *, size_t);
 
+/* Deallocates n memory blocks allocated with the same requested size. Blocks
+ * whose buddies are also in the batch are merged directly, so each merge is
+ * only done once. The array of addresses is reordered and overwritten.
+ */
+void buddy_free_batch(buddy_t *, void **, size_t, size_t);
+
+/* Resizes a memory block allocated by buddy_malloc from the old requested size
+ * to the new one. Shrinking splits the block in place. Growing merges the
+ * block in place with its buddies if they are free, and only moves the block
+ * and copies its contents otherwise. A NULL address allocates a new block, and
+ * a new size of 0 frees the block. Returns the address of the resized block,
+ * or NULL if it could not be resized, in which case the old block is kept.
+ */
+void *buddy_realloc(buddy_t *, void *, size_t, size_t);
+
+/* Deallocates a memory block allocated by buddy_malloc without the requested
+ * size. The block's order is recovered from the bit tree, so the size does
+ * not need to be stored by the caller.
+ */
+void buddy_free_unsized(buddy_t *, void *);
+
+/* Returns the size of the block or run backing an allocation, or the size
+ * class of a slab object, which is at least the requested size. Returns 0 if
+ * the address is not an allocated block.
+ */
+size_t buddy_usable_size(buddy_t *, void *);
+
+struct buddy_stats {
+    size_t free_blocks[BUDDY_MAX_ORDERS];
+    size_t bytes_free;
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+    size_t failed_allocs;
+    size_t splits;
+    size_t merges;
+    #ifdef BUDDY_CHECKED
+    size_t invalid_frees;
+    #endif
+};
+
+/* Reports the number of blocks in each free list, the bytes free and in use,
+ * the high-water mark of bytes in use, and the number of failed allocations,
+ * splits and merges since initialization. With BUDDY_CHECKED, it also counts
+ * the frees and resizes that failed a check. Blocks held in thread caches and
+ * slabs count as in use, and deferred blocks count as free. The counters are
+ * updated as blocks move in and out of the free lists, so this does not walk
+ * any allocator state.
+ */
+void buddy_stats(buddy_t *, struct buddy_stats *);
+
+struct buddy_fragmentation {
+    int largest_order;
+    size_t largest_free;
+    size_t bytes_free;
+    double ratio;
+};
+
+/* Scans the bit tree with buddy_census to find the largest free block, which
+ * is the largest order that can be allocated without merging, and the total
+ * free memory. The external fragmentation ratio is 1 - largest free block /
+ * bytes free, from 0 when all free memory is in one block to nearly 1 when it
+ * is spread over many small blocks. The largest order is -1 if no memory is
+ * free. In BUDDY_ATOMIC mode the scan does not stop other threads, so the
+ * result is approximate.
+ */
+void buddy_fragmentation(buddy_t *, struct buddy_fragmentation *);
+
+struct buddy_census {
+    size_t allocated[BUDDY_MAX_ORDERS];
+    size_t split[BUDDY_MAX_ORDERS];
+    size_t free[BUDDY_MAX_ORDERS];
+};
+
+/* Counts the blocks of each order that are allocated, split and free by
+ * scanning the bit tree a level at a time. Allocated blocks include reserved
+ * memory outside of the pool and blocks held in thread caches, slabs and
+ * deferred arrays. The scan uses the bit kernels, and takes time proportional
+ * to the size of the bit tree rather than the number of blocks. In
+ * BUDDY_ATOMIC mode the scan does not stop other threads, so the result is
+ * approximate.
+ */
+void buddy_census(buddy_t *, struct buddy_census *);
+
+/* Returns the free block of the order with the lowest address without
+ * allocating it, or NULL if the order has no free block.
+ */
+void *buddy_find_free(buddy_t *, uint8_t);
+
+#ifdef BUDDY_CHECKED
+typedef void (*buddy_leak_fn)(void *addr, size_t length, void *ctx);
+
+/* Walks the bit tree for the blocks still allocated and hands the address
+ * and size of each to the callback, which may be NULL to only count them.
+ * Blocks holding the cookie of a freed block, such as those in thread
+ * caches and deferred arrays, are skipped. Slabs are reported an object at a
+ * time, and runs as a whole. The lock is held during the walk, so the
+ * callback must not call into the pool. Returns the number of live blocks.
+ */
+size_t buddy_leak_report(buddy_t *, buddy_leak_fn, void *);
+#endif
+
+#ifdef BUDDY_LAZY_MERGE
+/* Merges every deferred block with its buddies and returns it to the free
+ * lists. Returns the number of blocks merged.
+ */
+size_t buddy_coalesce(buddy_t *);
+#endif
+
+#ifdef BUDDY_PURGE
+/* Ends the current purge epoch and releases the pages of the free blocks
+ * freed at least the given number of epochs ago, keeping the first page of
+ * each block. A decay of 0 purges every free block. Returns the number of
+ * bytes released.
+ */
+size_t buddy_purge(buddy_t *, unsigned);
+
+#ifdef BUDDY_THREADS
+/* Starts a thread calling buddy_purge with the given decay every interval, in
+ * milliseconds. Returns 0 on success, or -1 with errno set to EBUSY if the
+ * allocator's thread is already running, or as set by starting the thread.
+ */
+int buddy_purge_start(buddy_t *, unsigned, unsigned);
+
+/* Stops the allocator's purge thread, waiting for a running purge to finish. */
+void buddy_purge_stop(buddy_t *);
+#endif
+#endif
+
+/* Frees every block of the pool at once, restoring the state it was in right
+ * after initialization without walking the allocated blocks. The bit tree is
+ * cleared and the free memory added back to the free lists, so a reset costs
+ * about as much as clearing the bit tree. Cumulative statistics are kept. The
+ * blocks held in thread caches are dropped, and no other thread may use the
+ * pool during the reset. Returns 0, or -1 and sets errno if the thread cache
+ * key cannot be replaced.
+ */
+int buddy_reset(buddy_t *);
+
+#ifndef BUDDY_SLAB
+typedef struct buddy_mark buddy_mark_t;
+
+/* Records the state of the pool for buddy_release_to, in a block allocated
+ * from the pool that holds a copy of the bit tree. Marks nest, and a mark that
+ * is no longer needed is freed with buddy_free_unsized. The thread caches of
+ * every thread are returned to the pool first along with their blocks, so no
+ * other thread may use the pool while the mark is taken. Not available with
+ * BUDDY_SLAB, whose slabs keep their state in the pool memory. Returns NULL
+ * and sets errno to ENOMEM if the copy does not fit in a block, or as set by
+ * replacing the thread cache key.
+ */
+buddy_mark_t *buddy_mark(buddy_t *);
+
+/* Rolls the pool back to the state recorded by the mark, freeing every block
+ * allocated since it was taken, including later marks, and the mark itself.
+ * The free lists are rebuilt from the bit tree, so this costs a copy and a
+ * scan of the tree. Blocks allocated before the mark must not be freed while
+ * it is held, as rolling back allocates them again. Thread caches were all
+ * returned when the mark was taken, so the caches and the blocks they hold
+ * are freed with the rest of the scope, and no other thread may use the pool
+ * during the rollback. Returns 0, or -1 and sets errno if the thread cache key
+ * cannot be replaced.
+ */
+int buddy_release_to(buddy_t *, buddy_mark_t *);
+#endif
+
+/* Releases resources the allocator holds outside of the memory pool, such as
+ * the lock and the thread cache key, and stops its purge thread. The allocator
+ * must not be used after.
+ */
+void buddy_destroy(buddy_t *);
+
+#ifdef BUDDY_HEAP
+// An arena of a heap and the node its memory is bound to
+struct buddy_arena {
+    char *base;
+    size_t size;
+    char *meta;
+    size_t meta_size;
+    buddy_t *alloc;
+    int node;
+};
+
+struct buddy_heap {
+    uint8_t arena_log2;
+    uint8_t min_log2;
+    int flags;
+    size_t count;
+    struct buddy_arena arenas[BUDDY_HEAP_ARENAS];
+    uintptr_t current[BUDDY_HEAP_NODES];
+    #ifdef BUDDY_THREADS
+    pthread_rwlock_t lock;
+    #endif
+};
+typedef struct buddy_heap buddy_heap_t;
+
+/* Creates a heap of arenas of 2^arena_log2 bytes with the given minimum block
+ * size, passed as a log2 value. The flags are BUDDY_HEAP_HUGETLB to back the
+ * arenas with huge pages and BUDDY_HEAP_NUMA to bind arenas to nodes. No arena
+ * is mapped until the first allocation. Returns NULL if creation fails.
+ */
+buddy_heap_t *buddy_heap_create(uint8_t, uint8_t, int);
+
+/* Unmaps every arena of the heap along with the heap itself. The heap must
+ * not be used after.
+ */
+void buddy_heap_destroy(buddy_heap_t *);
+
+/* Allocates a best-fit block for the requested size from the arenas of the
+ * calling thread's node, mapping a new arena if none can satisfy the request.
+ * Returns NULL if allocation fails.
+ */
+void *buddy_heap_malloc(buddy_heap_t *, size_t);
+
+/* Allocates as buddy_heap_malloc, preferring the arenas of the given node. */
+void *buddy_heap_malloc_node(buddy_heap_t *, size_t, int);
+
+/* Deallocates a block allocated from the heap, unmapping its arena if it
+ * becomes fully free. Sets errno to EINVAL if the address is not in any arena.
+ */
+void buddy_heap_free(buddy_heap_t *, void *, size_t);
+
+/* Deallocates a block allocated from the heap without the requested size. */
+void buddy_heap_free_unsized(buddy_heap_t *, void *);
+
+/* Resizes a block allocated from the heap as buddy_realloc does within its
+ * arena, moving it to another arena if its own cannot hold the new size. The
+ * block is only moved when its arena is out of memory. Any other failure of
+ * buddy_realloc, such as an invalid block, returns NULL with its errno.
+ */
+void *buddy_heap_realloc(buddy_heap_t *, void *, size_t, size_t);
+
+/* Returns the usable size of a block allocated from the heap, or 0 if the
+ * address is not an allocated block of any arena.
+ */
+size_t buddy_heap_usable_size(buddy_heap_t *, void *);
+
+/* Unmaps every fully free arena. Returns the number of bytes unmapped. */
+size_t buddy_heap_trim(buddy_heap_t *);
+
+#ifdef BUDDY_PURGE
+/* Purges every arena as buddy_purge does. Returns the number of bytes released. */
+size_t buddy_heap_purge(buddy_heap_t *, unsigned);
+#endif
+#endif
+
+#ifdef BUDDY_THREAD_ARENAS
+struct buddy_thread_arena;
+
+struct buddy_thread_arenas {
+    buddy_t *parent;
+    uint8_t arena_log2;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    struct buddy_thread_arena *abandoned;
+    size_t slot_count;
+    struct buddy_thread_arena **slots;
+};
+typedef struct buddy_thread_arenas buddy_thread_arenas_t;
+
+/* Creates a set of thread arenas of 2^arena_log2 bytes, carved from the
+ * parent allocator, which must be shared between threads. The set itself is
+ * allocated from the parent. Returns NULL if creation fails.
+ */
+buddy_thread_arenas_t *buddy_thread_arenas_create(buddy_t *, uint8_t);
+
+/* Returns every arena to the parent, along with the set itself. No thread may
+ * use the arenas or the blocks allocated from them after.
+ */
+void buddy_thread_arenas_destroy(buddy_thread_arenas_t *);
+
+/* Allocates a best-fit block for the requested size from the calling thread's
+ * arena, creating the arena on first use, and from the parent if the arena
+ * cannot satisfy the request. Returns NULL if allocation fails.
+ */
+void *buddy_thread_malloc(buddy_thread_arenas_t *, size_t);
+
+/* Deallocates a block allocated with buddy_thread_malloc from any thread. A
+ * block of another thread's arena is handed to that thread.
+ */
+void buddy_thread_free(buddy_thread_arenas_t *, void *, size_t);
+
+/* Deallocates a block allocated with buddy_thread_malloc without its size. */
+void buddy_thread_free_unsized(buddy_thread_arenas_t *, void *);
+
+#ifdef BUDDY_CHECKED
+/* Reports the blocks still allocated from the parent as buddy_leak_report
+ * does, with each arena replaced by the blocks allocated from it and the set
+ * itself left out. Blocks freed by other threads that the owner has not
+ * drained yet are skipped. The allocators of the arenas have no lock, so no
+ * thread may allocate from or free to the arenas while they are walked.
+ * Returns the number of live blocks.
+ */
+size_t buddy_thread_leak_report(buddy_thread_arenas_t *, buddy_leak_fn, void *);
+#endif
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
\ No newline at end of file
@@ -0,0 +1,200 @@
+#ifndef BUDDY_HPP
+#define BUDDY_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+#include <system_error>
+
+#include "buddy.h"
+
+/* ============================== C++ FRONT END ===============================
+ * buddy_allocator fixes the geometry of a pool at compile time: blocks of
+ * 2^MinLog2 to 2^MaxLog2 bytes carved from 2^MemLog2 bytes of memory. Its
+ * order and block size arithmetic is constexpr, so the order of a constant
+ * size is known at compile time and geometries buddy_init_ex would reject
+ * fail to compile. The blocks are still managed by buddy.c, built with the
+ * same flags as the code including this header.
+ *
+ * buddy_memory_resource adapts a pool to std::pmr, and buddy_stl_allocator to
+ * the Allocator requirements of the standard containers. Both pass the size
+ * of every deallocation on to buddy_free, so the order of a block is never
+ * looked up in the bit tree. Allocation failures throw std::bad_alloc.
+ */
+
+template <unsigned MinLog2, unsigned MaxLog2, unsigned MemLog2>
+class buddy_allocator {
+    static_assert(MinLog2 > 3, "blocks must hold a free list node");
+    static_assert(MinLog2 <= MaxLog2, "the smallest block must not be larger than the largest");
+    static_assert(MaxLog2 < MemLog2, "the largest block must leave room for the metadata");
+    static_assert(MemLog2 < sizeof(size_t) * 8, "the memory size must fit in a size_t");
+
+public:
+    static constexpr size_t memory_size = (size_t)1 << MemLog2;
+    static constexpr size_t min_block_size = (size_t)1 << MinLog2;
+    static constexpr size_t max_block_size = (size_t)1 << MaxLog2;
+    static constexpr unsigned orders = MaxLog2 - MinLog2 + 1;
+
+    // Order of the best-fit block for the requested size, as computed by buddy_malloc
+    static constexpr unsigned order(size_t length) {
+        unsigned n = length > 1 ? sizeof(size_t) * 8 - __builtin_clzl(length - 1) : 0;
+        return n > MinLog2 ? n - MinLog2 : 0;
+    }
+
+    static constexpr size_t block_size(unsigned order) {
+        return min_block_size << order;
+    }
+
+    static constexpr bool fits(size_t length) {
+        return length <= max_block_size;
+    }
+
+    /* Sets up a pool in the given memory, which must be 2^MemLog2 bytes long.
+     * Throws std::system_error with the errno of buddy_init_ex on failure.
+     */
+    explicit buddy_allocator(void *memory)
+        : alloc(buddy_init_ex(static_cast<char *>(memory), memory_size, MinLog2, MaxLog2)) {
+        if (alloc == nullptr) throw std::system_error(errno, std::generic_category());
+    }
+
+    buddy_allocator(const buddy_allocator &) = delete;
+    buddy_allocator &operator=(const buddy_allocator &) = delete;
+
+    ~buddy_allocator() {
+        buddy_destroy(alloc);
+    }
+
+    void *malloc(size_t length) noexcept {
+        return buddy_malloc(alloc, length);
+    }
+
+    // Allocates a block of a constant size, rejecting sizes larger than the largest block at compile time
+    template <size_t Length>
+    void *malloc() noexcept {
+        static_assert(fits(Length), "requested size is larger than the largest block");
+        return buddy_malloc(alloc, Length);
+    }
+
+    void *aligned_alloc(size_t align, size_t length) noexcept {
+        return buddy_aligned_alloc(alloc, align, length);
+    }
+
+    void aligned_free(void *addr, size_t align, size_t length) noexcept {
+        buddy_aligned_free(alloc, addr, align, length);
+    }
+
+    void free(void *addr, size_t length) noexcept {
+        buddy_free(alloc, addr, length);
+    }
+
+    void free(void *addr) noexcept {
+        buddy_free_unsized(alloc, addr);
+    }
+
+    void *realloc(void *addr, size_t old_length, size_t new_length) noexcept {
+        return buddy_realloc(alloc, addr, old_length, new_length);
+    }
+
+    size_t usable_size(void *addr) noexcept {
+        return buddy_usable_size(alloc, addr);
+    }
+
+    void stats(struct buddy_stats *stats) noexcept {
+        buddy_stats(alloc, stats);
+    }
+
+    // The underlying pool, for the parts of the C API the class does not wrap
+    buddy_t *native() const noexcept {
+        return alloc;
+    }
+
+private:
+    buddy_t *alloc;
+};
+
+// Allocates a block from the pool, using buddy_aligned_alloc for alignments malloc does not guarantee
+inline void *buddy_allocate(buddy_t *alloc, size_t length, size_t align) {
+    void *addr = align <= alignof(std::max_align_t) ? buddy_malloc(alloc, length) : buddy_aligned_alloc(alloc, align, length);
+    if (addr == nullptr) throw std::bad_alloc();
+    return addr;
+}
+
+// Deallocates a block of buddy_allocate, with buddy_aligned_free for the blocks of buddy_aligned_alloc
+inline void buddy_deallocate(buddy_t *alloc, void *addr, size_t length, size_t align) noexcept {
+    if (align <= alignof(std::max_align_t)) buddy_free(alloc, addr, length);
+    else buddy_aligned_free(alloc, addr, align, length);
+}
+
+class buddy_memory_resource : public std::pmr::memory_resource {
+public:
+    explicit buddy_memory_resource(buddy_t *alloc) noexcept : alloc(alloc) {}
+
+    template <unsigned MinLog2, unsigned MaxLog2, unsigned MemLog2>
+    explicit buddy_memory_resource(buddy_allocator<MinLog2, MaxLog2, MemLog2> &allocator) noexcept
+        : alloc(allocator.native()) {}
+
+    buddy_t *native() const noexcept {
+        return alloc;
+    }
+
+private:
+    void *do_allocate(size_t length, size_t align) override {
+        return buddy_allocate(alloc, length, align);
+    }
+
+    void do_deallocate(void *addr, size_t length, size_t align) override {
+        buddy_deallocate(alloc, addr, length, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const buddy_memory_resource *resource = dynamic_cast<const buddy_memory_resource *>(&other);
+        return resource != nullptr && resource->alloc == alloc;
+    }
+
+    buddy_t *alloc;
+};
+
+template <typename T>
+class buddy_stl_allocator {
+public:
+    using value_type = T;
+
+    explicit buddy_stl_allocator(buddy_t *alloc) noexcept : alloc(alloc) {}
+
+    template <unsigned MinLog2, unsigned MaxLog2, unsigned MemLog2>
+    explicit buddy_stl_allocator(buddy_allocator<MinLog2, MaxLog2, MemLog2> &allocator) noexcept
+        : alloc(allocator.native()) {}
+
+    template <typename U>
+    buddy_stl_allocator(const buddy_stl_allocator<U> &other) noexcept : alloc(other.native()) {}
+
+    T *allocate(size_t n) {
+        if (n > SIZE_MAX / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T *>(buddy_allocate(alloc, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *addr, size_t n) noexcept {
+        buddy_deallocate(alloc, addr, n * sizeof(T), alignof(T));
+    }
+
+    buddy_t *native() const noexcept {
+        return alloc;
+    }
+
+    template <typename U>
+    bool operator==(const buddy_stl_allocator<U> &other) const noexcept {
+        return alloc == other.native();
+    }
+
+    template <typename U>
+    bool operator!=(const buddy_stl_allocator<U> &other) const noexcept {
+        return alloc != other.native();
+    }
+
+private:
+    buddy_t *alloc;
+};
+
+#endif
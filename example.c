@@ -4,7 +4,7 @@
 #include "buddy.h"
 
 int main() {
-    char memory[1 << MEM_BLOCK_LOG2];
+    char memory[4 << MAX_BLOCK_LOG2];
 
     buddy_t *alloc = buddy_init(memory, sizeof(memory));
     if (!alloc) return -1;
@@ -0,0 +1,1218 @@
+/* Round-trip tests for the buddy allocator, run by make test for every flag
+ * combination it lists.
+ *
+ * Each test starts from a freshly initialized pool, takes a census of its bit
+ * tree, runs its operations and checks that the pool settles back to the same
+ * census. Along the way the tree is checked to cover the whole pool, the free
+ * lists to hold exactly the blocks the tree has free, without overlapping or
+ * lying outside of the pool, and the statistics to agree with them. With
+ * BUDDY_THREADS each test runs in a thread of its own, and the pool settles
+ * once the thread has exited and given back its cache.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buddy.h"
+
+#ifdef BUDDY_THREADS
+#include <pthread.h>
+#endif
+#ifdef BUDDY_RECORD
+#include <unistd.h>
+#endif
+
+#define POOL_LOG2 22
+#define POOL_MIN_LOG2 4
+#define POOL_MAX_LOG2 18
+
+// Largest size the tests ask for
+#define SIZE_LOG2 16
+
+// Most live blocks a test holds at once
+#define BLOCKS 512
+
+static char pool[(size_t)1 << POOL_LOG2] __attribute__((aligned(1 << POOL_LOG2)));
+
+static const char *test_name;
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, test_name, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+/* RANDOM NUMBERS */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// Sizes are log-uniform from 1 byte up to 2^SIZE_LOG2
+static size_t random_size(uint64_t *state) {
+    uint64_t x = next_random(state);
+    size_t half = ((size_t)1 << (x % (SIZE_LOG2 + 1))) / 2;
+    return half + 1 + (x >> 8) % (half ? half : 1);
+}
+
+/* CONTENTS */
+// Fills a block with a pattern derived from its address, so blocks handed out twice are caught
+static void fill(void *p, size_t length) {
+    for (size_t i = 0; i < length; i++) ((unsigned char *)p)[i] = (unsigned char)((uintptr_t)p + i);
+}
+
+static int has_pattern(void *p, void *origin, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (((unsigned char *)p)[i] != (unsigned char)((uintptr_t)origin + i)) return 0;
+    }
+    return 1;
+}
+
+/* INVARIANTS */
+// One bit per smallest block of the pool, set for the free blocks seen by check_pool
+static uint8_t seen[((size_t)1 << (POOL_LOG2 - POOL_MIN_LOG2)) / 8];
+
+static buddy_t *new_pool(const char *name) {
+    test_name = name;
+    buddy_t *alloc = buddy_init_ex(pool, sizeof(pool), POOL_MIN_LOG2, POOL_MAX_LOG2);
+    CHECK(alloc != NULL);
+    if (alloc == NULL) exit(1);
+    return alloc;
+}
+
+// Marks a free block as seen, checking that it is aligned to its size, lies within the pool and was not seen before
+static void check_free_block(buddy_t *alloc, uintptr_t address, uint8_t order) {
+    size_t offset = address - alloc->base;
+    size_t first = (offset - alloc->offset) >> alloc->min_log2;
+
+    CHECK(offset % ((size_t)1 << (order + alloc->min_log2)) == 0);
+    CHECK(offset >= alloc->offset && offset + ((size_t)1 << (order + alloc->min_log2)) <= alloc->offset + alloc->size);
+    for (size_t i = first; i < first + ((size_t)1 << order) && i < sizeof(seen) * 8; i++) {
+        CHECK(!(seen[i / 8] >> i % 8 & 1));
+        seen[i / 8] |= 1 << i % 8;
+    }
+}
+
+#ifdef BUDDY_TREE_ONLY
+// Checks the blocks set in the bottom level of the free map of an order, returning the one with the lowest address
+static size_t check_map(buddy_t *alloc, uint8_t order, uintptr_t *lowest) {
+    size_t bits = (size_t)1 << (alloc->mem_log2 - alloc->min_log2 - order), count = 0;
+
+    for (size_t i = 0; i < bits; i++) {
+        if (!(alloc->free_maps[order].bottom[i / 64] >> i % 64 & 1)) continue;
+
+        uintptr_t address = alloc->base + (i << (order + alloc->min_log2));
+        check_free_block(alloc, address, order);
+        if (*lowest == 0 || address < *lowest) *lowest = address;
+        count++;
+    }
+    return count;
+}
+#else
+// Free list links are offsets from the base plus one with BUDDY_RELOCATABLE
+static buddy_page_t *from_link(buddy_t *alloc, buddy_page_t *link) {
+    #ifdef BUDDY_RELOCATABLE
+    if (link != NULL) return (buddy_page_t *)((uintptr_t)link + alloc->base - 1);
+    #else
+    (void)alloc;
+    #endif
+    return link;
+}
+
+// Checks the blocks of a free list and its links, returning the one with the lowest address
+static size_t check_list(buddy_t *alloc, buddy_page_t *list, uint8_t order, uintptr_t *lowest) {
+    size_t count = 0;
+
+    for (buddy_page_t *p = from_link(alloc, list); p != NULL; p = from_link(alloc, p->next)) {
+        check_free_block(alloc, (uintptr_t)p, order);
+        CHECK(p->next == NULL || from_link(alloc, from_link(alloc, p->next)->prev) == p);
+        if (*lowest == 0 || (uintptr_t)p < *lowest) *lowest = (uintptr_t)p;
+        count++;
+    }
+    return count;
+}
+#endif
+
+// Takes a census of the bit tree, checking that its blocks tile the pool, that the free lists or free maps hold its free blocks, and that the statistics agree with them
+static void check_pool(buddy_t *alloc, struct buddy_census *census) {
+    struct buddy_stats stats;
+    struct buddy_fragmentation fragmentation;
+    size_t bytes_free = 0, covered = 0;
+    int largest_order = -1;
+
+    #ifdef BUDDY_LAZY_MERGE
+    // Deferred blocks count as free in the statistics but are still marked in the tree
+    buddy_coalesce(alloc);
+    #endif
+    memset(seen, 0, sizeof(seen));
+    buddy_census(alloc, census);
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) {
+        uintptr_t lowest = 0;
+
+        #ifdef BUDDY_TREE_ONLY
+        size_t count = check_map(alloc, order, &lowest);
+        #else
+        size_t count = check_list(alloc, alloc->free_lists[order], order, &lowest);
+        #endif
+        #ifdef BUDDY_PURGE
+        count += check_list(alloc, alloc->purged_lists[order], order, &lowest);
+        #endif
+        #ifdef BUDDY_LAZY
+        // Blocks past the frontier are free in the tree without being in the free lists
+        if (order == alloc->max_order) {
+            for (uintptr_t address = alloc->frontier; address < alloc->frontier_end; address += (size_t)1 << alloc->max_log2) {
+                check_free_block(alloc, address, order);
+                if (lowest == 0 || address < lowest) lowest = address;
+                count++;
+            }
+        }
+        #endif
+        CHECK(count == census->free[order] && (uintptr_t)buddy_find_free(alloc, order) == lowest);
+        CHECK((alloc->free_orders >> order & 1) == (count > 0));
+        covered += (census->allocated[order] + census->free[order]) << (order + alloc->min_log2);
+        bytes_free += census->free[order] << (order + alloc->min_log2);
+        if (census->free[order] > 0) largest_order = order;
+    }
+    CHECK(covered == (size_t)1 << alloc->mem_log2);
+
+    buddy_stats(alloc, &stats);
+    buddy_fragmentation(alloc, &fragmentation);
+    for (uint8_t order = 0; order <= alloc->max_order; order++) CHECK(stats.free_blocks[order] == census->free[order]);
+    CHECK(stats.bytes_free == bytes_free && stats.bytes_free + stats.bytes_in_use == alloc->size);
+    CHECK(fragmentation.bytes_free == bytes_free && fragmentation.largest_order == largest_order);
+}
+
+static size_t free_bytes(buddy_t *alloc, const struct buddy_census *census) {
+    size_t bytes = 0;
+
+    for (uint8_t order = 0; order <= alloc->max_order; order++) bytes += census->free[order] << (order + alloc->min_log2);
+    return bytes;
+}
+
+#ifdef BUDDY_SLAB
+// Returns the memory of the slabs the size classes hold on to, which must be empty, so refilling one takes all of its objects from it
+static size_t held_slabs(buddy_t *alloc) {
+    static void *objects[(size_t)1 << (BUDDY_SLAB_LOG2 - 3)];
+    size_t slab_size = (size_t)1 << alloc->slab_log2, held = 0;
+
+    for (size_t i = 0; i < BUDDY_SLAB_CLASSES; i++) {
+        struct buddy_slab_class *c = &alloc->slab_classes[i];
+        uintptr_t slab = (uintptr_t)c->partial;
+        if (slab == 0) continue;
+
+        for (size_t n = 0; n < c->capacity; n++) {
+            objects[n] = buddy_malloc(alloc, i == 0 ? 8 : i * 16);
+            CHECK((uintptr_t)objects[n] - slab < slab_size);
+        }
+        for (size_t n = 0; n < c->capacity; n++) buddy_free_unsized(alloc, objects[n]);
+        held += slab_size;
+    }
+    return held;
+}
+#endif
+
+// With BUDDY_SLAB each size class may hold on to an empty slab, so only the free memory besides them settles back
+static void check_settled(buddy_t *alloc, const struct buddy_census *before) {
+    struct buddy_census after;
+    size_t held = 0;
+
+    #ifdef BUDDY_SLAB
+    held = held_slabs(alloc);
+    #endif
+    check_pool(alloc, &after);
+    if (held == 0) CHECK(memcmp(before, &after, sizeof(after)) == 0);
+    else CHECK(free_bytes(alloc, &after) + held == free_bytes(alloc, before));
+}
+
+// A test takes the census of a new pool, runs its operations on it and returns the pool to be checked
+typedef buddy_t *test_fn(struct buddy_census *);
+
+struct run {
+    test_fn *test;
+    struct buddy_census before;
+    buddy_t *alloc;
+};
+
+static void *run_thread(void *p) {
+    struct run *run = p;
+
+    run->alloc = run->test(&run->before);
+    return NULL;
+}
+
+// Runs a test in its own thread, so the thread's cache goes back to the pool before it is checked
+static void run_test(test_fn *test) {
+    struct run run = { .test = test };
+
+    #ifdef BUDDY_THREADS
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, run_thread, &run) == 0);
+    pthread_join(thread, NULL);
+    #else
+    run_thread(&run);
+    #endif
+    check_settled(run.alloc, &run.before);
+    buddy_destroy(run.alloc);
+}
+
+/* TESTS */
+// Allocates blocks of random sizes, then frees them in a scattered order, half of them without their size
+static buddy_t *test_alloc_free(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    static size_t lengths[BLOCKS];
+    uint64_t state = 88172645463325252ull;
+    buddy_t *alloc = new_pool("alloc_free");
+
+    check_pool(alloc, before);
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < BLOCKS; i++) {
+            lengths[i] = random_size(&state);
+            blocks[i] = buddy_malloc(alloc, lengths[i]);
+            if (blocks[i] != NULL) {
+                CHECK(buddy_usable_size(alloc, blocks[i]) >= lengths[i]);
+                fill(blocks[i], lengths[i]);
+            }
+        }
+        check_pool(alloc, &(struct buddy_census){ 0 });
+
+        for (size_t n = 0; n < BLOCKS; n++) {
+            size_t i = (n * 0x9e3779b97f4a7c15ull) & (BLOCKS - 1);
+            if (blocks[i] == NULL) continue;
+
+            CHECK(has_pattern(blocks[i], blocks[i], lengths[i]));
+            if (n % 2) buddy_free(alloc, blocks[i], lengths[i]);
+            else buddy_free_unsized(alloc, blocks[i]);
+        }
+    }
+    return alloc;
+}
+
+// Pools of different geometries live side by side, each handing out blocks within its own bounds
+static buddy_t *test_geometry(struct buddy_census *before) {
+    static char small[(size_t)1 << 12] __attribute__((aligned(1 << 12)));
+    buddy_t *alloc = new_pool("geometry");
+    buddy_t *other = buddy_init_ex(small, sizeof(small), 5, 10);
+
+    CHECK(other != NULL && other->min_log2 == 5 && other->max_log2 == 10 && other->mem_log2 <= 12);
+    CHECK(buddy_malloc(other, 2048) == NULL);
+    check_pool(alloc, before);
+
+    char *p = buddy_malloc(other, 1024);
+    char *q = buddy_malloc(alloc, 1024);
+    CHECK(p != NULL && p >= small && p + 1024 <= small + sizeof(small));
+    CHECK(q != NULL && q >= pool && q + 1024 <= pool + sizeof(pool));
+    buddy_free(other, p, 1024);
+    buddy_free(alloc, q, 1024);
+    buddy_destroy(other);
+    return alloc;
+}
+
+// Takes blocks of one size until they run out, which must leave no free block of that order or above
+static buddy_t *test_exhaust(struct buddy_census *before) {
+    static void *blocks[(size_t)1 << (POOL_LOG2 - POOL_MAX_LOG2 + 3)];
+    buddy_t *alloc = new_pool("exhaust");
+
+    check_pool(alloc, before);
+    for (uint8_t order = alloc->max_order; order > alloc->max_order - 4; order--) {
+        size_t length = ((size_t)1 << (order + alloc->min_log2)) - 1;
+        size_t n = 0;
+
+        while (n < sizeof(blocks) / sizeof(blocks[0]) && (blocks[n] = buddy_malloc(alloc, length)) != NULL) n++;
+        CHECK(alloc->free_orders >> order == 0);
+        check_pool(alloc, &(struct buddy_census){ 0 });
+
+        for (size_t i = 0; i < n; i++) buddy_free(alloc, blocks[i], length);
+    }
+    return alloc;
+}
+
+// Grows and shrinks blocks, checking that their contents move along with them
+static buddy_t *test_realloc(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    static size_t lengths[BLOCKS];
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    buddy_t *alloc = new_pool("realloc");
+
+    check_pool(alloc, before);
+    for (size_t i = 0; i < BLOCKS; i++) {
+        lengths[i] = random_size(&state) / 4 + 1;
+        blocks[i] = buddy_malloc(alloc, lengths[i]);
+        if (blocks[i] != NULL) fill(blocks[i], lengths[i]);
+    }
+
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < BLOCKS; i++) {
+            if (blocks[i] == NULL) continue;
+
+            size_t length = random_size(&state);
+            void *origin = blocks[i];
+            void *p = buddy_realloc(alloc, blocks[i], lengths[i], length);
+            if (p == NULL) continue;
+
+            CHECK(has_pattern(p, origin, length < lengths[i] ? length : lengths[i]));
+            blocks[i] = p;
+            lengths[i] = length;
+            fill(p, length);
+        }
+        check_pool(alloc, &(struct buddy_census){ 0 });
+    }
+
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (blocks[i] != NULL) buddy_free(alloc, blocks[i], lengths[i]);
+    }
+    return alloc;
+}
+
+#ifdef BUDDY_SLAB
+// Allocates small objects of every size, which come from slabs aligned to the largest power of 2 dividing their class
+static buddy_t *test_slab(struct buddy_census *before) {
+    static void *objects[BLOCKS];
+    buddy_t *alloc = new_pool("slab");
+
+    check_pool(alloc, before);
+    for (size_t length = 1; length <= BUDDY_SLAB_MAX; length++) {
+        size_t size_class = length <= 8 ? 8 : (length + 15) & ~(size_t)15;
+
+        for (size_t i = 0; i < BLOCKS; i++) {
+            objects[i] = buddy_malloc(alloc, length);
+            CHECK(objects[i] != NULL && buddy_usable_size(alloc, objects[i]) == size_class);
+            CHECK((uintptr_t)objects[i] % (size_class & -size_class) == 0);
+            fill(objects[i], length);
+        }
+        for (size_t i = 0; i < BLOCKS; i++) {
+            CHECK(has_pattern(objects[i], objects[i], length));
+            if (i % 2) buddy_free(alloc, objects[i], length);
+            else buddy_free_unsized(alloc, objects[i]);
+        }
+    }
+    return alloc;
+}
+#endif
+
+#ifdef BUDDY_TRIM
+// Allocates runs of random sizes, which only keep the minimum size blocks covering them
+static buddy_t *test_trimmed(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    static size_t lengths[BLOCKS];
+    uint64_t state = 0x853c49e6748fea9bull;
+    struct buddy_stats start, stats;
+    buddy_t *alloc = new_pool("trimmed");
+
+    check_pool(alloc, before);
+    size_t length = ((size_t)65 << 10) - 100, min_size = (size_t)1 << POOL_MIN_LOG2;
+    buddy_stats(alloc, &start);
+    void *p = buddy_malloc_trimmed(alloc, length);
+    buddy_stats(alloc, &stats);
+    CHECK(p != NULL && stats.bytes_in_use == start.bytes_in_use + ((length + min_size - 1) & ~(min_size - 1)));
+    buddy_free(alloc, p, length);
+
+    for (size_t i = 0; i < BLOCKS; i++) {
+        lengths[i] = random_size(&state);
+        blocks[i] = buddy_malloc_trimmed(alloc, lengths[i]);
+        if (blocks[i] != NULL) fill(blocks[i], lengths[i]);
+    }
+    check_pool(alloc, &(struct buddy_census){ 0 });
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (blocks[i] == NULL) continue;
+
+        CHECK(has_pattern(blocks[i], blocks[i], lengths[i]));
+        if (i % 2) buddy_free(alloc, blocks[i], lengths[i]);
+        else buddy_free_unsized(alloc, blocks[i]);
+    }
+    return alloc;
+}
+#endif
+
+#ifdef BUDDY_PURGE
+// Blocks freed long enough ago release their pages, and are allocated again like any other free block
+static buddy_t *test_purge(struct buddy_census *before) {
+    static void *blocks[BLOCKS / 16];
+    size_t length = (size_t)1 << SIZE_LOG2;
+    buddy_t *alloc = new_pool("purge");
+
+    check_pool(alloc, before);
+    CHECK(buddy_purge(alloc, 0) > 0);
+    CHECK(buddy_purge(alloc, 0) == 0);
+    for (int round = 0; round < 2; round++) {
+        for (size_t i = 0; i < BLOCKS / 16; i++) {
+            blocks[i] = buddy_malloc(alloc, length);
+            CHECK(blocks[i] != NULL);
+            if (blocks[i] != NULL) fill(blocks[i], length);
+        }
+        for (size_t i = 0; i < BLOCKS / 16; i++) {
+            CHECK(has_pattern(blocks[i], blocks[i], length));
+            buddy_free(alloc, blocks[i], length);
+        }
+        check_pool(alloc, &(struct buddy_census){ 0 });
+
+        // The blocks were freed in the epoch the first call ends, so only the second one purges them
+        CHECK(buddy_purge(alloc, 1) == 0);
+        CHECK(buddy_purge(alloc, 1) > 0);
+    }
+    return alloc;
+}
+#endif
+
+#if defined(BUDDY_TREE_ONLY) || defined(BUDDY_ADDRESS_ORDERED)
+// Free maps hand out the free block of an order with the lowest address
+static buddy_t *test_lowest(struct buddy_census *before) {
+    static char *blocks[BLOCKS / 8];
+    size_t length = (size_t)1 << (SIZE_LOG2 - 4);
+    buddy_t *alloc = new_pool("lowest");
+
+    check_pool(alloc, before);
+    for (size_t i = 0; i < BLOCKS / 8; i++) blocks[i] = buddy_malloc(alloc, length);
+    for (size_t i = 2; i < BLOCKS / 8; i += 4) buddy_free(alloc, blocks[i], length);
+    #ifdef BUDDY_LAZY_MERGE
+    // Deferred blocks are reused before the free lists, latest first
+    buddy_coalesce(alloc);
+    #endif
+    for (size_t i = 2; i < BLOCKS / 8; i += 4) {
+        char *p = buddy_malloc(alloc, length);
+        CHECK(p != NULL && p <= blocks[i]);
+        blocks[i] = p;
+    }
+    for (size_t i = 0; i < BLOCKS / 8; i++) buddy_free_unsized(alloc, blocks[i]);
+    return alloc;
+}
+#endif
+
+#ifdef BUDDY_LAZY_MERGE
+// Freed blocks are handed out again before being merged, until buddy_coalesce merges them all
+static buddy_t *test_coalesce(struct buddy_census *before) {
+    static void *blocks[BLOCKS / 8];
+    size_t length = (size_t)1 << (SIZE_LOG2 - 4);
+    buddy_t *alloc = new_pool("coalesce");
+
+    check_pool(alloc, before);
+    for (size_t i = 0; i < BLOCKS / 8; i++) blocks[i] = buddy_malloc(alloc, length);
+    for (size_t i = 0; i < BLOCKS / 8; i++) {
+        buddy_free(alloc, blocks[i], length);
+        CHECK(buddy_malloc(alloc, length) == blocks[i]);
+    }
+
+    for (size_t i = 0; i < BLOCKS / 8; i++) buddy_free(alloc, blocks[i], length);
+    CHECK(buddy_coalesce(alloc) > 0);
+    CHECK(buddy_coalesce(alloc) == 0);
+    return alloc;
+}
+#endif
+
+// Allocates and frees blocks of each size in batches
+static buddy_t *test_batch(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    buddy_t *alloc = new_pool("batch");
+
+    check_pool(alloc, before);
+    for (size_t length = 16; length < (size_t)1 << SIZE_LOG2; length *= 4) {
+        size_t n = buddy_malloc_batch(alloc, length + 1, blocks, BLOCKS);
+        CHECK(n > 0);
+        for (size_t i = 0; i < n; i++) fill(blocks[i], length + 1);
+        for (size_t i = 0; i < n; i++) CHECK(has_pattern(blocks[i], blocks[i], length + 1));
+        check_pool(alloc, &(struct buddy_census){ 0 });
+
+        buddy_free_batch(alloc, blocks, length + 1, n);
+    }
+    return alloc;
+}
+
+// Keeps the metadata outside of the pool, which leaves the pool whole for a single block of its size
+static buddy_t *test_oob(struct buddy_census *before) {
+    static char metadata[(size_t)1 << (POOL_LOG2 - POOL_MIN_LOG2)] __attribute__((aligned(64)));
+    static void *blocks[BLOCKS];
+    uint64_t state = 0xda942042e4dd58b5ull;
+    size_t length = buddy_metadata_size(pool, sizeof(pool), POOL_MIN_LOG2, POOL_LOG2);
+
+    test_name = "oob";
+    CHECK(length > 0 && length <= sizeof(metadata));
+    CHECK(buddy_init_oob(metadata, length - 1, pool, sizeof(pool), POOL_MIN_LOG2, POOL_LOG2) == NULL);
+    buddy_t *alloc = buddy_init_oob(metadata, length, pool, sizeof(pool), POOL_MIN_LOG2, POOL_LOG2);
+    CHECK(alloc != NULL);
+    if (alloc == NULL) exit(1);
+
+    check_pool(alloc, before);
+    CHECK(before->free[alloc->max_order] == 1);
+    void *p = buddy_malloc(alloc, sizeof(pool));
+    CHECK(p == pool);
+    buddy_free(alloc, p, sizeof(pool));
+
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = buddy_malloc(alloc, random_size(&state));
+        CHECK(blocks[i] == NULL || ((char *)blocks[i] >= pool && (char *)blocks[i] < pool + sizeof(pool)));
+    }
+    check_pool(alloc, &(struct buddy_census){ 0 });
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (blocks[i] != NULL) buddy_free_unsized(alloc, blocks[i]);
+    }
+    return alloc;
+}
+
+#ifdef BUDDY_LAZY
+// Initializes a pool that is already filled with zeros, whose header is then left as it is
+static buddy_t *test_zeroed(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    uint64_t state = 0xbf58476d1ce4e5b9ull;
+
+    test_name = "zeroed";
+    memset(pool, 0, sizeof(pool));
+    buddy_t *alloc = buddy_init_zeroed(pool, sizeof(pool), POOL_MIN_LOG2, POOL_MAX_LOG2);
+    CHECK(alloc != NULL);
+    if (alloc == NULL) exit(1);
+
+    check_pool(alloc, before);
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = buddy_malloc(alloc, random_size(&state));
+        if (blocks[i] != NULL) memset(blocks[i], 0xff, buddy_usable_size(alloc, blocks[i]));
+    }
+    check_pool(alloc, &(struct buddy_census){ 0 });
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (blocks[i] != NULL) buddy_free_unsized(alloc, blocks[i]);
+    }
+    return alloc;
+}
+#endif
+
+// Allocates blocks of small sizes at alignments larger than them
+static buddy_t *test_aligned(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    buddy_t *alloc = new_pool("aligned");
+
+    check_pool(alloc, before);
+    for (size_t align = 16; align < (size_t)1 << SIZE_LOG2; align *= 8) {
+        for (size_t i = 0; i < BLOCKS / 8; i++) {
+            blocks[i] = buddy_aligned_alloc(alloc, align, i + 1);
+            CHECK(blocks[i] != NULL && (uintptr_t)blocks[i] % align == 0);
+        }
+        for (size_t i = 0; i < BLOCKS / 8; i++) {
+            if (i % 2) buddy_aligned_free(alloc, blocks[i], align, i + 1);
+            else buddy_free_unsized(alloc, blocks[i]);
+        }
+    }
+    return alloc;
+}
+
+// The counters follow blocks in and out of the pool, and freeing every other block scatters the free memory
+static buddy_t *test_stats(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    size_t length = sizeof(pool) / BLOCKS, n = 0;
+    struct buddy_stats start, stats;
+    struct buddy_fragmentation whole, scattered;
+    buddy_t *alloc = new_pool("stats");
+
+    check_pool(alloc, before);
+    buddy_stats(alloc, &start);
+    buddy_fragmentation(alloc, &whole);
+
+    while (n < BLOCKS && (blocks[n] = buddy_malloc(alloc, length)) != NULL) n++;
+    for (size_t i = 1; i < n; i += 2) buddy_free(alloc, blocks[i], length);
+    #ifdef BUDDY_LAZY_MERGE
+    buddy_coalesce(alloc);
+    #endif
+    buddy_stats(alloc, &stats);
+    buddy_fragmentation(alloc, &scattered);
+    CHECK(stats.bytes_in_use == start.bytes_in_use + (n + 1) / 2 * length);
+    CHECK(stats.peak_bytes_in_use >= start.bytes_in_use + n * length);
+    CHECK(stats.splits > start.splits && stats.failed_allocs == start.failed_allocs + 1);
+    CHECK(scattered.largest_order == (int)(alloc->max_order - (POOL_MAX_LOG2 - SIZE_LOG2 + 3)));
+    CHECK(scattered.ratio > whole.ratio && scattered.bytes_free == stats.bytes_free);
+
+    for (size_t i = 0; i < n; i += 2) buddy_free(alloc, blocks[i], length);
+    #ifdef BUDDY_LAZY_MERGE
+    buddy_coalesce(alloc);
+    #endif
+    buddy_stats(alloc, &stats);
+    CHECK(stats.bytes_in_use == start.bytes_in_use && stats.merges >= stats.splits - start.splits);
+    return alloc;
+}
+
+#ifdef BUDDY_TRACE
+// Events of each kind recorded for a pool
+struct events {
+    const buddy_t *alloc;
+    size_t count[BUDDY_EVENT_OVERFLOW + 1];
+};
+
+static void count_event(const struct buddy_trace_event *event, void *p) {
+    struct events *events = p;
+
+    if (event->alloc == events->alloc) events->count[event->event]++;
+}
+#endif
+
+// Failed calls set errno and leave the pool untouched, recording an event for each of them with BUDDY_TRACE
+static buddy_t *test_errors(struct buddy_census *before) {
+    static void *blocks[(size_t)1 << (POOL_LOG2 - POOL_MAX_LOG2)];
+    buddy_t *alloc = new_pool("errors");
+    size_t n = 0;
+
+    #ifdef BUDDY_TRACE
+    struct events events = { .alloc = alloc };
+    buddy_trace_drain(count_event, &(struct events){ 0 });
+    size_t dropped = buddy_trace_dropped();
+    #endif
+    check_pool(alloc, before);
+
+    errno = 0;
+    CHECK(buddy_init_ex(pool, sizeof(pool), POOL_MAX_LOG2, POOL_MIN_LOG2) == NULL && errno == EINVAL);
+    errno = 0;
+    CHECK(buddy_malloc(alloc, sizeof(pool)) == NULL && errno == ENOMEM);
+
+    while (n < sizeof(blocks) / sizeof(blocks[0]) && (blocks[n] = buddy_malloc(alloc, (size_t)1 << POOL_MAX_LOG2)) != NULL) n++;
+    CHECK(n > 0 && n < sizeof(blocks) / sizeof(blocks[0]) && errno == ENOMEM);
+    for (size_t i = 0; i < n; i++) buddy_free(alloc, blocks[i], (size_t)1 << POOL_MAX_LOG2);
+
+    void *p = buddy_malloc(alloc, (size_t)1 << SIZE_LOG2);
+    CHECK(p != NULL);
+    buddy_free(alloc, p, (size_t)1 << SIZE_LOG2);
+    errno = 0;
+    buddy_free_unsized(alloc, p);
+    CHECK(errno == EINVAL);
+    #ifdef BUDDY_LAZY_MERGE
+    // The block is still deferred, which sized and batched frees find in the ring
+    errno = 0;
+    buddy_free(alloc, p, (size_t)1 << SIZE_LOG2);
+    CHECK(errno == EINVAL);
+    errno = 0;
+    buddy_free_batch(alloc, &p, (size_t)1 << SIZE_LOG2, 1);
+    CHECK(errno == EINVAL);
+    #endif
+
+    #ifdef BUDDY_TRACE
+    CHECK(buddy_trace_drain(count_event, &events) > 0);
+    CHECK(events.count[BUDDY_EVENT_ALLOC] == n + 1 && events.count[BUDDY_EVENT_OOM] == 1);
+    #ifdef BUDDY_LAZY_MERGE
+    // Frees are traced before the deferred ring rejects the double frees, and merges wait for buddy_coalesce
+    CHECK(events.count[BUDDY_EVENT_FREE] == n + 4 && events.count[BUDDY_EVENT_INVALID_FREE] == 3);
+    CHECK(events.count[BUDDY_EVENT_SPLIT] > 0);
+    #else
+    CHECK(events.count[BUDDY_EVENT_FREE] == n + 1 && events.count[BUDDY_EVENT_INVALID_FREE] == 1);
+    CHECK(events.count[BUDDY_EVENT_SPLIT] > 0 && events.count[BUDDY_EVENT_SPLIT] == events.count[BUDDY_EVENT_MERGE]);
+    #endif
+    CHECK(buddy_trace_dropped() == dropped);
+    #endif
+    return alloc;
+}
+
+#ifdef BUDDY_RECORD
+// Records a few operations to a file and reads them back
+static buddy_t *test_record(struct buddy_census *before) {
+    char path[] = "/tmp/buddy_record_XXXXXX";
+    static const uint8_t ops[] = {
+        BUDDY_RECORD_MALLOC, BUDDY_RECORD_MALLOC, BUDDY_RECORD_MALLOC, BUDDY_RECORD_REALLOC,
+        BUDDY_RECORD_FREE, BUDDY_RECORD_FREE, BUDDY_RECORD_FREE
+    };
+    struct buddy_record_header header;
+    struct buddy_record record;
+    void *blocks[3];
+    buddy_t *alloc = new_pool("record");
+
+    check_pool(alloc, before);
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd >= 0) close(fd);
+
+    CHECK(buddy_record_start(alloc, path) == 0);
+    errno = 0;
+    CHECK(buddy_record_start(alloc, path) == -1 && errno == EBUSY);
+    for (size_t i = 0; i < 3; i++) blocks[i] = buddy_malloc(alloc, 100);
+    CHECK(buddy_realloc(alloc, blocks[0], 100, 50) == blocks[0]);
+    buddy_free_unsized(alloc, blocks[0]);
+    buddy_free(alloc, blocks[1], 100);
+    buddy_free(alloc, blocks[2], 100);
+    buddy_record_stop();
+
+    FILE *file = fopen(path, "rb");
+    CHECK(file != NULL);
+    if (file == NULL) return alloc;
+
+    CHECK(fread(&header, sizeof(header), 1, file) == 1);
+    CHECK(memcmp(header.magic, BUDDY_RECORD_MAGIC, sizeof(header.magic)) == 0 && header.version == BUDDY_RECORD_VERSION);
+    CHECK(header.record_size == sizeof(record) && header.min_log2 == POOL_MIN_LOG2 && header.max_log2 == POOL_MAX_LOG2);
+    for (size_t i = 0; i < sizeof(ops); i++) {
+        CHECK(fread(&record, sizeof(record), 1, file) == 1 && record.op == ops[i]);
+        if (i == 3) CHECK(record.offset == (uintptr_t)blocks[0] - alloc->base && record.size == 50);
+        if (i == 4) CHECK(record.size == 0);
+    }
+    CHECK(fread(&record, sizeof(record), 1, file) == 0 && buddy_record_dropped() == 0);
+    fclose(file);
+    unlink(path);
+    return alloc;
+}
+#endif
+
+#ifdef BUDDY_HEAP
+#define ARENA_LOG2 20
+
+// Allocates, resizes and frees blocks across several arenas, one of them larger than an arena
+static void *run_heap(void *p) {
+    static void *blocks[BLOCKS / 4];
+    static size_t lengths[BLOCKS / 4];
+    buddy_heap_t *heap = p;
+    uint64_t state = 0x94d049bb133111ebull;
+
+    for (size_t i = 0; i < BLOCKS / 4; i++) {
+        lengths[i] = i == 0 ? (size_t)3 << ARENA_LOG2 : random_size(&state) * 2;
+        blocks[i] = buddy_heap_malloc(heap, lengths[i]);
+        CHECK(blocks[i] != NULL && buddy_heap_usable_size(heap, blocks[i]) >= lengths[i]);
+        if (blocks[i] != NULL) fill(blocks[i], lengths[i]);
+    }
+    CHECK(heap->count > 2);
+
+    for (size_t i = 1; i < BLOCKS / 4; i += 2) {
+        size_t length = lengths[i] * 4;
+        void *q = buddy_heap_realloc(heap, blocks[i], lengths[i], length);
+        CHECK(q != NULL && has_pattern(q, blocks[i], lengths[i]));
+        if (q == NULL) continue;
+
+        blocks[i] = q;
+        lengths[i] = length;
+        fill(q, length);
+    }
+
+    #ifdef BUDDY_CHECKED
+    // A block failing a check is left where it is instead of being moved to another arena
+    void *q = buddy_heap_malloc(heap, 4096);
+    CHECK(q != NULL);
+    errno = 0;
+    CHECK(buddy_heap_realloc(heap, q, 8192, 2048) == NULL && errno == EINVAL);
+    buddy_heap_free(heap, q, 4096);
+    #endif
+
+    for (size_t i = 0; i < BLOCKS / 4; i++) {
+        CHECK(has_pattern(blocks[i], blocks[i], lengths[i]));
+        if (i % 4) buddy_heap_free(heap, blocks[i], lengths[i]);
+        else buddy_heap_free_unsized(heap, blocks[i]);
+    }
+    return NULL;
+}
+
+// Every arena of a heap is fully free once its blocks are freed, so trimming unmaps them all
+static void test_heap(void) {
+    test_name = "heap";
+    buddy_heap_t *heap = buddy_heap_create(ARENA_LOG2, POOL_MIN_LOG2, 0);
+    CHECK(heap != NULL);
+    if (heap == NULL) return;
+
+    #ifdef BUDDY_THREADS
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, run_heap, heap) == 0);
+    pthread_join(thread, NULL);
+    #else
+    run_heap(heap);
+    #endif
+    errno = 0;
+    buddy_heap_free_unsized(heap, pool);
+    CHECK(errno == EINVAL);
+
+    CHECK(buddy_heap_trim(heap) > 0 && heap->count == 0);
+    buddy_heap_destroy(heap);
+}
+#endif
+
+#ifdef BUDDY_THREADS
+#define THREADS 4
+
+struct worker {
+    buddy_t *alloc;
+    uint64_t seed;
+};
+
+// Allocates and frees blocks of random sizes, keeping a few of them live at a time
+static void *run_worker(void *p) {
+    struct worker *w = p;
+    void *blocks[BLOCKS / THREADS] = { 0 };
+    size_t lengths[BLOCKS / THREADS];
+    uint64_t state = w->seed;
+
+    for (size_t n = 0; n < 64 * BLOCKS; n++) {
+        size_t i = next_random(&state) % (BLOCKS / THREADS);
+
+        if (blocks[i] != NULL) {
+            CHECK(has_pattern(blocks[i], blocks[i], lengths[i]));
+            buddy_free(w->alloc, blocks[i], lengths[i]);
+        }
+        lengths[i] = random_size(&state) / 16 + 1;
+        blocks[i] = buddy_malloc(w->alloc, lengths[i]);
+        if (blocks[i] != NULL) fill(blocks[i], lengths[i]);
+    }
+    for (size_t i = 0; i < BLOCKS / THREADS; i++) {
+        if (blocks[i] != NULL) buddy_free_unsized(w->alloc, blocks[i]);
+    }
+    return NULL;
+}
+
+// Threads allocate and free on the same pool at once, mostly from their caches
+static buddy_t *test_threads(struct buddy_census *before) {
+    pthread_t threads[THREADS];
+    struct worker workers[THREADS];
+    buddy_t *alloc = new_pool("threads");
+
+    check_pool(alloc, before);
+    for (int i = 0; i < THREADS; i++) {
+        workers[i] = (struct worker){ alloc, 0x9e3779b97f4a7c15ull * (i + 1) };
+        CHECK(pthread_create(&threads[i], NULL, run_worker, &workers[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    return alloc;
+}
+#endif
+
+#ifdef BUDDY_THREAD_ARENAS
+struct arena_worker {
+    buddy_thread_arenas_t *arenas;
+    void **blocks;
+};
+
+// Allocates blocks from the thread's arena for another thread to free remotely
+static void *run_arena_worker(void *p) {
+    struct arena_worker *w = p;
+
+    for (size_t i = 0; i < BLOCKS / 2; i++) {
+        w->blocks[i] = buddy_thread_malloc(w->arenas, 16 + i);
+        if (w->blocks[i] != NULL) fill(w->blocks[i], 16 + i);
+    }
+    return NULL;
+}
+
+// Frees the blocks of arenas from their owner and from other threads
+static buddy_t *test_thread_arenas(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    pthread_t thread;
+    buddy_t *alloc = new_pool("thread_arenas");
+
+    check_pool(alloc, before);
+    buddy_thread_arenas_t *arenas = buddy_thread_arenas_create(alloc, POOL_MAX_LOG2);
+    CHECK(arenas != NULL);
+
+    struct arena_worker w = { arenas, blocks + BLOCKS / 2 };
+    CHECK(pthread_create(&thread, NULL, run_arena_worker, &w) == 0);
+    for (size_t i = 0; i < BLOCKS / 2; i++) blocks[i] = buddy_thread_malloc(arenas, 16 + i);
+    pthread_join(thread, NULL);
+
+    #ifdef BUDDY_CHECKED
+    CHECK(buddy_thread_leak_report(arenas, NULL, NULL) == BLOCKS);
+    #endif
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (i >= BLOCKS / 2) CHECK(has_pattern(blocks[i], blocks[i], 16 + i - BLOCKS / 2));
+        if (i % 2) buddy_thread_free(arenas, blocks[i], 16 + i % (BLOCKS / 2));
+        else buddy_thread_free_unsized(arenas, blocks[i]);
+    }
+    #ifdef BUDDY_CHECKED
+    // The block is still pending in the remote free list of the arena that allocated it
+    errno = 0;
+    buddy_thread_free(arenas, blocks[BLOCKS / 2 + 1], 17);
+    CHECK(errno == EINVAL);
+    CHECK(buddy_thread_leak_report(arenas, NULL, NULL) == 0);
+    #endif
+
+    buddy_thread_arenas_destroy(arenas);
+    return alloc;
+}
+#endif
+
+#ifndef BUDDY_SLAB
+// Takes a census once the calling thread's cache is back in the pool, which taking a mark sees to
+static void take_census(buddy_t *alloc, struct buddy_census *census) {
+    buddy_mark_t *mark = buddy_mark(alloc);
+    CHECK(mark != NULL);
+    if (mark != NULL) buddy_free_unsized(alloc, mark);
+    check_pool(alloc, census);
+}
+
+// Rolls back nested marks, keeping the blocks allocated before each of them
+static buddy_t *test_mark_release(struct buddy_census *before) {
+    static void *blocks[BLOCKS];
+    struct buddy_census kept, after;
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    buddy_t *alloc = new_pool("mark_release");
+
+    check_pool(alloc, before);
+    for (size_t i = 0; i < BLOCKS / 2; i++) blocks[i] = buddy_malloc(alloc, random_size(&state) / 8 + 1);
+    take_census(alloc, &kept);
+
+    buddy_mark_t *outer = buddy_mark(alloc);
+    CHECK(outer != NULL);
+    for (size_t i = BLOCKS / 2; i < BLOCKS; i++) blocks[i] = buddy_malloc(alloc, random_size(&state) / 8 + 1);
+    buddy_mark_t *inner = buddy_mark(alloc);
+    CHECK(inner != NULL);
+    for (size_t i = BLOCKS / 2; i < BLOCKS; i++) buddy_free_unsized(alloc, blocks[i]);
+    for (size_t i = BLOCKS / 2; i < BLOCKS; i++) blocks[i] = buddy_malloc(alloc, random_size(&state) / 8 + 1);
+    check_pool(alloc, &after);
+
+    CHECK(buddy_release_to(alloc, outer) == 0);
+    take_census(alloc, &after);
+    CHECK(memcmp(&kept, &after, sizeof(after)) == 0);
+
+    for (size_t i = 0; i < BLOCKS / 2; i++) buddy_free_unsized(alloc, blocks[i]);
+    return alloc;
+}
+
+#ifdef BUDDY_THREADS
+struct cache_worker {
+    buddy_t *alloc;
+    pthread_barrier_t *barrier;
+};
+
+// Leaves blocks in the thread's cache while the calling thread takes a mark and rolls it back
+static void *run_cache_worker(void *p) {
+    struct cache_worker *w = p;
+    void *blocks[BLOCKS / 8];
+
+    for (int phase = 0; phase < 2; phase++) {
+        for (size_t i = 0; i < BLOCKS / 8; i++) blocks[i] = buddy_malloc(w->alloc, 16 << (i % 4));
+        for (size_t i = 0; i < BLOCKS / 8; i++) buddy_free(w->alloc, blocks[i], 16 << (i % 4));
+        pthread_barrier_wait(w->barrier);
+        pthread_barrier_wait(w->barrier);
+    }
+    return NULL;
+}
+
+// The caches of other threads must not leak blocks across a mark and its rollback
+static buddy_t *test_mark_threads(struct buddy_census *before) {
+    pthread_barrier_t barrier;
+    pthread_t thread;
+    buddy_t *alloc = new_pool("mark_threads");
+    struct cache_worker w = { alloc, &barrier };
+
+    check_pool(alloc, before);
+    pthread_barrier_init(&barrier, NULL, 2);
+    CHECK(pthread_create(&thread, NULL, run_cache_worker, &w) == 0);
+
+    for (int phase = 0; phase < 2; phase++) {
+        pthread_barrier_wait(&barrier);
+        buddy_mark_t *mark = buddy_mark(alloc);
+        CHECK(mark != NULL);
+        CHECK(buddy_malloc(alloc, 1000) != NULL);
+        CHECK(buddy_release_to(alloc, mark) == 0);
+        pthread_barrier_wait(&barrier);
+    }
+
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&barrier);
+    return alloc;
+}
+#endif
+#endif
+
+#ifdef BUDDY_RELOCATABLE
+// Copies a pool holding blocks to another address, attaches it there and frees the blocks through it
+static buddy_t *test_attach(struct buddy_census *before) {
+    static char moved[sizeof(pool)] __attribute__((aligned(1 << POOL_LOG2)));
+    static void *blocks[BLOCKS];
+    static size_t lengths[BLOCKS];
+    uint64_t state = 0x5851f42d4c957f2dull;
+    buddy_t *alloc = new_pool("attach");
+
+    check_pool(alloc, before);
+    // Blocks held in thread caches would stay allocated, so the sizes skip the cached orders
+    for (size_t i = 0; i < BLOCKS; i++) {
+        lengths[i] = 256 + random_size(&state);
+        blocks[i] = buddy_malloc(alloc, lengths[i]);
+        if (blocks[i] != NULL) fill(blocks[i], lengths[i]);
+    }
+    for (size_t i = 0; i < BLOCKS; i += 2) {
+        if (blocks[i] != NULL) buddy_free(alloc, blocks[i], lengths[i]);
+    }
+
+    errno = 0;
+    CHECK(buddy_attach(moved) == NULL && errno == EINVAL);
+    buddy_destroy(alloc);
+    memcpy(moved, pool, sizeof(pool));
+    memset(pool, 0, sizeof(pool));
+    buddy_t *attached = buddy_attach(moved);
+    CHECK(attached == (buddy_t *)moved);
+    if (attached == NULL) exit(1);
+
+    struct buddy_census census;
+
+    check_pool(attached, &census);
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = blocks[i] != NULL ? moved + ((char *)blocks[i] - pool) : NULL;
+        if (i % 2 == 0) blocks[i] = buddy_malloc(attached, lengths[i]);
+    }
+    for (size_t i = 0; i < BLOCKS; i++) {
+        if (blocks[i] == NULL) continue;
+
+        if (i % 2) CHECK(has_pattern(blocks[i], pool + ((char *)blocks[i] - moved), lengths[i]));
+        if (i % 4 == 1) buddy_free(attached, blocks[i], lengths[i]);
+        else buddy_free_unsized(attached, blocks[i]);
+    }
+    return attached;
+}
+#endif
+
+#ifdef BUDDY_CHECKED
+static void count_leak(void *addr, size_t length, void *ctx) {
+    (void)addr;
+    *(size_t *)ctx += length;
+}
+
+// Double frees, frees with the wrong size and overflows into the slack are rejected and leave the block alone,
+// and the leak report lists the blocks of 1024 bytes still live
+static buddy_t *test_checked(struct buddy_census *before) {
+    enum { COUNT = BLOCKS / 4, LENGTH = 1000 };
+    static char *blocks[COUNT];
+    struct buddy_stats stats;
+    size_t leaked = 0;
+    buddy_t *alloc = new_pool("checked");
+
+    #ifdef BUDDY_TRACE
+    struct events events = { .alloc = alloc };
+    buddy_trace_drain(count_event, &(struct events){ 0 });
+    #endif
+    check_pool(alloc, before);
+    for (size_t i = 0; i < COUNT; i++) CHECK((blocks[i] = buddy_malloc(alloc, LENGTH)) != NULL);
+    CHECK(buddy_leak_report(alloc, count_leak, &leaked) == COUNT && leaked == COUNT * 1024);
+
+    buddy_free(alloc, blocks[0], LENGTH);
+    errno = 0;
+    buddy_free(alloc, blocks[0], LENGTH);
+    CHECK(errno == EINVAL);
+    errno = 0;
+    buddy_free_unsized(alloc, blocks[0]);
+    CHECK(errno == EINVAL);
+
+    errno = 0;
+    buddy_free(alloc, blocks[1], 2 * LENGTH);
+    CHECK(errno == EINVAL);
+    errno = 0;
+    buddy_free(alloc, blocks[1] + 16, LENGTH);
+    CHECK(errno == EINVAL);
+
+    blocks[2][LENGTH] ^= 1;
+    errno = 0;
+    buddy_free(alloc, blocks[2], LENGTH);
+    CHECK(errno == EINVAL);
+
+    buddy_stats(alloc, &stats);
+    CHECK(stats.invalid_frees == 5);
+    CHECK(buddy_leak_report(alloc, NULL, NULL) == COUNT - 1);
+    #ifdef BUDDY_TRACE
+    buddy_trace_drain(count_event, &events);
+    CHECK(events.count[BUDDY_EVENT_INVALID_FREE] == 4 && events.count[BUDDY_EVENT_OVERFLOW] == 1);
+    #endif
+
+    // Without a length the overflowed block can still be freed
+    buddy_free_unsized(alloc, blocks[2]);
+    for (size_t i = 1; i < COUNT; i++) {
+        if (i != 2) buddy_free(alloc, blocks[i], LENGTH);
+    }
+    buddy_stats(alloc, &stats);
+    CHECK(stats.invalid_frees == 5);
+    CHECK(buddy_leak_report(alloc, NULL, NULL) == 0);
+    return alloc;
+}
+#endif
+
+// Short-lived blocks are placed below long-lived ones, and both are freed as any other block
+static buddy_t *test_hint(struct buddy_census *before) {
+    enum { COUNT = BLOCKS / 8, LENGTH = 4096 };
+    static char *blocks[2][COUNT];
+    buddy_t *alloc = new_pool("hint");
+
+    check_pool(alloc, before);
+    errno = 0;
+    CHECK(buddy_malloc_hint(alloc, LENGTH, BUDDY_HINT_SHORT_LIVED | BUDDY_HINT_LONG_LIVED) == NULL && errno == EINVAL);
+    for (size_t i = 0; i < COUNT; i++) {
+        CHECK((blocks[0][i] = buddy_malloc_hint(alloc, LENGTH, BUDDY_HINT_SHORT_LIVED)) != NULL);
+        CHECK((blocks[1][i] = buddy_malloc_hint(alloc, LENGTH, BUDDY_HINT_LONG_LIVED)) != NULL);
+    }
+
+    // Hints are ignored with BUDDY_ATOMIC, and the blocks past the lazy frontier are not searched
+    #if !defined(BUDDY_ATOMIC) && !defined(BUDDY_LAZY)
+    for (size_t i = 0; i < COUNT; i++) {
+        for (size_t j = 0; j < COUNT; j++) CHECK(blocks[0][i] < blocks[1][j]);
+    }
+    #endif
+
+    for (size_t i = 0; i < COUNT; i++) {
+        buddy_free(alloc, blocks[0][i], LENGTH);
+        buddy_free_unsized(alloc, blocks[1][i]);
+    }
+    return alloc;
+}
+
+// Resetting frees every block at once, leaving the pool as it was initialized
+static buddy_t *test_reset(struct buddy_census *before) {
+    uint64_t state = 0x2b992ddfa23249d6ull;
+    struct buddy_stats stats;
+    buddy_t *alloc = new_pool("reset");
+
+    check_pool(alloc, before);
+    for (int round = 0; round < 2; round++) {
+        for (size_t i = 0; i < BLOCKS; i++) buddy_malloc(alloc, random_size(&state));
+        CHECK(buddy_reset(alloc) == 0);
+        buddy_stats(alloc, &stats);
+        CHECK(stats.bytes_in_use == 0 && stats.peak_bytes_in_use > 0);
+        check_settled(alloc, before);
+    }
+    return alloc;
+}
+
+int main(void) {
+    run_test(test_alloc_free);
+    run_test(test_geometry);
+    run_test(test_exhaust);
+    run_test(test_realloc);
+    #ifdef BUDDY_SLAB
+    run_test(test_slab);
+    #endif
+    #ifdef BUDDY_TRIM
+    run_test(test_trimmed);
+    #endif
+    #ifdef BUDDY_PURGE
+    run_test(test_purge);
+    #endif
+    #if defined(BUDDY_TREE_ONLY) || defined(BUDDY_ADDRESS_ORDERED)
+    run_test(test_lowest);
+    #endif
+    #ifdef BUDDY_LAZY_MERGE
+    run_test(test_coalesce);
+    #endif
+    run_test(test_batch);
+    run_test(test_aligned);
+    run_test(test_oob);
+    #ifdef BUDDY_LAZY
+    run_test(test_zeroed);
+    #endif
+    run_test(test_errors);
+    run_test(test_stats);
+    #ifdef BUDDY_RECORD
+    run_test(test_record);
+    #endif
+    #ifdef BUDDY_THREADS
+    run_test(test_threads);
+    #endif
+
+    #ifndef BUDDY_SLAB
+    run_test(test_mark_release);
+    #ifdef BUDDY_THREADS
+    run_test(test_mark_threads);
+    #endif
+    #endif
+    run_test(test_hint);
+    run_test(test_reset);
+    #ifdef BUDDY_RELOCATABLE
+    run_test(test_attach);
+    #endif
+    #ifdef BUDDY_CHECKED
+    run_test(test_checked);
+    #endif
+    #ifdef BUDDY_THREAD_ARENAS
+    run_test(test_thread_arenas);
+    #endif
+    #ifdef BUDDY_HEAP
+    test_heap();
+    #endif
+
+    if (failures) fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
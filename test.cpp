@@ -0,0 +1,151 @@
+/* Round-trip tests for the C++ front end in buddy.hpp, run by make test
+ * against buddy.c built as C without any flags.
+ *
+ * Each test allocates through one of the wrappers, checks the size and
+ * alignment of what it gets, and checks that the pool has no bytes in use
+ * once everything is freed again.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+#include "buddy.hpp"
+
+#define POOL_LOG2 22
+#define POOL_MIN_LOG2 4
+#define POOL_MAX_LOG2 18
+
+alignas(1 << POOL_LOG2) static char pool[(size_t)1 << POOL_LOG2];
+
+using pool_allocator = buddy_allocator<POOL_MIN_LOG2, POOL_MAX_LOG2, POOL_LOG2>;
+
+static_assert(pool_allocator::order(1) == 0 && pool_allocator::order(16) == 0 && pool_allocator::order(17) == 1, "");
+static_assert(pool_allocator::block_size(pool_allocator::order(1000)) == 1024, "");
+static_assert(pool_allocator::orders == POOL_MAX_LOG2 - POOL_MIN_LOG2 + 1, "");
+static_assert(pool_allocator::fits(pool_allocator::max_block_size) && !pool_allocator::fits(pool_allocator::max_block_size + 1), "");
+
+// Aligned beyond std::max_align_t, so the adaptors allocate it with buddy_aligned_alloc
+struct alignas(256) wide {
+    unsigned char bytes[256];
+};
+
+static const char *test_name;
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__, test_name, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static bool is_aligned(const void *p, size_t align) {
+    return reinterpret_cast<uintptr_t>(p) % align == 0;
+}
+
+static void check_settled(pool_allocator &alloc) {
+    struct buddy_stats stats;
+
+    alloc.stats(&stats);
+    CHECK(stats.bytes_in_use == 0);
+}
+
+// The class wraps the C API for a pool of fixed geometry
+static void test_allocator() {
+    test_name = "allocator";
+    pool_allocator alloc(pool);
+
+    void *p = alloc.malloc(1000);
+    CHECK(p != nullptr && alloc.usable_size(p) == pool_allocator::block_size(pool_allocator::order(1000)));
+    memset(p, 1, 1000);
+    p = alloc.realloc(p, 1000, 3000);
+    CHECK(p != nullptr && static_cast<unsigned char *>(p)[999] == 1);
+    alloc.free(p, 3000);
+
+    void *q = alloc.malloc<pool_allocator::max_block_size>();
+    CHECK(q != nullptr && is_aligned(q, pool_allocator::max_block_size));
+    alloc.free(q);
+
+    void *r = alloc.aligned_alloc(4096, 100);
+    CHECK(r != nullptr && is_aligned(r, 4096));
+    alloc.aligned_free(r, 4096, 100);
+
+    CHECK(alloc.malloc(pool_allocator::max_block_size + 1) == nullptr);
+    check_settled(alloc);
+}
+
+// Containers of the standard library allocate through a memory resource of the pool
+static void test_memory_resource() {
+    test_name = "memory_resource";
+    pool_allocator alloc(pool);
+    buddy_memory_resource resource(alloc);
+    buddy_memory_resource other(alloc.native());
+
+    CHECK(resource.is_equal(other) && !resource.is_equal(*std::pmr::new_delete_resource()));
+    {
+        std::pmr::vector<int> numbers(&resource);
+        for (int i = 0; i < 10000; i++) numbers.push_back(i);
+        CHECK(numbers[9999] == 9999);
+
+        std::pmr::vector<wide> wides(&resource);
+        for (int i = 0; i < 100; i++) wides.push_back(wide());
+        CHECK(is_aligned(wides.data(), alignof(wide)));
+
+        void *p = resource.allocate(100, 4096);
+        CHECK(is_aligned(p, 4096));
+        resource.deallocate(p, 100, 4096);
+    }
+
+    bool thrown = false;
+    try {
+        void *p = resource.allocate(pool_allocator::max_block_size + 1);
+        resource.deallocate(p, pool_allocator::max_block_size + 1);
+    } catch (const std::bad_alloc &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    check_settled(alloc);
+}
+
+// Containers take the pool as an allocator, rebinding it to the types they allocate
+static void test_stl_allocator() {
+    test_name = "stl_allocator";
+    pool_allocator alloc(pool);
+    buddy_stl_allocator<int> ints(alloc);
+    buddy_stl_allocator<wide> wides(ints);
+
+    CHECK(ints == wides && !(ints != wides) && wides.native() == alloc.native());
+    {
+        std::vector<int, buddy_stl_allocator<int>> numbers(ints);
+        for (int i = 0; i < 10000; i++) numbers.push_back(i);
+        CHECK(numbers[9999] == 9999);
+
+        std::vector<wide, buddy_stl_allocator<wide>> blocks(wides);
+        for (int i = 0; i < 100; i++) {
+            blocks.push_back(wide());
+            CHECK(is_aligned(blocks.data(), alignof(wide)));
+        }
+    }
+
+    bool thrown = false;
+    try {
+        wide *p = wides.allocate(pool_allocator::max_block_size / sizeof(wide) + 1);
+        wides.deallocate(p, pool_allocator::max_block_size / sizeof(wide) + 1);
+    } catch (const std::bad_alloc &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    check_settled(alloc);
+}
+
+int main() {
+    test_allocator();
+    test_memory_resource();
+    test_stl_allocator();
+
+    if (failures) fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}